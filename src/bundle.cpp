@@ -0,0 +1,382 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bundle.hpp"
+#include "markers.hpp"
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstring>
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+namespace Transfuse {
+
+// The last byte is the format version
+constexpr char bundle_magic[8] = { 'T', 'F', 'S', 'B', '\0', '\0', '\0', '\2' };
+
+enum Section {
+	sec_original,
+	sec_skeleton,
+	sec_info,
+	sec_styles,
+	sec_blocks,
+	sec_block_ids,
+	num_sections
+};
+
+// All integers are little-endian, so a bundle can move between machines
+// Header is the magic followed by offset and size of each section
+// Tables are a count, the offset of each row, and the rows, where each field is a 32 bit length and the bytes
+// Block rows are in document order, and the block_ids section is the block numbers sorted by id
+constexpr size_t bundle_header = sizeof(bundle_magic) + num_sections * 2 * sizeof(uint64_t);
+
+inline void put_u64(std::string& s, size_t v) {
+	auto le = to_little_endian(UI64(v));
+	s.append(reinterpret_cast<const char*>(&le), sizeof(le));
+}
+
+inline void patch_u64(std::string& s, size_t off, size_t v) {
+	auto le = to_little_endian(UI64(v));
+	memcpy(&s[off], &le, sizeof(le));
+}
+
+inline void put_u32(std::string& s, size_t v) {
+	auto le = to_little_endian(UI32(v));
+	s.append(reinterpret_cast<const char*>(&le), sizeof(le));
+}
+
+struct Bundle::impl {
+	fs::path fn;
+	const char* map = nullptr;
+	size_t size = 0;
+	std::string owned;
+	std::array<std::pair<size_t, size_t>, num_sections> secs{};
+
+	~impl() {
+#ifndef _WIN32
+		if (map && owned.empty()) {
+			munmap(const_cast<char*>(map), size);
+		}
+#endif
+	}
+
+	[[noreturn]] void corrupt() {
+		throw std::runtime_error(concat("Corrupt state bundle: ", fn.string()));
+	}
+
+	size_t u64(size_t off) {
+		if (off + sizeof(uint64_t) > size) {
+			corrupt();
+		}
+		uint64_t v = 0;
+		memcpy(&v, map + off, sizeof(v));
+		return SZ(to_little_endian(v));
+	}
+
+	size_t u32(size_t off) {
+		if (off + sizeof(uint32_t) > size) {
+			corrupt();
+		}
+		uint32_t v = 0;
+		memcpy(&v, map + off, sizeof(v));
+		return SZ(to_little_endian(v));
+	}
+
+	std::string_view field(size_t& off) {
+		auto n = u32(off);
+		off += sizeof(uint32_t);
+		if (off + n > size) {
+			corrupt();
+		}
+		std::string_view rv{ map + off, n };
+		off += n;
+		return rv;
+	}
+
+	std::string_view section(Section sec) {
+		return { map + secs[sec].first, secs[sec].second };
+	}
+
+	size_t rows(Section sec) {
+		return u64(secs[sec].first);
+	}
+
+	size_t row(Section sec, size_t i) {
+		if (i >= rows(sec)) {
+			corrupt();
+		}
+		return u64(secs[sec].first + (i + 1) * sizeof(uint64_t));
+	}
+
+	// Binary search on the first fields of a sorted table
+	template<typename... Keys>
+	size_t find(Section sec, Keys... keys) {
+		std::array<std::string_view, sizeof...(keys)> want{ keys... };
+		size_t b = 0;
+		size_t e = rows(sec);
+		while (b < e) {
+			auto m = b + (e - b) / 2;
+			auto off = row(sec, m);
+			int cmp = 0;
+			for (auto& w : want) {
+				cmp = field(off).compare(w);
+				if (cmp != 0) {
+					break;
+				}
+			}
+			if (cmp == 0) {
+				return row(sec, m);
+			}
+			if (cmp < 0) {
+				b = m + 1;
+			}
+			else {
+				e = m;
+			}
+		}
+		return 0;
+	}
+
+	Block block(size_t off) {
+		Block rv;
+		rv.id = field(off);
+		rv.key = field(off);
+		rv.body = field(off);
+		return rv;
+	}
+};
+
+Bundle::Bundle(const fs::path& fn)
+  : s(std::make_unique<impl>())
+{
+	s->fn = fn;
+#ifndef _WIN32
+	auto fd = open(fn.string().c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(concat("Could not open state bundle: ", fn.string()));
+	}
+	struct stat st {};
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error(concat("Could not stat state bundle: ", fn.string()));
+	}
+	if (st.st_size > 0) {
+		auto p = mmap(nullptr, SZ(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error(concat("Could not map state bundle: ", fn.string()));
+		}
+		s->map = static_cast<const char*>(p);
+		s->size = SZ(st.st_size);
+	}
+	close(fd);
+#else
+	s->owned = file_load(fn);
+	s->map = s->owned.data();
+	s->size = s->owned.size();
+#endif
+
+	if (s->size < bundle_header || memcmp(s->map, bundle_magic, sizeof(bundle_magic) - 1) != 0) {
+		throw std::runtime_error(concat("Not a Transfuse state bundle: ", fn.string()));
+	}
+	if (s->map[sizeof(bundle_magic) - 1] != bundle_magic[sizeof(bundle_magic) - 1]) {
+		throw std::runtime_error(concat("Unsupported state bundle version: ", fn.string()));
+	}
+	for (size_t i = 0; i < num_sections; ++i) {
+		auto off = sizeof(bundle_magic) + i * 2 * sizeof(uint64_t);
+		s->secs[i] = { s->u64(off), s->u64(off + sizeof(uint64_t)) };
+		if (s->secs[i].first > s->size || s->secs[i].second > s->size - s->secs[i].first) {
+			s->corrupt();
+		}
+	}
+	for (auto sec : { sec_info, sec_styles, sec_blocks }) {
+		if (s->secs[sec].second < sizeof(uint64_t) || (s->secs[sec].second - sizeof(uint64_t)) / sizeof(uint64_t) < s->rows(sec)) {
+			s->corrupt();
+		}
+	}
+	if (s->secs[sec_block_ids].second != s->rows(sec_blocks) * sizeof(uint32_t)) {
+		s->corrupt();
+	}
+}
+
+Bundle::~Bundle() {
+}
+
+std::string_view Bundle::original() {
+	return s->section(sec_original);
+}
+
+std::string_view Bundle::skeleton() {
+	return s->section(sec_skeleton);
+}
+
+std::string_view Bundle::info(std::string_view key) {
+	if (auto off = s->find(sec_info, key)) {
+		s->field(off);
+		return s->field(off);
+	}
+	return {};
+}
+
+std::tuple<std::string_view, std::string_view, std::string_view> Bundle::style(std::string_view tag, std::string_view hash) {
+	if (auto off = s->find(sec_styles, tag, hash)) {
+		s->field(off);
+		s->field(off);
+		auto otag = s->field(off);
+		auto ctag = s->field(off);
+		auto flags = s->field(off);
+		return { otag, ctag, flags };
+	}
+	return {};
+}
+
+size_t Bundle::blocks() {
+	return s->rows(sec_blocks);
+}
+
+Bundle::Block Bundle::block(size_t i) {
+	return s->block(s->row(sec_blocks, i));
+}
+
+bool Bundle::block(std::string_view id, Block& blk) {
+	auto ids = s->secs[sec_block_ids].first;
+	size_t b = 0;
+	size_t e = blocks();
+	while (b < e) {
+		auto m = b + (e - b) / 2;
+		blk = block(s->u32(ids + m * sizeof(uint32_t)));
+		auto cmp = blk.id.compare(id);
+		if (cmp == 0) {
+			return true;
+		}
+		if (cmp < 0) {
+			b = m + 1;
+		}
+		else {
+			e = m;
+		}
+	}
+	return false;
+}
+
+void Bundle::write(const fs::path& fn, std::string_view original, std::string_view skeleton, std::vector<Row> info, std::vector<Row> styles, const std::vector<Row>& blocks) {
+	std::string out;
+	out.reserve(bundle_header + original.size() + skeleton.size() * 2);
+	out.append(bundle_magic, sizeof(bundle_magic));
+	out.resize(bundle_header);
+
+	auto section = [&](Section sec, size_t b) {
+		auto off = sizeof(bundle_magic) + SZ(sec) * 2 * sizeof(uint64_t);
+		patch_u64(out, off, b);
+		patch_u64(out, off + sizeof(uint64_t), out.size() - b);
+	};
+
+	auto b = out.size();
+	out += original;
+	section(sec_original, b);
+
+	b = out.size();
+	out += skeleton;
+	section(sec_skeleton, b);
+
+	auto table = [&](Section sec, std::vector<Row>& rows, size_t key_fields) {
+		std::sort(rows.begin(), rows.end(), [&](const Row& a, const Row& b) {
+			return std::lexicographical_compare(a.begin(), a.begin() + PD(key_fields), b.begin(), b.begin() + PD(key_fields));
+		});
+		auto b = out.size();
+		put_u64(out, rows.size());
+		out.resize(out.size() + rows.size() * sizeof(uint64_t));
+		for (size_t i = 0; i < rows.size(); ++i) {
+			patch_u64(out, b + (i + 1) * sizeof(uint64_t), out.size());
+			for (auto& f : rows[i]) {
+				put_u32(out, f.size());
+				out += f;
+			}
+		}
+		section(sec, b);
+	};
+	table(sec_info, info, 1);
+	table(sec_styles, styles, 2);
+
+	// Find every block in the skeleton, in document order
+	std::unordered_map<std::string_view, const Row*> by_id;
+	for (auto& row : blocks) {
+		by_id[row[0]] = &row;
+	}
+
+	std::vector<std::string_view> found;
+	MarkerScanner scan(skeleton);
+	Marker m;
+	while (scan.next(m)) {
+		if (m.kind != marker_kind(TFB_OPEN_B)) {
+			continue;
+		}
+		auto ib = scan.pos;
+		auto ie = scan.skip_to(marker_kind(TFB_OPEN_E));
+		if (ie == std::string_view::npos) {
+			break;
+		}
+		found.push_back(skeleton.substr(ib, ie - ib));
+	}
+
+	b = out.size();
+	put_u64(out, found.size());
+	out.resize(out.size() + found.size() * sizeof(uint64_t));
+	for (size_t i = 0; i < found.size(); ++i) {
+		patch_u64(out, b + (i + 1) * sizeof(uint64_t), out.size());
+		put_u32(out, found[i].size());
+		out += found[i];
+		std::string_view key;
+		std::string_view body;
+		if (auto it = by_id.find(found[i]); it != by_id.end()) {
+			key = (*it->second)[1];
+			body = (*it->second)[2];
+		}
+		put_u32(out, key.size());
+		out += key;
+		put_u32(out, body.size());
+		out += body;
+	}
+	section(sec_blocks, b);
+
+	std::vector<uint32_t> ids(found.size());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		ids[i] = UI32(i);
+	}
+	std::sort(ids.begin(), ids.end(), [&](auto a, auto b) {
+		return found[a] < found[b];
+	});
+	b = out.size();
+	for (auto i : ids) {
+		put_u32(out, i);
+	}
+	section(sec_block_ids, b);
+
+	// Write to the side and rename, so a reader never sees half a bundle
+	auto tmp = fn;
+	tmp += ".tmp";
+	file_save(tmp, out);
+	fs::rename(tmp, fn);
+}
+
+}
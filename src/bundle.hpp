@@ -0,0 +1,66 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_BUNDLE_HPP_
+#define e5bd51be_BUNDLE_HPP_
+
+#include "filesystem.hpp"
+#include "shared.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <tuple>
+#include <memory>
+
+namespace Transfuse {
+
+// Everything injection needs from a state folder in one versioned file: the original document, the skeleton with block markers, and the info, styles, and blocks tables.
+// The file is mmap()ed and read in place, so opening it costs the same for any document size, and moving state elsewhere is a single file copy.
+struct Bundle {
+	struct Block {
+		std::string_view id;
+		std::string_view key;
+		std::string_view body;
+	};
+	using Row = std::vector<std::string_view>;
+
+	Bundle(const fs::path&);
+	~Bundle();
+
+	std::string_view original();
+	std::string_view skeleton();
+	// Returns empty if not found. Views stay valid until the bundle is destroyed.
+	std::string_view info(std::string_view key);
+	std::tuple<std::string_view, std::string_view, std::string_view> style(std::string_view tag, std::string_view hash);
+
+	// Blocks are numbered in document order
+	size_t blocks();
+	Block block(size_t i);
+	bool block(std::string_view id, Block&);
+
+	// Info rows are key, value. Style rows are tag, hash, otag, ctag, flags. Block rows are id, key, body, and blocks not in the skeleton are left out.
+	static void write(const fs::path&, std::string_view original, std::string_view skeleton, std::vector<Row> info, std::vector<Row> styles, const std::vector<Row>& blocks);
+
+protected:
+	struct impl;
+	std::unique_ptr<impl> s;
+};
+
+}
+
+#endif
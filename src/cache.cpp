@@ -0,0 +1,428 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache.hpp"
+#include "base64.hpp"
+#include <xxhash.h>
+#include <map>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#ifndef _WIN32
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+namespace Transfuse {
+
+constexpr char tm_magic[8] = { 'T', 'F', 'T', 'M', '\0', '\0', '\0', '\1' };
+constexpr uint64_t tm_min_slots = 1024;
+
+struct tm_header {
+	char magic[8];
+	uint64_t slots;
+	uint64_t count;
+	uint64_t end;
+};
+
+struct tm_slot {
+	uint64_t hash;
+	// Offset of the record from start of file, or 0 if the slot is empty
+	uint64_t offset;
+};
+
+// Followed by klen bytes of key and vlen bytes of value, padded to 8 bytes
+struct tm_record {
+	uint32_t klen;
+	uint32_t vlen;
+};
+
+inline size_t tm_heap(uint64_t slots) {
+	return sizeof(tm_header) + SZ(slots) * sizeof(tm_slot);
+}
+
+inline size_t tm_record_size(size_t klen, size_t vlen) {
+	return (sizeof(tm_record) + klen + vlen + 7) & ~size_t(7);
+}
+
+inline uint64_t tm_hash(std::string_view key) {
+	return UI64(XXH64(key.data(), key.size(), 0));
+}
+
+#ifndef _WIN32
+
+struct TMCache::impl {
+	fs::path fn;
+	bool rw = false;
+	int fd = -1;
+	char* map = nullptr;
+	size_t size = 0;
+	std::map<std::string, std::string> pending;
+
+	~impl() {
+		unmap();
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	tm_header* header() {
+		return reinterpret_cast<tm_header*>(map);
+	}
+
+	tm_slot* slots() {
+		return reinterpret_cast<tm_slot*>(map + sizeof(tm_header));
+	}
+
+	[[noreturn]] void corrupt() {
+		throw std::runtime_error(concat("Corrupt cache file: ", fn.string()));
+	}
+
+	// Slot offsets and record lengths come from the file, so they are checked against its size before anything is read through them
+	tm_record* record(uint64_t off) {
+		if (off < tm_heap(header()->slots) || off > size || size - off < sizeof(tm_record)) {
+			corrupt();
+		}
+		auto r = reinterpret_cast<tm_record*>(map + off);
+		if (UI64(r->klen) + r->vlen > size - off - sizeof(tm_record)) {
+			corrupt();
+		}
+		return r;
+	}
+
+	std::string_view rec_key(uint64_t off) {
+		auto r = record(off);
+		return { map + off + sizeof(tm_record), r->klen };
+	}
+
+	std::string_view rec_value(uint64_t off) {
+		auto r = record(off);
+		return { map + off + sizeof(tm_record) + r->klen, r->vlen };
+	}
+
+	void unmap() {
+		if (map) {
+			munmap(map, size);
+		}
+		map = nullptr;
+		size = 0;
+	}
+
+	void remap() {
+		unmap();
+		struct stat st {};
+		if (fstat(fd, &st) != 0) {
+			throw std::runtime_error(concat("Could not stat cache file: ", fn.string()));
+		}
+		if (SZ(st.st_size) < sizeof(tm_header)) {
+			return;
+		}
+		auto p = mmap(nullptr, SZ(st.st_size), rw ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			throw std::runtime_error(concat("Could not map cache file: ", fn.string()));
+		}
+		map = static_cast<char*>(p);
+		size = SZ(st.st_size);
+
+		auto hdr = header();
+		if (memcmp(hdr->magic, tm_magic, sizeof(tm_magic)) != 0) {
+			throw std::runtime_error(concat("Not a Transfuse cache file: ", fn.string()));
+		}
+		if (hdr->slots < tm_min_slots || (hdr->slots & (hdr->slots - 1)) || hdr->slots > size / sizeof(tm_slot) || tm_heap(hdr->slots) > size || hdr->end > size || hdr->count > hdr->slots / 2) {
+			corrupt();
+		}
+	}
+
+	// Returns the slot holding the key, or the empty slot where it would go
+	// A sound table is never more than half full, but one read from a damaged file may have no empty slot, so the probe stops after going all the way round
+	tm_slot* find(tm_slot* table, uint64_t nslots, uint64_t hash, std::string_view key) {
+		auto mask = nslots - 1;
+		auto i = hash & mask;
+		for (uint64_t n = 0; n < nslots; ++n, i = (i + 1) & mask) {
+			auto& slot = table[i];
+			if (slot.offset == 0) {
+				return &slot;
+			}
+			if (slot.hash == hash && rec_key(slot.offset) == key) {
+				return &slot;
+			}
+		}
+		corrupt();
+	}
+
+	// Rewrites the file with a table of the given size, compacting away replaced records
+	void rebuild(uint64_t nslots) {
+		std::string img(tm_heap(nslots), '\0');
+		tm_header hdr{};
+		memcpy(hdr.magic, tm_magic, sizeof(tm_magic));
+		hdr.slots = nslots;
+
+		if (map) {
+			auto old = slots();
+			for (uint64_t i = 0; i < header()->slots; ++i) {
+				if (old[i].offset == 0) {
+					continue;
+				}
+				auto k = rec_key(old[i].offset);
+				auto v = rec_value(old[i].offset);
+				auto off = img.size();
+				img.resize(off + tm_record_size(k.size(), v.size()));
+				tm_record r{ static_cast<uint32_t>(k.size()), static_cast<uint32_t>(v.size()) };
+				memcpy(&img[off], &r, sizeof(r));
+				memcpy(&img[off + sizeof(r)], k.data(), k.size());
+				memcpy(&img[off + sizeof(r) + k.size()], v.data(), v.size());
+
+				auto table = reinterpret_cast<tm_slot*>(&img[sizeof(tm_header)]);
+				for (auto j = old[i].hash & (nslots - 1);; j = (j + 1) & (nslots - 1)) {
+					if (table[j].offset == 0) {
+						table[j] = { old[i].hash, off };
+						break;
+					}
+				}
+				++hdr.count;
+			}
+		}
+		hdr.end = img.size();
+		memcpy(&img[0], &hdr, sizeof(hdr));
+
+		// Written to the side, synced and renamed over the file while the lock is held, so a crash or a full disk leaves the old cache as it was
+		// Only the holder of the exclusive lock rebuilds, so the side file's name can't clash
+		auto tmp = fn;
+		tmp += ".tmp";
+		auto tfd = open(tmp.string().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (tfd < 0) {
+			throw std::runtime_error(concat("Could not create cache file: ", tmp.string()));
+		}
+		try {
+			struct stat st {};
+			if (fstat(fd, &st) == 0) {
+				fchmod(tfd, st.st_mode & 07777);
+			}
+			size_t w = 0;
+			while (w < img.size()) {
+				auto n = pwrite(tfd, img.data() + w, img.size() - w, static_cast<off_t>(w));
+				if (n <= 0) {
+					throw std::runtime_error(concat("Could not write cache file: ", tmp.string()));
+				}
+				w += SZ(n);
+			}
+			if (fsync(tfd) != 0) {
+				throw std::runtime_error(concat("Could not sync cache file: ", tmp.string()));
+			}
+			// Nobody else can know of the new file yet, so this lock is had at once, and the file is never unlocked between the rename and the end of the commit
+			if (flock(tfd, LOCK_EX) != 0) {
+				throw std::runtime_error(concat("Could not lock cache file: ", tmp.string()));
+			}
+			if (rename(tmp.string().c_str(), fn.string().c_str()) != 0) {
+				throw std::runtime_error(concat("Could not replace cache file: ", fn.string()));
+			}
+		}
+		catch (...) {
+			close(tfd);
+			unlink(tmp.string().c_str());
+			throw;
+		}
+
+		// Closing the old file releases its lock, and anyone who was waiting for it will see that it is no longer the cache and open it anew
+		unmap();
+		close(fd);
+		fd = tfd;
+		remap();
+	}
+
+	// Locks the file, and if it was replaced by a rebuild while waiting, opens and locks the one that replaced it instead
+	void lock(int op) {
+		for (;;) {
+			if (flock(fd, op) != 0) {
+				throw std::runtime_error(concat("Could not lock cache file: ", fn.string()));
+			}
+			struct stat have {};
+			struct stat want {};
+			if (fstat(fd, &have) != 0) {
+				throw std::runtime_error(concat("Could not stat cache file: ", fn.string()));
+			}
+			if (stat(fn.string().c_str(), &want) == 0 && have.st_dev == want.st_dev && have.st_ino == want.st_ino) {
+				return;
+			}
+			auto nfd = open(fn.string().c_str(), rw ? (O_RDWR | O_CREAT) : O_RDONLY, 0666);
+			if (nfd < 0) {
+				throw std::runtime_error(concat("Could not open cache file: ", fn.string()));
+			}
+			close(fd);
+			fd = nfd;
+		}
+	}
+};
+
+TMCache::TMCache(const fs::path& fn, bool rw)
+  : s(std::make_unique<impl>())
+{
+	s->fn = fn;
+	s->rw = rw;
+	s->fd = open(fn.string().c_str(), rw ? (O_RDWR | O_CREAT) : O_RDONLY, 0666);
+	if (s->fd < 0) {
+		if (!rw && errno == ENOENT) {
+			// A cache that doesn't exist yet is simply empty
+			return;
+		}
+		throw std::runtime_error(concat("Could not open cache file: ", fn.string()));
+	}
+	if (!rw) {
+		s->lock(LOCK_SH);
+		s->remap();
+	}
+}
+
+TMCache::~TMCache() {
+}
+
+std::string_view TMCache::get(std::string_view key) {
+	if (!s->map) {
+		return {};
+	}
+	auto slot = s->find(s->slots(), s->header()->slots, tm_hash(key), key);
+	if (slot->offset == 0) {
+		return {};
+	}
+	return s->rec_value(slot->offset);
+}
+
+void TMCache::put(std::string_view key, std::string_view value) {
+	s->pending[std::string(key)] = value;
+}
+
+size_t TMCache::commit() {
+	if (s->pending.empty()) {
+		return 0;
+	}
+	s->lock(LOCK_EX);
+	// Unlock however this ends, so a failed commit doesn't keep other users of the file waiting
+	// A rebuild may have swapped the file out from under us, so it's whatever file is open by then that gets unlocked
+	struct unlock {
+		int& fd;
+		~unlock() {
+			flock(fd, LOCK_UN);
+		}
+	} unlocker{ s->fd };
+	s->remap();
+	if (!s->map) {
+		s->rebuild(tm_min_slots);
+	}
+
+	// Grow the table once up front, so that it stays at most half full
+	size_t bytes = 0;
+	uint64_t fresh = 0;
+	for (auto& kv : s->pending) {
+		bytes += tm_record_size(kv.first.size(), kv.second.size());
+		if (s->find(s->slots(), s->header()->slots, tm_hash(kv.first), kv.first)->offset == 0) {
+			++fresh;
+		}
+	}
+	auto nslots = s->header()->slots;
+	while ((s->header()->count + fresh) * 2 > nslots) {
+		nslots *= 2;
+	}
+	if (nslots != s->header()->slots) {
+		s->rebuild(nslots);
+	}
+
+	// Append the records to the heap, then point the slots at them; replaced records are left for the next rebuild to drop
+	// The records are written with pwrite() rather than through the map, so that running out of disk space is an error instead of a SIGBUS
+	auto end = s->header()->end;
+	std::string recs(bytes, '\0');
+	size_t off = 0;
+	for (auto& kv : s->pending) {
+		tm_record r{ static_cast<uint32_t>(kv.first.size()), static_cast<uint32_t>(kv.second.size()) };
+		memcpy(&recs[off], &r, sizeof(r));
+		memcpy(&recs[off + sizeof(r)], kv.first.data(), kv.first.size());
+		memcpy(&recs[off + sizeof(r) + kv.first.size()], kv.second.data(), kv.second.size());
+		off += tm_record_size(kv.first.size(), kv.second.size());
+	}
+	s->unmap();
+	size_t w = 0;
+	while (w < recs.size()) {
+		auto n = pwrite(s->fd, recs.data() + w, recs.size() - w, static_cast<off_t>(end + w));
+		if (n <= 0) {
+			// Whatever made it to the file is past the end the header knows of, so the cache is still sound
+			throw std::runtime_error(concat("Could not write cache file: ", s->fn.string()));
+		}
+		w += SZ(n);
+	}
+	s->remap();
+
+	for (auto& kv : s->pending) {
+		auto hash = tm_hash(kv.first);
+		auto slot = s->find(s->slots(), s->header()->slots, hash, kv.first);
+		if (slot->offset == 0) {
+			++s->header()->count;
+		}
+		slot->hash = hash;
+		slot->offset = end;
+		end += tm_record_size(kv.first.size(), kv.second.size());
+	}
+	s->header()->end = end;
+
+	auto rv = s->pending.size();
+	s->pending.clear();
+	s->unmap();
+	return rv;
+}
+
+#else
+
+struct TMCache::impl {
+};
+
+TMCache::TMCache(const fs::path&, bool) {
+	throw std::runtime_error("Translation cache is not supported on this platform");
+}
+
+TMCache::~TMCache() {
+}
+
+std::string_view TMCache::get(std::string_view) {
+	return {};
+}
+
+void TMCache::put(std::string_view, std::string_view) {
+}
+
+size_t TMCache::commit() {
+	return 0;
+}
+
+#endif
+
+std::string TMCache::key(std::string_view pair, std::string_view body) {
+	std::string buf{ pair };
+	buf += TFI_HASH_SEP;
+	buf += body;
+
+	// Two differently seeded 64-bit hashes, so the 128-bit key is safe to trust without storing the source
+	uint64_t h[2] = {
+		to_little_endian(UI64(XXH64(buf.data(), buf.size(), 0))),
+		to_little_endian(UI64(XXH64(buf.data(), buf.size(), 0x54463a))),
+	};
+	std::string rv;
+	base64_url(rv, bytes_view(reinterpret_cast<const uint8_t*>(h), sizeof(h)));
+	return rv;
+}
+
+}
@@ -0,0 +1,52 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_CACHE_HPP_
+#define e5bd51be_CACHE_HPP_
+
+#include "filesystem.hpp"
+#include "shared.hpp"
+#include <string>
+#include <string_view>
+#include <memory>
+
+namespace Transfuse {
+
+// Translation memory shared between documents, mapping a hash of source block + pair to the translated block.
+// The file is an open-addressed hash table followed by a heap of records, mmap()ed and guarded by flock(), so any number of extractions and injections may use the same file at once.
+struct TMCache {
+	// Read-only caches hold a shared lock for their lifetime; writable caches only lock while committing
+	TMCache(const fs::path&, bool rw = false);
+	~TMCache();
+
+	// Returns empty if not found. Views stay valid until commit() is called or the cache is destroyed.
+	std::string_view get(std::string_view key);
+	// Queues a translation, which is written by commit()
+	void put(std::string_view key, std::string_view value);
+	size_t commit();
+
+	static std::string key(std::string_view pair, std::string_view body);
+
+protected:
+	struct impl;
+	std::unique_ptr<impl> s;
+};
+
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "charclass.hpp"
+#include "shared.hpp"
+#include <unicode/uniset.h>
+#include <unicode/ucptrie.h>
+#include <unicode/umutablecptrie.h>
+#include <array>
+#include <stdexcept>
+
+namespace Transfuse {
+
+namespace {
+
+// ASCII is looked up in a plain table
+constexpr std::array<uint8_t, 128> make_ascii() {
+	std::array<uint8_t, 128> rv{};
+	for (size_t c = 0; c < rv.size(); ++c) {
+		if ((c >= '\t' && c <= '\r') || c == ' ') {
+			rv[c] = CC_SPACE | CC_BLANK;
+		}
+		else {
+			rv[c] = CC_VISIBLE;
+		}
+		if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_') {
+			rv[c] |= CC_WORD;
+		}
+	}
+	return rv;
+}
+constexpr auto ascii = make_ascii();
+
+// Everything else goes through a code point trie, built the first time it is needed from the properties that ICU's regex classes are made of
+struct Trie {
+	UCPTrie* trie = nullptr;
+
+	Trie() {
+		UErrorCode status = U_ZERO_ERROR;
+		// Anything that isn't blank is visible, and ill-formed UTF-8 counts as U+FFFD, which is only visible
+		auto mut = umutablecptrie_open(CC_VISIBLE, CC_VISIBLE, &status);
+		auto add = [&](const char* pattern, uint8_t set, uint8_t clear) {
+			icu::UnicodeSet us(icu::UnicodeString::fromUTF8(pattern), status);
+			for (int32_t i = 0; U_SUCCESS(status) && i < us.getRangeCount(); ++i) {
+				for (auto c = us.getRangeStart(i); c <= us.getRangeEnd(i); ++c) {
+					umutablecptrie_set(mut, c, (umutablecptrie_get(mut, c) & ~UI32(clear)) | set, &status);
+				}
+			}
+		};
+		add(R"X([\p{WhiteSpace}\p{Zs}])X", CC_SPACE, 0);
+		add(R"X([\p{WhiteSpace}\p{Z}])X", CC_BLANK, CC_VISIBLE);
+		add(R"X([\p{Alphabetic}\p{M}\p{Nd}\p{Pc}\u200c\u200d\p{L}\p{N}])X", CC_WORD, 0);
+		trie = umutablecptrie_buildImmutable(mut, UCPTRIE_TYPE_FAST, UCPTRIE_VALUE_BITS_8, &status);
+		umutablecptrie_close(mut);
+		if (U_FAILURE(status)) {
+			throw std::runtime_error(concat("Could not build character class trie: ", u_errorName(status)));
+		}
+	}
+
+	~Trie() {
+		ucptrie_close(trie);
+	}
+};
+
+const UCPTrie* get_trie() {
+	static Trie t;
+	return t.trie;
+}
+
+// Classes of the code point at src, which is then moved past it
+inline uint8_t next_class(const xmlChar*& src, const xmlChar* limit, const UCPTrie*& trie) {
+	if (*src < 0x80) {
+		return ascii[*src++];
+	}
+	if (!trie) {
+		trie = get_trie();
+	}
+	uint8_t rv = 0;
+	UCPTRIE_FAST_U8_NEXT(trie, UCPTRIE_8, src, limit, rv);
+	return rv;
+}
+
+// Classes of the code point that ends at src, which is then moved to its start
+inline uint8_t prev_class(const xmlChar* start, const xmlChar*& src, const UCPTrie*& trie) {
+	if (src[-1] < 0x80) {
+		return ascii[*--src];
+	}
+	if (!trie) {
+		trie = get_trie();
+	}
+	uint8_t rv = 0;
+	UCPTRIE_FAST_U8_PREV(trie, UCPTRIE_8, start, src, rv);
+	return rv;
+}
+
+}
+
+size_t cc_span(xmlChar_view xc, uint8_t cc) {
+	const UCPTrie* trie = nullptr;
+	auto start = xc.data();
+	auto limit = start + xc.size();
+	auto src = start;
+	while (src < limit) {
+		auto p = src;
+		if (!(next_class(p, limit, trie) & cc)) {
+			break;
+		}
+		src = p;
+	}
+	return SZ(src - start);
+}
+
+size_t cc_span_back(xmlChar_view xc, uint8_t cc) {
+	const UCPTrie* trie = nullptr;
+	auto start = xc.data();
+	auto src = start + xc.size();
+	while (src > start) {
+		auto p = src;
+		if (!(prev_class(start, p, trie) & cc)) {
+			break;
+		}
+		src = p;
+	}
+	return SZ(src - start);
+}
+
+bool cc_any(xmlChar_view xc, uint8_t cc) {
+	const UCPTrie* trie = nullptr;
+	auto src = xc.data();
+	auto limit = src + xc.size();
+	while (src < limit) {
+		if (next_class(src, limit, trie) & cc) {
+			return true;
+		}
+	}
+	return false;
+}
+
+}
@@ -0,0 +1,49 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_CHARCLASS_HPP_
+#define e5bd51be_CHARCLASS_HPP_
+
+#include "xml.hpp"
+#include <cstdint>
+
+namespace Transfuse {
+
+// Classes of code points, as bits so that one lookup answers all of them. Each is exactly what the ICU regex class in the comment matches.
+enum CharClass : uint8_t {
+	CC_SPACE   = (1 << 0), // [\s\p{Zs}]
+	CC_BLANK   = (1 << 1), // [\s\r\n\p{Z}]
+	CC_VISIBLE = (1 << 2), // [^\s\p{Z}]
+	CC_WORD    = (1 << 3), // [\w\p{L}\p{N}\p{M}]
+};
+
+// Byte length of the run of code points in the class at the start of xc
+size_t cc_span(xmlChar_view xc, uint8_t cc);
+// Offset at which the run of code points in the class at the end of xc starts
+size_t cc_span_back(xmlChar_view xc, uint8_t cc);
+// Whether xc has any code point in the class
+bool cc_any(xmlChar_view xc, uint8_t cc);
+
+// Whether xc is non-empty and all of it is in the class
+inline bool cc_only(xmlChar_view xc, uint8_t cc) {
+	return !xc.empty() && cc_span(xc, cc) == xc.size();
+}
+
+}
+
+#endif
@@ -18,10 +18,16 @@
 #include "dom.hpp"
 #include "shared.hpp"
 #include "base64.hpp"
+#include "markers.hpp"
+#include "memory.hpp"
 #include <unicode/utext.h>
+#include <unicode/utf8.h>
 #include <unicode/regex.h>
+#include <libxml/parser.h>
 #include <xxhash.h>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 using namespace icu;
 
@@ -94,33 +100,20 @@ void assign_mangle(xmlString& dest, xmlChar_view src, bool mangle = false) {
 
 DOM::DOM(State& state, xmlDocPtr xml)
   : state(state)
-  , xml(xml, &xmlFreeDoc)
-  , rx_space_only(UnicodeString::fromUTF8(R"X(^([\s\p{Zs}]+)$)X"), 0, status)
-  , rx_blank_only(UnicodeString::fromUTF8(R"X(^([\s\r\n\p{Z}]+)$)X"), 0, status)
-  , rx_blank_head(UnicodeString::fromUTF8(R"X(^([\s\r\n\p{Z}]+))X"), 0, status)
-  , rx_blank_tail(UnicodeString::fromUTF8(R"X(([\s\r\n\p{Z}]+)$)X"), 0, status)
+  , xml(xml, &mem_free_doc)
 {
 	if (state.stream() == Streams::apertium) {
 		stream.reset(new ApertiumStream(state.settings));
 	}
-	else {
-		stream.reset(new VISLStream(state.settings));
-	}
-
-	if (state.settings->opt_extract_more) {
-		rx_any_content.reset(new icu::RegexMatcher(UnicodeString::fromUTF8(R"X([^\s\p{Z}])X"), 0, status));
+	else if (state.stream() == Streams::binary) {
+		stream.reset(new BinaryStream(state.settings));
 	}
 	else {
-		rx_any_content.reset(new icu::RegexMatcher(UnicodeString::fromUTF8(R"X([\w\p{L}\p{N}\p{M}])X"), 0, status));
-	}
-
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Something ICU went wrong in DOM::DOM(): ", u_errorName(status)));
+		stream.reset(new VISLStream(state.settings));
 	}
-}
 
-DOM::~DOM() {
-	utext_close(&tmp_ut);
+	// What counts as content worth translating: anything not whitespace, or by default only something alphanumeric
+	cc_content = state.settings->opt_extract_more ? CC_VISIBLE : CC_WORD;
 }
 
 void DOM::cmdline_tags() {
@@ -166,10 +159,9 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 			save_spaces(child, rn + 1);
 		}
 		else if (child->content && child->parent) {
-			utext_openUTF8(tmp_ut, child->content);
-
-			rx_blank_only.reset(&tmp_ut);
-			if (rx_blank_only.matches(status)) {
+			xmlChar_view content(child->content);
+			auto head = cc_span(content, CC_BLANK);
+			if (!content.empty() && head == content.size()) {
 				if (!child->prev) {
 					xmlSetProp(child->parent, XC("tf-space-prefix"), child->content);
 				}
@@ -185,14 +177,10 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 				// If the node was entirely whitespace, skip looking for leading/trailing
 				continue;
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_only: ", u_errorName(status)));
-			}
 
 			// If this node has leading whitespace, record that either in the previous sibling or parent
-			rx_blank_head.reset(&tmp_ut);
-			if (rx_blank_head.find(status)) {
-				tmp_lxs[0].assign(child->content + rx_blank_head.start(1, status), child->content + rx_blank_head.end(1, status));
+			if (head) {
+				tmp_lxs[0].assign(content.substr(0, head));
 				if (child->prev) {
 					if (child->prev->type == XML_ELEMENT_NODE || child->prev->properties) {
 						xmlSetProp(child->prev, XC("tf-space-after"), tmp_lxs[0].c_str());
@@ -202,14 +190,11 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 					xmlSetProp(child->parent, XC("tf-space-prefix"), tmp_lxs[0].c_str());
 				}
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_head: ", u_errorName(status)));
-			}
 
 			// If this node has trailing whitespace, record that either in the next sibling or parent
-			rx_blank_tail.reset(&tmp_ut);
-			if (rx_blank_tail.find(status)) {
-				tmp_lxs[0].assign(child->content + rx_blank_tail.start(1, status), child->content + rx_blank_tail.end(1, status));
+			auto tail = cc_span_back(content, CC_BLANK);
+			if (tail < content.size()) {
+				tmp_lxs[0].assign(content.substr(tail));
 				if (child->next) {
 					if (child->next->type == XML_ELEMENT_NODE || child->next->properties) {
 						xmlSetProp(child->next, XC("tf-space-before"), tmp_lxs[0].c_str());
@@ -219,23 +204,12 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 					xmlSetProp(child->parent, XC("tf-space-suffix"), tmp_lxs[0].c_str());
 				}
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_tail: ", u_errorName(status)));
-			}
 		}
 	}
 }
 
 void DOM::append_ltrim(xmlString& s, xmlChar_view xc) {
-	utext_openUTF8(tmp_ut, xc);
-	rx_blank_head.reset(&tmp_ut);
-	if (rx_blank_head.find()) {
-		auto e = rx_blank_head.end(0, status);
-		s.append(xc.begin() + PD(e), xc.end());
-	}
-	else {
-		s += xc;
-	}
+	s += xc.substr(cc_span(xc, CC_BLANK));
 }
 
 void DOM::assign_ltrim(xmlString& s, xmlChar_view xc) {
@@ -245,15 +219,7 @@ void DOM::assign_ltrim(xmlString& s, xmlChar_view xc) {
 
 void DOM::assign_rtrim(xmlString& s, xmlChar_view xc) {
 	s.clear();
-	utext_openUTF8(tmp_ut, xc);
-	rx_blank_tail.reset(&tmp_ut);
-	if (rx_blank_tail.find()) {
-		auto b = rx_blank_tail.start(0, status);
-		s.append(xc.begin(), xc.begin() + PD(b));
-	}
-	else {
-		s += xc;
-	}
+	s += xc.substr(0, cc_span_back(xc, CC_BLANK));
 }
 
 // restore_spaces() can only modify existing nodes, so this function will create new nodes for any remaining saved whitespace
@@ -266,7 +232,7 @@ void DOM::create_spaces(xmlNodePtr dom, size_t rn) {
 	tmp_xs = &tmp_xss[rn];
 	auto& tmp_lxs = tmp_xss[rn];
 
-	bool apertium = (state.stream() == Streams::apertium);
+	bool apertium = (state.stream() == Streams::apertium || state.stream() == Streams::binary);
 
 	for (auto child = dom->children; child != nullptr; child = child->next) {
 		assign_name_ns(tmp_lxs[0], child);
@@ -324,7 +290,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 	tmp_xs = &tmp_xss[rn];
 	auto& tmp_lxs = tmp_xss[rn];
 
-	bool apertium = (state.stream() == Streams::apertium);
+	bool apertium = (state.stream() == Streams::apertium || state.stream() == Streams::binary);
 
 	for (auto child = dom->children; child != nullptr; child = child->next) {
 		assign_name_ns(tmp_lxs[0], child);
@@ -383,14 +349,20 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 				xmlRemoveProp(attr);
 			}
 
-			if (xmlStrstr(child->content, XC(TF_SENTINEL))) {
+			auto c = xmlChar_view(child->content);
+			MarkerScanner scan(c);
+			size_t b = 0;
+			if (scan.skip_to(marker_kind(TF_SENTINEL)) != xmlChar_view::npos) {
 				tmp_lxs[1].clear();
-				auto c = xmlChar_view(child->content);
-				size_t b = 0, e = 0;
-				while ((e = c.find(XCV(TF_SENTINEL), b)) != xmlChar_view::npos) {
-					tmp_lxs[1].append(c.begin() + b, c.begin() + e);
+				scan.pos = 0;
+				Marker m;
+				while (scan.next(m)) {
+					if (m.kind != marker_kind(TF_SENTINEL)) {
+						continue;
+					}
+					tmp_lxs[1].append(c.begin() + b, c.begin() + m.offset);
 					tmp_lxs[1] += "\n";
-					b = e + 3;
+					b = scan.pos;
 				}
 				tmp_lxs[1].append(c.begin() + b, c.end());
 				xmlNodeSetContent(child, tmp_lxs[1].c_str());
@@ -400,14 +372,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 }
 
 bool DOM::is_space(xmlChar_view xc) {
-	bool rv = true;
-	utext_openUTF8(tmp_ut, xc);
-	rx_space_only.reset(&tmp_ut);
-	rv = rx_space_only.matches(status);
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Could not match rx_space_only: ", u_errorName(status)));
-	}
-	return rv;
+	return cc_only(xc, CC_SPACE);
 }
 
 bool DOM::is_only_child(xmlNodePtr cn) {
@@ -439,6 +404,31 @@ bool DOM::has_block_child(xmlNodePtr dom) {
 	return blockchild;
 }
 
+// Whether an element with children becomes a style instead of being written as-is
+bool DOM::is_style_inline(xmlNodePtr child, xmlChar_view lname, bool l_protect) {
+	return !l_protect && tags[Strs::tags_inline].count(lname) && !tags[Strs::tags_prot].count(to_lower(assign_name_ns((*tmp_xs)[3], child->children))) && (tags[Strs::tags_semantic].count(lname) || !is_only_child(child)) && !has_block_child(child);
+}
+
+// Whether save_styles() writes a node as anything other than itself: styles and protected regions, CDATA as text, and unknown node types not at all
+bool DOM::is_restyled(xmlNodePtr child, bool protect) {
+	if (child->type == XML_TEXT_NODE) {
+		return false;
+	}
+	if (child->type != XML_ELEMENT_NODE) {
+		return true;
+	}
+
+	auto& lname = to_lower(assign_name_ns((*tmp_xs)[1], child));
+	if (tags[Strs::tags_prot_inline].count(lname) && !protect) {
+		return true;
+	}
+	if (!child->children) {
+		return false;
+	}
+	bool l_protect = (protect || tags[Strs::tags_prot].count(lname) || xmlHasProp(child, XC("tf-protect")));
+	return is_style_inline(child, lname, l_protect);
+}
+
 // Serializes the XML document while turning inline tags into something the stream can deal with
 void DOM::save_styles(xmlString& s, xmlNodePtr dom, size_t rn, bool protect) {
 	if (dom == nullptr || dom->children == nullptr) {
@@ -518,7 +508,7 @@ void DOM::save_styles(xmlString& s, xmlNodePtr dom, size_t rn, bool protect) {
 				continue;
 			}
 
-			if (!l_protect && tags[Strs::tags_inline].count(lname) && !tags[Strs::tags_prot].count(to_lower(assign_name_ns(tmp_lxs[3], child->children))) && (tags[Strs::tags_semantic].count(lname) || !is_only_child(child)) && !has_block_child(child)) {
+			if (is_style_inline(child, lname, l_protect)) {
 				tmp_lxs[0] = child->name;
 				auto& sname = to_lower(tmp_lxs[0]);
 				auto hash = state.style(sname, otag, ctag);
@@ -556,6 +546,209 @@ void DOM::save_styles(xmlString& s, xmlNodePtr dom, size_t rn, bool protect) {
 	}
 }
 
+// Finds the elements whose children save_styles() would change, and serializes only those, each wrapped in > < as if between its own tags
+void DOM::apply_styles(xmlString& s, std::vector<xmlNodePtr>& units, xmlNodePtr dom, size_t rn, bool protect) {
+	tmp_xss.resize(std::max(tmp_xss.size(), rn + 1));
+	tmp_xs = &tmp_xss[rn];
+	auto& tmp_lxs = tmp_xss[rn];
+
+	for (auto child = dom->children; child != nullptr; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+
+		auto& lname = to_lower(assign_name_ns(tmp_lxs[0], child));
+		if (tags[Strs::tags_unique].count(lname)) {
+			xmlSetProp(child, XC("tf-unique"), XC(std::to_string(++unique).c_str()));
+		}
+		bool l_protect = (protect || tags[Strs::tags_prot].count(lname) || xmlHasProp(child, XC("tf-protect")));
+
+		bool restyled = false;
+		for (auto cn = child->children; cn != nullptr && !restyled; cn = cn->next) {
+			restyled = is_restyled(cn, l_protect);
+		}
+
+		if (restyled) {
+			if (!units.empty()) {
+				s += '\0';
+			}
+			s += '>';
+			save_styles(s, child, rn + 1, l_protect);
+			s += '<';
+			units.push_back(child);
+		}
+		else {
+			apply_styles(s, units, child, rn + 1, l_protect);
+		}
+		tmp_xs = &tmp_lxs;
+	}
+}
+
+// Turns inline tags into styles and protected regions in place, leaving the document as if save_styles() had been written out and parsed again
+void DOM::apply_styles() {
+	if (state.settings->opt_verbose) {
+		std::cerr << "Applying styles" << std::endl;
+	}
+
+	// The serialized form was plain UTF-8 XML without a doctype, and fragments parsed into the document must be read as such
+	auto doc = xml.get();
+	if (auto dtd = xmlGetIntSubset(doc)) {
+		xmlUnlinkNode(reinterpret_cast<xmlNodePtr>(dtd));
+		xmlFreeDtd(dtd);
+	}
+	doc->type = XML_DOCUMENT_NODE;
+	doc->properties &= ~XML_DOC_HTML;
+	doc->standalone = -1;
+	if (doc->version == nullptr) {
+		doc->version = xmlStrdup(XC("1.0"));
+	}
+	xmlFree(const_cast<xmlChar*>(doc->encoding));
+	doc->encoding = xmlStrdup(XC("UTF-8"));
+
+	// Top-level comments and PIs always end up left as-is, so only the elements are looked at
+	xmlString joined;
+	std::vector<xmlNodePtr> units;
+	state.begin();
+	apply_styles(joined, units, reinterpret_cast<xmlNodePtr>(doc), 0);
+	stream->protect_to_styles(joined, state);
+	state.commit();
+	Transfuse::cleanup_styles(state, joined);
+
+	// Every fragment must parse as well-formed in its element before any are put back. Recovery drops or mangles what follows a malformed part, such as a comment containing --, so then the whole document is serialized and parsed the way it always was.
+	std::string tmp;
+	std::vector<std::string_view> frags;
+	std::vector<xmlNodePtr> parsed(units.size(), nullptr);
+	auto view = XV2SV(joined);
+	size_t b = 0;
+	bool ok = true;
+	for (size_t i = 0; i < units.size(); ++i) {
+		auto e = std::min(view.find('\0', b), view.size());
+		auto frag = view.substr(b, e - b);
+		b = e + 1;
+		if (!frag.empty() && frag.front() == '>') {
+			frag.remove_prefix(1);
+		}
+		if (!frag.empty() && frag.back() == '<') {
+			frag.remove_suffix(1);
+		}
+		frags.push_back(frag);
+		if (ok && frag.find('<') != std::string_view::npos) {
+			ok = parse_fragment(units[i], frag, parsed[i]);
+		}
+	}
+
+	if (!ok) {
+		for (auto nodes : parsed) {
+			xmlFreeNodeList(nodes);
+		}
+		if (state.settings->opt_verbose) {
+			std::cerr << "Fragment not well-formed, reparsing whole document" << std::endl;
+		}
+
+		unique = 0;
+		xmlString styled;
+		styled += XC("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		state.begin();
+		save_styles(styled, reinterpret_cast<xmlNodePtr>(doc), 0);
+		stream->protect_to_styles(styled, state);
+		state.commit();
+		Transfuse::cleanup_styles(state, styled);
+		xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < units.size(); ++i) {
+		if (parsed[i]) {
+			replace_children(units[i], parsed[i]);
+		}
+		else {
+			replace_children(units[i], frags[i], tmp);
+		}
+	}
+}
+
+// Runs the style cleanup over all text nodes that have style markers, as if over the serialized document
+void DOM::cleanup_text_styles() {
+	std::vector<xmlNodePtr> marked;
+	std::string joined;
+
+	std::function<void(xmlNodePtr)> walk = [&](xmlNodePtr node) {
+		for (auto child = node->children; child != nullptr; child = child->next) {
+			if (child->type == XML_ELEMENT_NODE) {
+				walk(child);
+			}
+			else if (child->type == XML_TEXT_NODE && child->content) {
+				Marker m;
+				if (!MarkerScanner(xmlChar_view(child->content)).next(m)) {
+					continue;
+				}
+				if (!marked.empty()) {
+					joined += '\0';
+				}
+				escape_xml(joined, x2s(child->content));
+				marked.push_back(child);
+			}
+		}
+	};
+	walk(reinterpret_cast<xmlNodePtr>(xml.get()));
+
+	Transfuse::cleanup_styles(state, joined);
+
+	std::string tmp;
+	std::string_view view{ joined };
+	size_t b = 0;
+	for (auto text : marked) {
+		auto e = std::min(view.find('\0', b), view.size());
+		unescape_xml(tmp, view.substr(b, e - b));
+		b = e + 1;
+		xmlNodeSetContent(text, XC(tmp.c_str()));
+	}
+}
+
+// Writes a block to the stream, unless a previous injection or the translation cache already has it, or it repeats an earlier block
+void DOM::emit_block(xmlString& s, xmlChar_view id, xmlChar_view body, bool header) {
+	auto b = s.size();
+	stream->block_open(s, id);
+	auto bb = s.size();
+	stream->block_body(s, body);
+	if (header) {
+		stream->block_term_header(s);
+	}
+	auto be = s.size();
+	stream->block_close(s, id);
+
+	if (!keyed) {
+		block_starts.push_back(b);
+		return;
+	}
+
+	// Key on the block exactly as the translation pipeline would see it, minus the block ID which differs between documents and revisions
+	auto key = TMCache::key(state.settings->cache_pair, x2s(xmlChar_view(s).substr(bb, be - bb)));
+	std::string_view hit;
+	if (auto it = translated.find(key); it != translated.end()) {
+		hit = it->second;
+		++reused;
+	}
+	else if (tm) {
+		hit = tm->get(key);
+		cached += !hit.empty();
+	}
+	state.block(x2s(id), key, hit);
+	if (!hit.empty()) {
+		s.resize(b);
+	}
+	else if (state.settings->opt_dedupe && !emitted.insert(key).second) {
+		s.resize(b);
+		++repeats;
+	}
+	else {
+		block_starts.push_back(b);
+	}
+}
+
 // Extracts blocks and textual attributes for the stream, and leaves unique markers we can later search/replace
 void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool header) {
 	if (dom == nullptr || dom->children == nullptr) {
@@ -592,9 +785,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool
 			for (auto a : tags[Strs::tag_attrs]) {
 				if (auto attr = xmlHasProp(child, a.data())) {
 					assign_mangle(tmp_lxs[1], attr->children->content, state.settings->opt_mangle_xml);
-					utext_openUTF8(tmp_ut, tmp_lxs[1]);
-					rx_any_content->reset(&tmp_ut);
-					if (!rx_any_content->find()) {
+					if (!cc_any(tmp_lxs[1], cc_content)) {
 						// If the value contains no alphanumeric data, skip it
 						continue;
 					}
@@ -606,12 +797,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool
 					tmp_lxs[2] += '-';
 					tmp_lxs[2] += tmp_s;
 
-					stream->block_open(s, tmp_lxs[2]);
-					stream->block_body(s, tmp_lxs[1]);
-					if (tags[Strs::attrs_headers].count(a)) {
-						stream->block_term_header(s);
-					}
-					stream->block_close(s, tmp_lxs[2]);
+					emit_block(s, tmp_lxs[2], tmp_lxs[1], tags[Strs::attrs_headers].count(a));
 
 					tmp_lxs[3] = XC(TFB_OPEN_B);
 					tmp_lxs[3] += tmp_lxs[2];
@@ -647,9 +833,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool
 			}
 
 			assign_mangle(tmp_lxs[1], child->content, state.settings->opt_mangle_xml);
-			utext_openUTF8(tmp_ut, tmp_lxs[1]);
-			rx_any_content->reset(&tmp_ut);
-			if (!rx_any_content->find()) {
+			if (!cc_any(tmp_lxs[1], cc_content)) {
 				continue;
 			}
 
@@ -660,12 +844,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool
 			tmp_lxs[2] += '-';
 			tmp_lxs[2] += tmp_s;
 
-			stream->block_open(s, tmp_lxs[2]);
-			stream->block_body(s, tmp_lxs[1]);
-			if (header || tags[Strs::tags_headers].count(pname)) {
-				stream->block_term_header(s);
-			}
-			stream->block_close(s, tmp_lxs[2]);
+			emit_block(s, tmp_lxs[2], tmp_lxs[1], header || tags[Strs::tags_headers].count(pname));
 
 			tmp_lxs[3] = XC(TFB_OPEN_B);
 			tmp_lxs[3] += tmp_lxs[2];
@@ -679,6 +858,278 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt, bool
 	}
 }
 
+// Escapes text the same way libxml2 serializes it, so the markers are seen exactly as in a saved document
+void escape_xml(std::string& out, std::string_view in, bool attr) {
+	for (auto c : in) {
+		if (c == '&') {
+			out += "&amp;";
+		}
+		else if (c == '<') {
+			out += "&lt;";
+		}
+		else if (c == '>') {
+			out += "&gt;";
+		}
+		else if (c == '\r') {
+			out += "&#13;";
+		}
+		else if (attr && c == '"') {
+			out += "&quot;";
+		}
+		else if (attr && c == '\n') {
+			out += "&#10;";
+		}
+		else if (attr && c == '\t') {
+			out += "&#9;";
+		}
+		else {
+			out += c;
+		}
+	}
+}
+
+void unescape_xml(std::string& out, std::string_view in) {
+	out.clear();
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i] != '&') {
+			out += in[i];
+			continue;
+		}
+		auto e = in.find(';', i);
+		if (e == std::string_view::npos) {
+			out += in[i];
+			continue;
+		}
+		auto ent = in.substr(i + 1, e - i - 1);
+		if (ent == "amp") {
+			out += '&';
+		}
+		else if (ent == "lt") {
+			out += '<';
+		}
+		else if (ent == "gt") {
+			out += '>';
+		}
+		else if (ent == "quot") {
+			out += '"';
+		}
+		else if (ent == "apos") {
+			out += '\'';
+		}
+		else if (ent.size() > 1 && ent[0] == '#') {
+			bool hex = (ent[1] == 'x' || ent[1] == 'X');
+			auto cp = std::stoul(std::string(ent.substr(hex ? 2 : 1)), nullptr, hex ? 16 : 10);
+			char u8[4]{};
+			int32_t n = 0;
+			U8_APPEND_UNSAFE(u8, n, static_cast<UChar32>(cp));
+			out.append(u8, SZ(n));
+		}
+		else {
+			out += in[i];
+			continue;
+		}
+		i = e;
+	}
+}
+
+// Parses serialized XML as children of the context node, without recovery, so a fragment that is not well-formed is reported rather than silently cut short
+bool parse_fragment(xmlNodePtr context, std::string_view frag, xmlNodePtr& nodes) {
+	nodes = nullptr;
+	if (xmlParseInNodeContext(context, frag.data(), SI(frag.size()), XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING, &nodes) == XML_ERR_OK) {
+		return true;
+	}
+	xmlFreeNodeList(nodes);
+	nodes = nullptr;
+	return false;
+}
+
+// Replaces all children of a node with the given node list
+void replace_children(xmlNodePtr node, xmlNodePtr nodes) {
+	xmlNodeSetContent(node, nullptr);
+	while (nodes) {
+		auto n = nodes;
+		nodes = nodes->next;
+		xmlUnlinkNode(n);
+		xmlAddChild(node, n);
+	}
+}
+
+// Replaces all children of a node with serialized XML that has no tags
+void replace_children(xmlNodePtr node, std::string_view frag, std::string& tmp) {
+	unescape_xml(tmp, frag);
+	xmlNodeSetContent(node, nullptr);
+	if (!tmp.empty()) {
+		xmlAddChild(node, xmlNewDocTextLen(node->doc, XC(tmp.data()), SI(tmp.size())));
+	}
+}
+
+// Merges each element of the given name into a directly preceding one of the same name, as removing </name><name> from the serialized document would, so not if the latter has attributes
+void merge_adjacent(xmlNodePtr dom, xmlChar_view name) {
+	for (auto child = dom->children; child != nullptr; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		while (child->children && child->next && child->next->type == XML_ELEMENT_NODE && child->next->children && !child->next->properties && !child->next->nsDef && xmlStrcmp(child->name, name.data()) == 0 && xmlStrcmp(child->next->name, name.data()) == 0) {
+			auto next = child->next;
+			while (next->children) {
+				auto n = next->children;
+				xmlUnlinkNode(n);
+				xmlAddChild(child, n);
+			}
+			xmlUnlinkNode(next);
+			xmlFreeNode(next);
+		}
+		merge_adjacent(child, name);
+	}
+}
+
+// Replaces the node with its children, as removing its tags from the serialized document would
+void unwrap_node(xmlNodePtr node) {
+	while (node->children) {
+		auto n = node->children;
+		xmlUnlinkNode(n);
+		xmlAddPrevSibling(node, n);
+	}
+	xmlUnlinkNode(node);
+	xmlFreeNode(node);
+}
+
+// Sets an attribute and makes it the element's first, as inserting it right after the tag name would. libxml only appends attributes, so the ones before it are moved after it in their order.
+xmlAttrPtr set_first_prop(xmlNodePtr node, const xmlChar* name, const xmlChar* value) {
+	auto a = xmlSetProp(node, name, value);
+	while (a && node->properties != a) {
+		auto o = reinterpret_cast<xmlNodePtr>(node->properties);
+		xmlUnlinkNode(o);
+		xmlAddChild(node, o);
+	}
+	return a;
+}
+
+icu::RegexMatcher& rx_matcher(const char* pattern, uint32_t flags) {
+	static std::mutex mtx;
+	static std::unordered_map<std::string, std::unique_ptr<icu::RegexPattern>> patterns;
+	thread_local std::unordered_map<std::string, std::unique_ptr<icu::RegexMatcher>> matchers;
+	thread_local std::string key;
+
+	key = pattern;
+	key += '\0';
+	key += std::to_string(flags);
+
+	auto& matcher = matchers[key];
+	if (!matcher) {
+		UErrorCode status = U_ZERO_ERROR;
+		std::lock_guard<std::mutex> lock(mtx);
+		auto& rx = patterns[key];
+		if (!rx) {
+			rx.reset(icu::RegexPattern::compile(UnicodeString::fromUTF8(pattern), flags, status));
+			if (U_FAILURE(status)) {
+				rx.reset();
+				throw std::runtime_error(concat("Could not compile regex ", pattern, ": ", u_errorName(status)));
+			}
+		}
+		matcher.reset(rx->matcher(status));
+		if (U_FAILURE(status)) {
+			matcher.reset();
+			throw std::runtime_error(concat("Could not create matcher for regex ", pattern, ": ", u_errorName(status)));
+		}
+	}
+	return *matcher;
+}
+
+// Calls keep(b, e) for each stretch of the input that is not one of the attributes, and returns whether any were found
+template<typename Char, typename F>
+inline bool strip_attr_spans(std::basic_string_view<Char> in, std::string_view name, AttrValue value, F&& keep) {
+	std::basic_string<Char> prefix(1, ' ');
+	for (auto c : name) {
+		prefix += static_cast<Char>(c);
+	}
+	prefix += '=';
+	prefix += '"';
+
+	bool did = false;
+	size_t last = 0;
+	for (auto pos = in.find(prefix); pos != in.npos; pos = in.find(prefix, pos)) {
+		auto vb = pos + prefix.size();
+		auto ve = in.find('"', vb);
+		if (ve == in.npos) {
+			// Later attributes would need a quote after this one too
+			break;
+		}
+		bool ok = (value == AttrValue::any || ve > vb);
+		if (ok && value == AttrValue::digits) {
+			for (auto i = vb; i < ve && ok; ++i) {
+				ok = (in[i] >= '0' && in[i] <= '9');
+			}
+		}
+		if (!ok) {
+			++pos;
+			continue;
+		}
+		keep(last, pos);
+		last = pos = ve + 1;
+		did = true;
+	}
+	if (did) {
+		keep(last, in.size());
+	}
+	return did;
+}
+
+void strip_attr(icu::UnicodeString& udata, std::string_view name, icu::UnicodeString& tmp, AttrValue value) {
+	std::u16string_view in(udata.getBuffer(), SZ(udata.length()));
+	tmp.remove();
+	if (strip_attr_spans(in, name, value, [&](size_t b, size_t e) { tmp.append(udata, SI32(b), SI32(e - b)); })) {
+		std::swap(udata, tmp);
+	}
+}
+
+void strip_attr(std::string& data, std::string_view name, std::string& tmp, AttrValue value) {
+	std::string_view in(data);
+	tmp.clear();
+	if (strip_attr_spans(in, name, value, [&](size_t b, size_t e) { tmp.append(in.substr(b, e - b)); })) {
+		std::swap(data, tmp);
+	}
+}
+
+void replace_all(icu::UnicodeString& udata, std::initializer_list<std::u16string_view> finds, std::u16string_view repl, icu::UnicodeString& tmp) {
+	std::u16string_view in(udata.getBuffer(), SZ(udata.length()));
+	// Next occurrence of each literal, only searched again once the scan has passed it
+	std::vector<size_t> next;
+	for (auto f : finds) {
+		next.push_back(in.find(f));
+	}
+
+	tmp.remove();
+	bool did = false;
+	size_t last = 0;
+	for (;;) {
+		size_t best = 0;
+		for (size_t i = 1; i < next.size(); ++i) {
+			if (next[i] < next[best]) {
+				best = i;
+			}
+		}
+		if (next.empty() || next[best] == in.npos) {
+			break;
+		}
+		auto pos = next[best];
+		tmp.append(udata, SI32(last), SI32(pos - last));
+		tmp.append(repl.data(), SI32(repl.size()));
+		last = pos + (finds.begin() + best)->size();
+		did = true;
+
+		for (size_t i = 0; i < next.size(); ++i) {
+			if (next[i] != in.npos && next[i] < last) {
+				next[i] = in.find(*(finds.begin() + i), last);
+			}
+		}
+	}
+	if (did) {
+		tmp.append(udata, SI32(last), SI32(in.size() - last));
+		std::swap(udata, tmp);
+	}
+}
+
 // Adjust and merge inline information where applicable
 void cleanup_styles(State& state, std::string& str) {
 	UText tmp_ut = UTEXT_INITIALIZER;
@@ -687,12 +1138,12 @@ void cleanup_styles(State& state, std::string& str) {
 	UChar32 cp = 0;
 	tmp.reserve(str.size());
 
-	RegexMatcher rx_merge(R"X((\ue011[^\ue012]+\ue012)([^\ue011-\ue013]+)\ue013([\s\p{Zs}]*)(\1))X", 0, status);
-	RegexMatcher rx_nested(R"X(\ue011([^\ue012]+)\ue012\ue011([^\ue012]+)\ue012([^\ue011-\ue013]+)\ue013\ue013)X", 0, status);
-	RegexMatcher rx_alpha_prefix(R"X(([\p{L}\p{M}])(\ue011[^\ue012]+\ue012)(\p{L}+))X", 0, status);
-	RegexMatcher rx_alpha_suffix(R"X(([\p{L}\p{M}])(\ue013)(\p{L}[\p{L}\p{N}\p{M}]*))X", 0, status);
-	RegexMatcher rx_spc_prefix(R"X((\ue011[^\ue012]+\ue012)([\s\p{Zs}]+))X", 0, status);
-	RegexMatcher rx_spc_suffix(R"X(([\s\p{Zs}])(\ue013))X", 0, status);
+	auto& rx_merge = rx_matcher(R"X((\ue011[^\ue012\x{0}]+\ue012)([^\ue011-\ue013\x{0}]+)\ue013([\s\p{Zs}]*)(\1))X");
+	auto& rx_nested = rx_matcher(R"X(\ue011([^\ue012\x{0}]+)\ue012\ue011([^\ue012\x{0}]+)\ue012([^\ue011-\ue013\x{0}]+)\ue013\ue013)X");
+	auto& rx_alpha_prefix = rx_matcher(R"X(([\p{L}\p{M}])(\ue011[^\ue012\x{0}]+\ue012)(\p{L}+))X");
+	auto& rx_alpha_suffix = rx_matcher(R"X(([\p{L}\p{M}])(\ue013)(\p{L}[\p{L}\p{N}\p{M}]*))X");
+	auto& rx_spc_prefix = rx_matcher(R"X((\ue011[^\ue012\x{0}]+\ue012)([\s\p{Zs}]+))X");
+	auto& rx_spc_suffix = rx_matcher(R"X(([\s\p{Zs}])(\ue013))X");
 
 	bool did = true;
 	for (size_t zi = 0; did; ++zi) {
@@ -22,14 +22,19 @@
 #include "state.hpp"
 #include "xml.hpp"
 #include "stream.hpp"
+#include "cache.hpp"
+#include "charclass.hpp"
 #include <unicode/utext.h>
 #include <unicode/regex.h>
 #include <libxml/tree.h>
 #include <string_view>
 #include <array>
 #include <deque>
+#include <vector>
 #include <map>
-#include <regex>
+#include <unordered_map>
+#include <unordered_set>
+#include <initializer_list>
 
 namespace Transfuse {
 
@@ -80,19 +85,35 @@ inline void assign_xml(S& str, SV sv, bool nls = false) {
 	append_xml(str, sv, nls);
 }
 
-inline void rx_replaceAll(const char* pattern, const char* repl, std::string& udata, std::string& tmp) {
-	tmp.clear();
-	std::regex rx(pattern);
-	std::regex_replace(std::back_inserter(tmp), udata.begin(), udata.end(), rx, repl);
-	std::swap(udata, tmp);
-}
+void escape_xml(std::string& out, std::string_view in, bool attr = false);
+void unescape_xml(std::string& out, std::string_view in);
+bool parse_fragment(xmlNodePtr context, std::string_view frag, xmlNodePtr& nodes);
+void replace_children(xmlNodePtr node, xmlNodePtr nodes);
+void replace_children(xmlNodePtr node, std::string_view frag, std::string& tmp);
+void merge_adjacent(xmlNodePtr dom, xmlChar_view name);
+void unwrap_node(xmlNodePtr node);
+xmlAttrPtr set_first_prop(xmlNodePtr node, const xmlChar* name, const xmlChar* value);
+
+// Matcher for a pattern that is compiled once per process, with each thread getting its own matcher from that
+icu::RegexMatcher& rx_matcher(const char* pattern, uint32_t flags = 0);
+
+// What an attribute value must look like for strip_attr() to remove it: [^"]*, [^"]+ or [0-9]+
+enum class AttrValue {
+	any,
+	nonempty,
+	digits,
+};
+
+// Removes every ` name="value"` in one pass, without a regex
+void strip_attr(icu::UnicodeString& udata, std::string_view name, icu::UnicodeString& tmp, AttrValue value = AttrValue::nonempty);
+void strip_attr(std::string& data, std::string_view name, std::string& tmp, AttrValue value = AttrValue::nonempty);
+
+// Replaces every occurrence of any of the literals in one pass, where the earliest match wins and the first listed wins a tie, same as a regex alternation would
+void replace_all(icu::UnicodeString& udata, std::initializer_list<std::u16string_view> finds, std::u16string_view repl, icu::UnicodeString& tmp);
 
 inline void rx_replaceAll(const char* pattern, const char* repl, icu::UnicodeString& udata, icu::UnicodeString& tmp) {
 	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher regex(pattern, 0, status);
-	if (U_FAILURE(status)) {
-		throw status;
-	}
+	auto& regex = rx_matcher(pattern);
 
 	regex.reset(udata);
 	tmp = regex.replaceAll(repl, status);
@@ -104,10 +125,7 @@ inline void rx_replaceAll(const char* pattern, const char* repl, icu::UnicodeStr
 
 inline void rx_replaceAll_expand_21(const char* pattern, icu::UnicodeString& udata, icu::UnicodeString& tmp) {
 	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher regex(pattern, 0, status);
-	if (U_FAILURE(status)) {
-		throw status;
-	}
+	auto& regex = rx_matcher(pattern);
 
 	regex.reset(udata);
 	tmp.remove();
@@ -144,20 +162,24 @@ struct DOM {
 	std::string tmp_s;
 	size_t blocks = 0;
 	size_t unique = 0;
+	size_t cached = 0;
+	size_t reused = 0;
+	size_t repeats = 0;
 	std::unique_ptr<StreamBase> stream;
+	std::unique_ptr<TMCache> tm;
+	std::unordered_map<std::string, std::string> translated;
+	std::unordered_set<std::string> emitted;
+	std::vector<size_t> block_starts;
+	// Whether blocks get a key in the state; only needed to look them up, leave out repeats, or for a later injection to record translations under
+	bool keyed = true;
+	// The original document during injection, for formats that build their output from a copy of it
+	std::string_view original;
 
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher rx_space_only;
-	icu::RegexMatcher rx_blank_only;
-	icu::RegexMatcher rx_blank_head;
-	icu::RegexMatcher rx_blank_tail;
-	std::unique_ptr<icu::RegexMatcher> rx_any_content;
+	uint8_t cc_content = 0;
 
 	std::map<std::string_view, xmlChars> tags;
 
 	DOM(State&, xmlDocPtr);
-	~DOM();
 
 	void cmdline_tags();
 
@@ -181,30 +203,40 @@ struct DOM {
 	bool is_only_child(xmlNodePtr);
 	bool has_block_child(xmlNodePtr);
 
+	bool is_style_inline(xmlNodePtr, xmlChar_view, bool);
+	bool is_restyled(xmlNodePtr, bool);
 	void save_styles(xmlString&, xmlNodePtr, size_t, bool protect = false);
-	xmlString save_styles(bool prefix = false) {
-		xmlString rv;
-		if (prefix) {
-			rv += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-		}
-		state.begin();
-		save_styles(rv, reinterpret_cast<xmlNodePtr>(xml.get()), 0);
-		stream->protect_to_styles(rv, state);
-		state.commit();
-		cleanup_styles(state, rv);
-		return rv;
-	}
+	void apply_styles(xmlString&, std::vector<xmlNodePtr>&, xmlNodePtr, size_t, bool protect = false);
+	void apply_styles();
+	void cleanup_text_styles();
 
+	void emit_block(xmlString&, xmlChar_view id, xmlChar_view body, bool header);
 	void extract_blocks(xmlString&, xmlNodePtr, size_t, bool txt = false, bool header = false);
 	xmlString extract_blocks() {
 		xmlString rv;
 		stream->stream_header(rv, state.settings->tmpdir);
 		blocks = 0;
+		cached = 0;
+		reused = 0;
+		repeats = 0;
+		emitted.clear();
+		block_starts.clear();
+		state.begin();
 		extract_blocks(rv, reinterpret_cast<xmlNodePtr>(xml.get()), 0);
+		state.commit();
 		return rv;
 	}
 };
 
+// What extraction hands straight to injection in fused clean mode, where there is no state folder
+// The stream is kept in memory and read back the same way as from a file, so the blocks get the same treatment as in an unfused round trip
+struct Fused {
+	std::string original;
+	std::unique_ptr<State> state;
+	std::unique_ptr<DOM> dom;
+	std::string stream;
+};
+
 }
 
 #endif
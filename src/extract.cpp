@@ -21,18 +21,246 @@
 #include "base64.hpp"
 #include "dom.hpp"
 #include "formats.hpp"
+#include "sniff.hpp"
+#include "memory.hpp"
 #include <libxml/tree.h>
+#include <libxml/parser.h>
+#include <libxml/SAX2.h>
 #include <libxml/xmlsave.h>
 #include <zip.h>
 #include <string_view>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <random>
 #include <memory>
+#include <functional>
+#include <unordered_map>
 
 namespace Transfuse {
 
-void extract(Settings& settings) {
+std::string original_load(State& state) {
+	if (state.original.data()) {
+		return std::string(state.original);
+	}
+	return file_load("original");
+}
+
+zip_t* original_zip(State& state, std::string_view what) {
+	if (!state.original.data()) {
+		int e = 0;
+		auto zip = zip_open("original", ZIP_RDONLY, &e);
+		if (zip == nullptr) {
+			throw std::runtime_error(concat("Could not open ", what, " file: ", std::to_string(e)));
+		}
+		return zip;
+	}
+
+	zip_error_t error;
+	zip_error_init(&error);
+	auto src = zip_source_buffer_create(state.original.data(), state.original.size(), 0, &error);
+	if (src == nullptr) {
+		throw std::runtime_error(concat("Could not create buffer for ", what, " file: ", zip_error_strerror(&error)));
+	}
+	auto zip = zip_open_from_source(src, ZIP_RDONLY, &error);
+	if (zip == nullptr) {
+		zip_source_free(src);
+		throw std::runtime_error(concat("Could not open ", what, " file: ", zip_error_strerror(&error)));
+	}
+	return zip;
+}
+
+namespace {
+
+// Hands libxml the entries as they are decompressed, as if they were one document
+struct ZipFeed {
+	zip_t* zip = nullptr;
+	const std::vector<zip_uint64_t>* entries = nullptr;
+	size_t entry = 0;
+	zip_file_t* zf = nullptr;
+	bool skip_decl = false;
+	std::string_view tail;
+	std::string pending;
+	size_t pos = 0;
+	const std::function<void(xmlNodePtr)>* closed = nullptr;
+};
+
+int zip_feed_read(void* ctx, char* out, int len) {
+	auto& feed = *static_cast<ZipFeed*>(ctx);
+	for (;;) {
+		if (feed.pos < feed.pending.size()) {
+			auto n = std::min(SZ(len), feed.pending.size() - feed.pos);
+			memcpy(out, feed.pending.data() + feed.pos, n);
+			feed.pos += n;
+			return SI(n);
+		}
+		if (feed.zf) {
+			auto n = zip_fread(feed.zf, out, SZ(len));
+			if (n < 0) {
+				return -1;
+			}
+			if (n > 0) {
+				return SI(n);
+			}
+			zip_fclose(feed.zf);
+			feed.zf = nullptr;
+			++feed.entry;
+			continue;
+		}
+		if (feed.entry < feed.entries->size()) {
+			feed.zf = zip_fopen_index(feed.zip, (*feed.entries)[feed.entry], 0);
+			if (feed.zf == nullptr) {
+				return -1;
+			}
+			if (feed.skip_decl) {
+				// The XML declaration is assumed to be within the first 4 KiB
+				feed.pending.resize(4096);
+				auto n = zip_fread(feed.zf, &feed.pending[0], feed.pending.size());
+				if (n < 0) {
+					return -1;
+				}
+				feed.pending.resize(SZ(n));
+				feed.pos = 0;
+				auto xs = feed.pending.find("?>\r\n");
+				if (xs != std::string::npos) {
+					feed.pos = xs + 4;
+				}
+				else if ((xs = feed.pending.find("?>\n")) != std::string::npos) {
+					feed.pos = xs + 3;
+				}
+			}
+			continue;
+		}
+		if (!feed.tail.empty()) {
+			feed.pending = feed.tail;
+			feed.pos = 0;
+			feed.tail = {};
+			continue;
+		}
+		return 0;
+	}
+}
+
+int zip_feed_close(void* ctx) {
+	auto& feed = *static_cast<ZipFeed*>(ctx);
+	if (feed.zf) {
+		zip_fclose(feed.zf);
+		feed.zf = nullptr;
+	}
+	return 0;
+}
+
+void zip_feed_end(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* uri) {
+	auto ctxt = static_cast<xmlParserCtxtPtr>(ctx);
+	auto node = ctxt->node;
+	xmlSAX2EndElementNs(ctx, localname, prefix, uri);
+	if (node) {
+		(*static_cast<ZipFeed*>(ctxt->_private)->closed)(node);
+	}
+}
+
+}
+
+xmlDocPtr zip_read_xml(zip_t* zip, const std::vector<zip_uint64_t>& entries, const char* url, const std::function<void(xmlNodePtr)>& closed, std::string_view head, std::string_view tail) {
+	ZipFeed feed;
+	feed.zip = zip;
+	feed.entries = &entries;
+	feed.skip_decl = !head.empty();
+	feed.pending = head;
+	feed.tail = tail;
+	feed.closed = &closed;
+
+	auto ctxt = xmlNewParserCtxt();
+	if (ctxt == nullptr) {
+		return nullptr;
+	}
+	if (closed) {
+		ctxt->_private = &feed;
+		ctxt->sax->endElementNs = zip_feed_end;
+	}
+	auto xml = xmlCtxtReadIO(ctxt, zip_feed_read, zip_feed_close, &feed, url, "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
+	xmlFreeParserCtxt(ctxt);
+	return xml;
+}
+
+static std::unique_ptr<DOM> extract_format(State& state, std::string_view format, zip_t* zip = nullptr) {
+	if (format == "docx") {
+		return extract_docx(state, zip);
+	}
+	if (format == "pptx") {
+		return extract_pptx(state, zip);
+	}
+	if (format == "odt" || format == "odp") {
+		return extract_odt(state, zip);
+	}
+	if (format == "html") {
+		return extract_html(state);
+	}
+	if (format == "html-fragment") {
+		return extract_html_fragment(state);
+	}
+	if (format == "tei") {
+		return extract_tei(state);
+	}
+	if (format == "text") {
+		return extract_text(state);
+	}
+	if (format == "line") {
+		return extract_text(state, true);
+	}
+	throw std::runtime_error(concat("Unknown format: ", format));
+}
+
+// Refuses a document that is projected to need more than --max-memory, unless a lower-memory path brings it within
+static void extract_budget(Settings& settings, State& state, std::string_view format, std::unique_ptr<zip_t, decltype(&zip_discard)>& zip) {
+	if (!settings.max_memory) {
+		return;
+	}
+
+	// What the projection goes by is the XML that gets parsed, which for office documents is only some of the archive
+	size_t bytes = 0;
+	bool zipped = (format == "docx" || format == "pptx" || format == "odt" || format == "odp");
+	if (zipped) {
+		if (!zip) {
+			zip.reset(original_zip(state, format));
+		}
+		auto add = [&](const std::string& name) {
+			zip_stat_t stat{};
+			if (zip_stat(zip.get(), name.c_str(), 0, &stat) != 0) {
+				return false;
+			}
+			bytes += stat.size;
+			return true;
+		};
+		if (format == "docx") {
+			add("word/document.xml");
+		}
+		else if (format == "pptx") {
+			for (int i = 1; add(concat("ppt/slides/slide", std::to_string(i), ".xml")); ++i) {
+			}
+		}
+		else {
+			add("content.xml");
+		}
+	}
+	if (bytes == 0) {
+		bytes = state.original.data() ? state.original.size() : SZ(fs::file_size("original"));
+	}
+
+	auto projected = mem_projected(format, bytes, settings.opt_stream_zip);
+	if (projected > settings.max_memory && zipped && !settings.opt_stream_zip && mem_projected(format, bytes, true) <= settings.max_memory) {
+		settings.opt_stream_zip = true;
+		projected = mem_projected(format, bytes, true);
+		if (settings.opt_verbose) {
+			std::cerr << "Using --stream-zip to stay within --max-memory" << std::endl;
+		}
+	}
+	mem_budget(settings, concat("this ", format, " document"), projected);
+}
+
+// With fused set, nothing is written anywhere: the original is read into memory, the state is an in-memory database, and the stream is handed over instead of saved
+void extract(Settings& settings, Fused* fused) {
 	fs::path& tmpdir = settings.tmpdir;
 	fs::path& infile = settings.infile;
 	std::string_view& format = settings.format;
@@ -44,7 +272,7 @@ void extract(Settings& settings) {
 	}
 
 	// Did not get --dir, so try to make a working dir in a temporary location
-	if (tmpdir.empty()) {
+	if (tmpdir.empty() && !fused) {
 		std::string name{ "transfuse-" };
 		std::random_device rd;
 		auto rnd = UI64(rd()) | (UI64(rd()) << UI64(32));
@@ -78,35 +306,62 @@ void extract(Settings& settings) {
 			}
 		}
 	}
-	if (tmpdir.empty()) {
+	if (tmpdir.empty() && !fused) {
 		throw std::runtime_error("Could not create state folder in any of OS temporary folder, $TMPDIR, $TEMPDIR, $TMP, $TEMP, or /tmp");
 	}
-	if (wipe) {
+
+	// Keep what the previous injection translated, then start over with the new document
+	std::unordered_map<std::string, std::string> translated;
+	if (settings.opt_incremental && (fs::exists(tmpdir / "state.sqlite3") || fs::exists(tmpdir / "state.tfs"))) {
+		auto curdir = fs::current_path();
+		fs::current_path(tmpdir);
+		translated = State(&settings, true).translated();
+		fs::current_path(curdir);
 		if (settings.opt_verbose) {
-			std::cerr << "Removing state folder " << tmpdir << std::endl;
+			std::cerr << "Previously translated blocks: " << translated.size() << std::endl;
 		}
-		try {
-			fs::remove_all(tmpdir);
+		wipe = true;
+	}
+
+	if (!fused) {
+		if (wipe) {
+			if (settings.opt_verbose) {
+				std::cerr << "Removing state folder " << tmpdir << std::endl;
+			}
+			try {
+				fs::remove_all(tmpdir);
+			}
+			catch (...) {
+			}
 		}
-		catch (...) {
+		fs::create_directories(tmpdir);
+		if (!fs::exists(tmpdir)) {
+			throw std::runtime_error(concat("State folder did not exist and could not be created: ", tmpdir.string()));
 		}
-	}
-	fs::create_directories(tmpdir);
-	if (!fs::exists(tmpdir)) {
-		throw std::runtime_error(concat("State folder did not exist and could not be created: ", tmpdir.string()));
-	}
 
-	if (settings.opt_verbose) {
-		std::cerr << "State folder: " << tmpdir << std::endl;
+		if (settings.opt_verbose) {
+			std::cerr << "State folder: " << tmpdir << std::endl;
+		}
 	}
 
 	std::unique_ptr<State> state;
 	std::unique_ptr<DOM> dom;
 
 	// If the folder already contains an extraction, assume the user just wants to output the existing extraction again, potentially in another stream format
-	if (!fs::exists(tmpdir / "extracted")) {
-		// If input is coming from stdin, put it into a file that we can manipulate
-		if (infile == "-") {
+	if (fused || !fs::exists(tmpdir / "extracted")) {
+		// Fused clean only needs the original in memory, and otherwise if input is coming from stdin, put it into a file that we can manipulate
+		if (fused) {
+			if (settings.opt_verbose) {
+				std::cerr << "Reading original into memory" << std::endl;
+			}
+			if (infile == "-") {
+				fused->original.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+			}
+			else {
+				fused->original = file_load(infile);
+			}
+		}
+		else if (infile == "-") {
 			if (settings.opt_verbose) {
 				std::cerr << "Reading original from stdin" << std::endl;
 			}
@@ -133,85 +388,25 @@ void extract(Settings& settings) {
 			}
 		}
 
-		fs::current_path(tmpdir);
-
-		state = std::make_unique<State>(&settings);
+		if (fused) {
+			state = std::make_unique<State>(&settings, false, true);
+			state->original = fused->original;
+		}
+		else {
+			fs::current_path(tmpdir);
+			state = std::make_unique<State>(&settings);
+		}
 		state->name(infile.filename().string());
 
+		// The archive sniffing opened is closed here if anything throws before extraction takes it over
+		std::unique_ptr<zip_t, decltype(&zip_discard)> zip(nullptr, &zip_discard);
 		if (format == "auto") {
-			auto ext = infile.extension().string();
-			if (!ext.empty()) {
-				ext = ext.substr(1);
-			}
-			to_lower(ext);
-
-			if (ext == "docx") {
-				format = "docx";
-			}
-			else if (ext == "pptx") {
-				format = "pptx";
-			}
-			else if (ext == "odt") {
-				format = "odt";
-			}
-			else if (ext == "odp") {
-				format = "odp";
-			}
-			else if (ext == "xml") {
-				format = "tei";
-			}
-			else if (ext == "html" || ext == "htm") {
-				format = "html";
-			}
-			else if (ext == "text" || ext == "txt") {
-				format = "text";
-			}
-			else {
-				bool is_zip = []() {
-					char buf[4]{};
-					std::ifstream in("original", std::ios::binary);
-					in.exceptions(std::ios::badbit | std::ios::failbit);
-					in.read(buf, sizeof(buf));
-					return (buf[0] == 'P' && buf[1] == 'K' && ((buf[2] == '\x03' && buf[3] == '\x04') || (buf[2] == '\x05' && buf[3] == '\x06') || (buf[2] == '\x07' && buf[3] == '\x08')));
-				}();
-
-				if (is_zip) {
-					int e = 0;
-					auto zip = zip_open("original", ZIP_RDONLY, &e);
-					if (zip == nullptr) {
-						throw std::runtime_error(concat("Could not open zip file: ", std::to_string(e)));
-					}
-					if (zip_name_locate(zip, "word/document.xml", 0) >= 0) {
-						format = "docx";
-					}
-					else if (zip_name_locate(zip, "ppt/slides/slide1.xml", 0) >= 0) {
-						format = "pptx";
-					}
-					else if (zip_name_locate(zip, "[Content_Types].xml", 0) >= 0) {
-						format = "docx";
-					}
-					else if (zip_name_locate(zip, "content.xml", 0) >= 0) {
-						// ODP == ODT
-						format = "odt";
-					}
-					zip_close(zip);
-				}
-				else {
-					auto c = file_load("original");
-					to_lower(c);
-					if (c.find("</html>") != std::string::npos) {
-						format = "html";
-					}
-					else if (c.find("</tei>") != std::string::npos) {
-						format = "tei";
-					}
-					else if (c.find("</b>") != std::string::npos || c.find("</a>") != std::string::npos || c.find("</i>") != std::string::npos || c.find("</span>") != std::string::npos || c.find("</p>") != std::string::npos || c.find("</u>") != std::string::npos || c.find("</strong>") != std::string::npos || c.find("</em>") != std::string::npos || c.find("</s>") != std::string::npos || c.find("</q>") != std::string::npos || c.find("</font>") != std::string::npos) {
-						format = "html-fragment";
-					}
-					else {
-						format = "text";
-					}
-				}
+			auto sniffed = sniff(*state, infile);
+			zip.reset(sniffed.zip);
+			format = sniffed.format;
+			state->info("confidence", to_string(sniffed.confidence));
+			if (settings.opt_verbose) {
+				std::cerr << "Format sniffed by " << to_string(sniffed.confidence) << std::endl;
 			}
 		}
 		if (format == "auto") {
@@ -224,33 +419,8 @@ void extract(Settings& settings) {
 		state->format(format);
 		state->stream(stream);
 
-		if (format == "docx") {
-			dom = extract_docx(*state);
-		}
-		else if (format == "pptx") {
-			dom = extract_pptx(*state);
-		}
-		else if (format == "odt" || format == "odp") {
-			dom = extract_odt(*state);
-		}
-		else if (format == "html") {
-			dom = extract_html(*state);
-		}
-		else if (format == "html-fragment") {
-			dom = extract_html_fragment(*state);
-		}
-		else if (format == "tei") {
-			dom = extract_tei(*state);
-		}
-		else if (format == "text") {
-			dom = extract_text(*state);
-		}
-		else if (format == "line") {
-			dom = extract_text(*state, true);
-		}
-		else {
-			throw std::runtime_error(concat("Unknown format: ", format));
-		}
+		extract_budget(settings, *state, format, zip);
+		dom = extract_format(*state, format, zip.release());
 	}
 	else {
 		if (settings.opt_verbose) {
@@ -258,21 +428,103 @@ void extract(Settings& settings) {
 		}
 		fs::current_path(tmpdir);
 
-		auto xml = xmlReadFile("styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
-		if (xml == nullptr) {
-			throw std::runtime_error(concat("Could not parse styled.xml: ", xmlGetLastError()->message));
+		// The styled document is not kept, so run the format's extraction on the original again
+		state = std::make_unique<State>(&settings);
+		dom = extract_format(*state, state->format());
+	}
+	mem_phase(settings, "extract-parse");
+
+	if (!settings.cache.empty()) {
+		if (settings.opt_verbose) {
+			std::cerr << "Translation cache: " << settings.cache << std::endl;
 		}
-		state = std::make_unique<State>(&settings, true);
-		dom = std::make_unique<DOM>(*state, xml);
+		// Injection needs to know where to store new translations, even if it isn't told
+		state->info("cache", settings.cache.string());
+		dom->tm = std::make_unique<TMCache>(settings.cache);
 	}
 
+	dom->translated.swap(translated);
+	state->info("dedupe", settings.opt_dedupe ? "1" : "");
+	// A clean round trip throws the state away, so unless blocks are looked up or deduplicated, hashing them and storing a row each is wasted
+	// An extracted state folder may later be injected with --dir and read by --incremental, which both need the keys
+	dom->keyed = (settings.mode != "clean") || dom->tm || settings.opt_incremental || settings.opt_dedupe;
+
 	auto extracted = dom->extract_blocks();
+	dom->tm.reset();
+	mem_phase(settings, "extract-blocks");
+	if (settings.opt_verbose && settings.opt_incremental) {
+		std::cerr << "Blocks reused from previous injection: " << dom->reused << " of " << dom->blocks << std::endl;
+	}
+	if (settings.opt_verbose && !settings.cache.empty()) {
+		std::cerr << "Blocks found in cache: " << dom->cached << " of " << dom->blocks << std::endl;
+	}
+	if (settings.opt_verbose && settings.opt_dedupe) {
+		std::cerr << "Repeated blocks left out: " << dom->repeats << " of " << dom->blocks << std::endl;
+	}
+
+	if (fused) {
+		fused->stream = x2s(extracted);
+		fused->dom = std::move(dom);
+		fused->state = std::move(state);
+		if (settings.opt_verbose) {
+			std::cerr << "Extracted " << fused->stream.size() << " bytes of stream in memory" << std::endl;
+		}
+		return;
+	}
+
 	file_save("extracted", x2s(extracted));
 
-	auto cntx = xmlSaveToFilename("content.xml", "UTF-8", 0);
-	xmlSaveDoc(cntx, dom->xml.get());
-	xmlSaveClose(cntx);
+	// Split the stream into shards of roughly equal byte size, each cut at a block boundary and with its own copy of the header
+	if (settings.shards > 1) {
+		auto& starts = dom->block_starts;
+		auto head = starts.empty() ? extracted.size() : starts.front();
+		auto total = extracted.size() - head;
+		xmlString shard;
+		size_t b = 0;
+		for (size_t i = 1; i <= settings.shards; ++i) {
+			auto cut = head + total * i / settings.shards;
+			auto e = b;
+			while (e < starts.size() && starts[e] < cut) {
+				++e;
+			}
+			shard.assign(extracted, 0, head);
+			if (b < e) {
+				auto end = (e < starts.size()) ? starts[e] : extracted.size();
+				shard.append(extracted, starts[b], end - starts[b]);
+			}
+			file_save(concat("extracted.", std::to_string(i)), x2s(shard));
+			b = e;
+		}
+		if (settings.opt_verbose) {
+			std::cerr << "Stream split into " << settings.shards << " shards" << std::endl;
+		}
+	}
+
+	if (settings.opt_bundle) {
+		auto buf = xmlBufferCreate();
+		auto cntx = xmlSaveToBuffer(buf, "UTF-8", 0);
+		xmlSaveDoc(cntx, dom->xml.get());
+		xmlSaveClose(cntx);
+		std::string_view skeleton(reinterpret_cast<const char*>(xmlBufferContent(buf)), SZ(xmlBufferLength(buf)));
+		state->bundle("state.tfs", skeleton, file_load("original"));
+		xmlBufferFree(buf);
+
+		dom.reset();
+		state.reset();
+		fs::remove("state.sqlite3");
+		fs::remove("original");
+		fs::remove("content.xml");
+		if (settings.opt_verbose) {
+			std::cerr << "State bundled" << std::endl;
+		}
+	}
+	else {
+		auto cntx = xmlSaveToFilename("content.xml", "UTF-8", 0);
+		xmlSaveDoc(cntx, dom->xml.get());
+		xmlSaveClose(cntx);
+	}
 
+	mem_phase(settings, "extract-save");
 	if (settings.opt_verbose) {
 		std::cerr << "Extracted" << std::endl;
 	}
@@ -195,11 +195,125 @@ void docx_merge_wt(State& state, xmlDocPtr xml) {
 	state.commit();
 }
 
-std::unique_ptr<DOM> extract_docx(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
+// Whether any text in the subtree has a line terminator, which the . in the textual <w:r> pattern would not cross
+inline bool docx_has_eol(xmlNodePtr node) {
+	for (auto c = node->children; c != nullptr; c = c->next) {
+		if (c->children && docx_has_eol(c)) {
+			return true;
+		}
+		if (c->type != XML_TEXT_NODE || c->content == nullptr) {
+			continue;
+		}
+		for (auto p = c->content; *p; ++p) {
+			if ((*p >= '\n' && *p <= '\r') || (p[0] == 0xC2 && p[1] == 0x85) || (p[0] == 0xE2 && p[1] == 0x80 && (p[2] == 0xA8 || p[2] == 0xA9))) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// The same chaff removal that extract_docx() does on the text of document.xml, but on the parsed tree, for when --stream-zip never has that text.
+// Only looks at the children of the node, so it can run as each element is closed while parsing, which has already done the children's own children.
+void docx_strip_chaff(xmlNodePtr node) {
+	for (auto child = node->children; child != nullptr;) {
+		auto next = child->next;
+		if (child->type != XML_ELEMENT_NODE) {
+			child = next;
+			continue;
+		}
+
+		for (auto a = child->properties; a != nullptr;) {
+			auto an = a->next;
+			auto val = attr_value(a);
+			if ((is_attr(a, "xml"_xcv, "space"_xcv) && val == "preserve"_xcv)
+				|| (is_attr(a, "w"_xcv, "eastAsiaTheme"_xcv) && val == "minorHAnsi"_xcv)
+				|| (is_attr(a, "w"_xcv, "type"_xcv) && val == "textWrapping"_xcv)
+				|| (!val.empty() && (is_attr(a, "w"_xcv, "rsidP"_xcv) || is_attr(a, "w"_xcv, "rsidRDefault"_xcv) || is_attr(a, "w"_xcv, "rsidR"_xcv) || is_attr(a, "w"_xcv, "rsidRPr"_xcv) || is_attr(a, "w"_xcv, "rsidDel"_xcv)))) {
+				xmlRemoveProp(a);
+			}
+			a = an;
+		}
+
+		bool chaff = false;
+		if (is_element(child, "w"_xcv, "lang"_xcv) || is_element(child, "w"_xcv, "proofErr"_xcv)) {
+			chaff = (child->properties && !child->children);
+		}
+		else if (is_element(child, "w"_xcv, "noProof"_xcv) || is_element(child, "w"_xcv, "lastRenderedPageBreak"_xcv) || is_element(child, "w"_xcv, "rFonts"_xcv) || is_element(child, "w"_xcv, "softHyphen"_xcv)) {
+			chaff = is_bare(child);
+		}
+		else if (is_element(child, "w"_xcv, "color"_xcv)) {
+			auto a = child->properties;
+			chaff = (a && !a->next && !child->children && is_attr(a, "w"_xcv, "val"_xcv) && attr_value(a) == "auto"_xcv);
+		}
+		// The parsed tree can't tell <w:rPr></w:rPr> from <w:rPr/>, so both go
+		else if (is_element(child, "w"_xcv, "rPr"_xcv)) {
+			chaff = is_bare(child);
+		}
+		else if ((is_element(child, "w"_xcv, "br"_xcv) || is_element(child, "w"_xcv, "cr"_xcv) || is_element(child, "w"_xcv, "noBreakHyphen"_xcv)) && is_bare(child)) {
+			auto t = xmlNewDocNode(child->doc, child->ns, XC(child->ns ? "t" : "w:t"), XC(is_element(child, "w"_xcv, "noBreakHyphen"_xcv) ? "-" : "\n"));
+			xmlReplaceNode(child, t);
+			chaff = true;
+		}
+
+		if (chaff) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		}
+		child = next;
+	}
+
+	for (auto child = node->children; child != nullptr; child = child->next) {
+		// </w:t>...<w:t> with nothing but text between them become one w:t
+		if (is_element(child, "w"_xcv, "t"_xcv)) {
+			for (;;) {
+				auto t = child->next;
+				if (t && t->type == XML_TEXT_NODE) {
+					t = t->next;
+				}
+				if (t == nullptr || !is_element(t, "w"_xcv, "t"_xcv)) {
+					break;
+				}
+				while (child->next != t) {
+					auto between = child->next;
+					xmlUnlinkNode(between);
+					xmlFreeNode(between);
+				}
+				while (t->children) {
+					auto c = t->children;
+					xmlUnlinkNode(c);
+					xmlAddChild(child, c);
+				}
+				xmlUnlinkNode(t);
+				xmlFreeNode(t);
+			}
+		}
+		// Move <w:tab> to its very own <w:r> so it doesn't interfere with <w:t> merging or style hashing
+		else if (is_element(child, "w"_xcv, "r"_xcv) && child->children && !docx_has_eol(child)) {
+			for (auto tab = child->children; tab != nullptr; tab = tab->next) {
+				if (!is_element(tab, "w"_xcv, "tab"_xcv) || !is_bare(tab) || !tab->next || !is_element(tab->next, "w"_xcv, "t"_xcv) || tab->next->properties) {
+					continue;
+				}
+				// Cloning in the context of the destination reuses its namespaces instead of declaring them again
+				xmlNodePtr r = nullptr;
+				xmlDOMWrapCloneNode(nullptr, child->doc, child, &r, child->doc, node, 0, 0);
+				xmlAddPrevSibling(child, r);
+				for (auto c = child->children; c != tab; c = c->next) {
+					xmlNodePtr cp = nullptr;
+					xmlDOMWrapCloneNode(nullptr, child->doc, c, &cp, child->doc, r, 1, 0);
+					xmlAddChild(r, cp);
+				}
+				xmlUnlinkNode(tab);
+				xmlAddChild(r, tab);
+				break;
+			}
+		}
+	}
+}
+
+std::unique_ptr<DOM> extract_docx(State& state, zip_t* zip) {
 	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open DOCX file: ", std::to_string(e)));
+		zip = original_zip(state, "DOCX");
 	}
 
 	zip_stat_t stat{};
@@ -251,93 +365,102 @@ std::unique_ptr<DOM> extract_docx(State& state) {
 		throw std::runtime_error(concat("DOCX main document ", docname, " was empty"));
 	}
 
-	auto zf = zip_fopen_index(zip, stat.index, 0);
-	if (zf == nullptr) {
-		throw std::runtime_error(concat("Could not open DOCX main document ", docname));
-	}
+	xmlDocPtr xml = nullptr;
+	if (state.settings->opt_stream_zip) {
+		if (state.settings->opt_verbose) {
+			std::cerr << "Parsing document XML from the archive, deleting superfluous elements and attributes" << std::endl;
+		}
 
-	std::string data(stat.size, 0);
-	zip_fread(zf, &data[0], stat.size);
-	zip_fclose(zf);
+		xml = zip_read_xml(zip, { stat.index }, "document.xml", docx_strip_chaff);
+		zip_close(zip);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse document.xml: ", xmlGetLastError()->message));
+		}
+		docx_strip_chaff(reinterpret_cast<xmlNodePtr>(xml));
+	}
+	else {
+		auto zf = zip_fopen_index(zip, stat.index, 0);
+		if (zf == nullptr) {
+			throw std::runtime_error(concat("Could not open DOCX main document ", docname));
+		}
 
-	zip_close(zip);
+		std::string data(stat.size, 0);
+		zip_fread(zf, &data[0], stat.size);
+		zip_fclose(zf);
 
-	if (state.settings->opt_verbose) {
-		std::cerr << "Deleting superfluous elements and attributes" << std::endl;
-	}
+		zip_close(zip);
 
-	auto udata = UnicodeString::fromUTF8(data);
-
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
-
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	udata.findAndReplace(" xml:space=\"preserve\"", "");
-	udata.findAndReplace(" w:eastAsiaTheme=\"minorHAnsi\"", "");
-	udata.findAndReplace(" w:type=\"textWrapping\"", "");
-
-	UnicodeString tmp;
-
-	// Revision tracking information
-	rx_replaceAll(R"X( w:rsidP="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidRDefault="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidR="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidRPr="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidDel="[^"]+")X", "", udata, tmp);
-
-	// Other full-tag chaff, intentionally done after attributes because removing those may leave these tags empty
-	rx_replaceAll(R"X(<w:lang(?=[ >])[^/>]+/>)X", "", udata, tmp);
-	rx_replaceAll(R"X(<w:proofErr(?=[ >])[^/>]+/>)X", "", udata, tmp);
-
-	udata.findAndReplace("<w:noProof/>", "");
-	udata.findAndReplace("<w:lastRenderedPageBreak/>", "");
-	udata.findAndReplace("<w:color w:val=\"auto\"/>", "");
-	udata.findAndReplace("<w:rFonts/>", "");
-	udata.findAndReplace("<w:rFonts></w:rFonts>", "");
-	udata.findAndReplace("<w:rPr></w:rPr>", "");
-	udata.findAndReplace("<w:softHyphen/>", "");
-	udata.findAndReplace("<w:br/>", "<w:t>\n</w:t>");
-	udata.findAndReplace("<w:cr/>", "<w:t>\n</w:t>");
-	udata.findAndReplace("<w:noBreakHyphen/>", "<w:t>-</w:t>");
-
-	rx_replaceAll(R"X(</w:t>([^<>]*?)<w:t(?=[ >])[^>]*>)X", "", udata, tmp);
-
-	// Move <w:tab> to its very own <w:r> so it doesn't interfere with <w:t> merging or style hashing
-	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_wr(R"X(<w:r(?=[ >])[^>]*>.*?</w:r>)X", 0, status);
-
-	tmp.remove();
-	rx_wr.reset(udata);
-	int32_t last = 0;
-	while (rx_wr.find(last, status)) {
-		auto mb = rx_wr.start(0, status);
-		auto me = rx_wr.end(0, status);
-
-		tmp.append(udata, last, mb - last);
-		int32_t tab = 0;
-		if ((tab = udata.indexOf("<w:tab/><w:t>", mb, me - mb)) != -1) {
-			tmp.append(udata, mb, tab - mb);
-			tmp.append("<w:tab/></w:r>");
-			tmp.append(udata, mb, tab - mb);
-			tmp.append(udata, tab + 8, me - tab - 8);
+		if (state.settings->opt_verbose) {
+			std::cerr << "Deleting superfluous elements and attributes" << std::endl;
 		}
-		else {
-			tmp.append(udata, mb, me - mb);
+
+		auto udata = UnicodeString::fromUTF8(data);
+
+		udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
+
+		// Wipe chaff that's not relevant when translated, or simply superfluous
+		UnicodeString tmp;
+
+		// Each pass is a single scan, where UnicodeString::findAndReplace() would shift the rest of the document once per match
+		replace_all(udata, { u" xml:space=\"preserve\"", u" w:eastAsiaTheme=\"minorHAnsi\"", u" w:type=\"textWrapping\"" }, u"", tmp);
+
+		// Revision tracking information
+		strip_attr(udata, "w:rsidP", tmp);
+		strip_attr(udata, "w:rsidRDefault", tmp);
+		strip_attr(udata, "w:rsidR", tmp);
+		strip_attr(udata, "w:rsidRPr", tmp);
+		strip_attr(udata, "w:rsidDel", tmp);
+
+		// Other full-tag chaff, intentionally done after attributes because removing those may leave these tags empty
+		rx_replaceAll(R"X(<w:lang(?=[ >])[^/>]+/>)X", "", udata, tmp);
+		rx_replaceAll(R"X(<w:proofErr(?=[ >])[^/>]+/>)X", "", udata, tmp);
+
+		// Emptying an rPr must happen in an earlier pass than removing empty ones
+		replace_all(udata, { u"<w:noProof/>", u"<w:lastRenderedPageBreak/>", u"<w:color w:val=\"auto\"/>", u"<w:rFonts/>", u"<w:rFonts></w:rFonts>" }, u"", tmp);
+		replace_all(udata, { u"<w:rPr></w:rPr>", u"<w:softHyphen/>" }, u"", tmp);
+		replace_all(udata, { u"<w:br/>", u"<w:cr/>" }, u"<w:t>\n</w:t>", tmp);
+		replace_all(udata, { u"<w:noBreakHyphen/>" }, u"<w:t>-</w:t>", tmp);
+
+		rx_replaceAll(R"X(</w:t>([^<>]*?)<w:t(?=[ >])[^>]*>)X", "", udata, tmp);
+
+		// Move <w:tab> to its very own <w:r> so it doesn't interfere with <w:t> merging or style hashing
+		UErrorCode status = U_ZERO_ERROR;
+		auto& rx_wr = rx_matcher(R"X(<w:r(?=[ >])[^>]*>.*?</w:r>)X");
+
+		tmp.remove();
+		rx_wr.reset(udata);
+		int32_t last = 0;
+		while (rx_wr.find(last, status)) {
+			auto mb = rx_wr.start(0, status);
+			auto me = rx_wr.end(0, status);
+
+			tmp.append(udata, last, mb - last);
+			int32_t tab = 0;
+			if ((tab = udata.indexOf("<w:tab/><w:t>", mb, me - mb)) != -1) {
+				tmp.append(udata, mb, tab - mb);
+				tmp.append("<w:tab/></w:r>");
+				tmp.append(udata, mb, tab - mb);
+				tmp.append(udata, tab + 8, me - tab - 8);
+			}
+			else {
+				tmp.append(udata, mb, me - mb);
+			}
+			last = me;
 		}
-		last = me;
-	}
-	tmp.append(udata, last, udata.length() - last);
-	std::swap(tmp, udata);
+		tmp.append(udata, last, udata.length() - last);
+		std::swap(tmp, udata);
 
-	if (state.settings->opt_verbose) {
-		std::cerr << "Parsing document XML" << std::endl;
-	}
+		if (state.settings->opt_verbose) {
+			std::cerr << "Parsing document XML" << std::endl;
+		}
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "document.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse document.xml: ", xmlGetLastError()->message));
+		xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "document.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse document.xml: ", xmlGetLastError()->message));
+		}
+		udata.remove();
+		tmp.remove();
 	}
-	udata.remove();
-	tmp.remove();
 
 	docx_merge_wt(state, xml);
 
@@ -346,98 +469,101 @@ std::unique_ptr<DOM> extract_docx(State& state) {
 	dom->cmdline_tags();
 	dom->save_spaces();
 
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, xml, "UTF-8");
-	data.assign(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
-	cleanup_styles(state, data);
+	dom->cleanup_text_styles();
+	merge_adjacent(reinterpret_cast<xmlNodePtr>(xml), XC("tf-text"));
 
-	auto b = data.rfind("</tf-text><tf-text>");
-	while (b != std::string::npos) {
-		data.erase(b, 19);
-		b = data.rfind("</tf-text><tf-text>");
-	}
+	return dom;
+}
 
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(data.data()), SI(data.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
+// Whether the run is exactly <w:r><w:t/></w:r> or <w:r><w:t></w:t></w:r>
+inline bool docx_is_empty_run(xmlNodePtr r) {
+	if (r->properties || r->nsDef) {
+		return false;
+	}
+	auto t = r->children;
+	if (t == nullptr || t->next || !is_element(t, "w"_xcv, "t"_xcv) || t->properties || t->nsDef) {
+		return false;
+	}
+	for (auto c = t->children; c != nullptr; c = c->next) {
+		if (c->type != XML_TEXT_NODE || (c->content && c->content[0])) {
+			return false;
+		}
 	}
-	file_save("styled.xml", data);
+	return true;
+}
 
-	return dom;
+// DOCX can't have any text outside w:t, so text that injection left in <tf-text> or its hyperlinks is wrapped in runs of its own, in a way that does not inherit formatting.
+// Styled text already came back in runs with their recorded properties. In the same pass, empty runs are removed, the <tf-text> helper elements that we added are unwrapped,
+// and w:t and w:instrText are told to preserve whitespace, because DOCX by default ignores all leading/trailing whitespace.
+// ToDo: xml:space=preserve needs adjusting to only be added where it makes sense, such as not before punctuation
+void docx_fix_runs(xmlNodePtr node, bool in_text) {
+	for (auto child = node->children; child != nullptr;) {
+		auto next = child->next;
+
+		if (child->type == XML_TEXT_NODE) {
+			if (!in_text) {
+				child = next;
+				continue;
+			}
+			// Adjacent text nodes serialize as one text, so they go in one run
+			bool empty = true;
+			for (next = child; next != nullptr && next->type == XML_TEXT_NODE; next = next->next) {
+				empty = empty && !(next->content && next->content[0]);
+			}
+			if (!empty) {
+				auto ns = xmlSearchNs(node->doc, node, XC("w"));
+				auto r = xmlNewDocNode(node->doc, ns, XC(ns ? "r" : "w:r"), nullptr);
+				auto t = xmlNewDocNode(node->doc, ns, XC(ns ? "t" : "w:t"), nullptr);
+				xmlAddChild(r, t);
+				xmlAddPrevSibling(child, r);
+				while (child != next) {
+					auto n = child;
+					child = child->next;
+					xmlUnlinkNode(n);
+					xmlAddChild(t, n);
+				}
+				xmlSetProp(t, XC("xml:space"), XC("preserve"));
+			}
+			child = next;
+			continue;
+		}
+		if (child->type != XML_ELEMENT_NODE) {
+			child = next;
+			continue;
+		}
+
+		if (child->ns == nullptr && xmlStrcmp(child->name, XC("tf-text")) == 0) {
+			docx_fix_runs(child, true);
+			unwrap_node(child);
+		}
+		else if (is_element(child, "w"_xcv, "r"_xcv) && docx_is_empty_run(child)) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		}
+		else {
+			// <w:t/> is left alone, but anything else named w:t or w:instrText gets xml:space as its first attribute
+			if ((is_element(child, "w"_xcv, "t"_xcv) || is_element(child, "w"_xcv, "instrText"_xcv)) && (child->properties || child->nsDef || child->children)) {
+				set_first_prop(child, XC("xml:space"), XC("preserve"));
+			}
+			docx_fix_runs(child, in_text && is_element(child, "w"_xcv, "hyperlink"_xcv));
+		}
+		child = next;
+	}
 }
 
 std::string inject_docx(DOM& dom) {
+	docx_fix_runs(reinterpret_cast<xmlNodePtr>(dom.xml.get()), false);
+
 	auto buf = xmlBufferCreate();
 	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
 	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
 	std::string data(buf->content, buf->content + buf->use);
 	xmlBufferFree(buf);
 
-	auto udata = UnicodeString::fromUTF8(data);
-	UnicodeString tmp;
-
-	// DOCX can't have any text outside w:t
-	// Wrap tags around text after </w:t></w:r>, in a way that does not inherit formatting
-	rx_replaceAll(R"X((</w:t></w:r>)([^<>]+))X", "$1<w:r><w:t>$2</w:t></w:r>", udata, tmp);
-
-	// Ditto for text before <w:r>
-	rx_replaceAll(R"X(([^<>]+)(<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", "<w:r><w:t>$1</w:t></w:r>$2", udata, tmp);
-
-	// Ditto for text after </w:t></w:r></w:hyperlink>
-	rx_replaceAll(R"X((</w:t></w:r></w:hyperlink>)([^<>]+))X", "$1<w:r><w:t>$2</w:t></w:r>", udata, tmp);
-
-	// Ditto for text before <w:hyperlink>
-	rx_replaceAll(R"X(([^<>]+)(<w:hyperlink(?=[ >])[^>]*>.*?<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", "<w:r><w:t>$1</w:t></w:r>$2", udata, tmp);
-
-	// Move text from before <w:r><w:t> inside it
-	rx_replaceAll_expand_21(R"X(([^>])(<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", udata, tmp);
-
-	// Move text from before <w:hyperlink><w:r><w:t> inside it
-	rx_replaceAll_expand_21(R"X(([^>])(<w:hyperlink(?=[ >])[^>]*>.*?<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", udata, tmp);
-
-	// Remove empty text elements
-	rx_replaceAll(R"X(<w:r><w:t/></w:r>)X", "", udata, tmp);
-	rx_replaceAll(R"X(<w:r><w:t></w:t></w:r>)X", "", udata, tmp);
-
-	// Remove the <tf-text> helper elements that we added
-	rx_replaceAll(R"X(<tf-text>([^<>]+)<w:r)X", "<w:r><w:t>$1</w:t></w:r>", udata, tmp);
-	rx_replaceAll(R"X(</w:r>([^<>]+)</tf-text>)X", "<w:r><w:t>$1</w:t></w:r>", udata, tmp);
-	rx_replaceAll(R"X(<tf-text>([^<>]+)</tf-text>)X", "<w:r><w:t>$1</w:t></w:r>", udata, tmp);
-	rx_replaceAll(R"X(</?tf-text/?>)X", "", udata, tmp);
-
-	// DOCX by default does ignores all leading/trailing whitespace, so tell it not do.
-	// ToDo: xml:space=preserve needs adjusting to only be added where it makes sense, such as not before punctuation
-	rx_replaceAll(R"X(<w:(t|instrText)([ >]))X", "<w:$1 xml:space=\"preserve\"$2", udata, tmp);
-
-	data.clear();
-	udata.toUTF8String(data);
-	file_save("injected.xml", data);
-
-	hook_inject(dom.state.settings, "injected.xml");
-
-	fs::copy("original", "injected.docx");
-
-	int e = 0;
-	auto zip = zip_open("injected.docx", 0, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open DOCX file: ", std::to_string(e)));
-	}
-
-	auto src = zip_source_file(zip, "injected.xml", 0, 0);
-	if (src == nullptr) {
-		throw std::runtime_error("Could not open injected.xml");
-	}
+	hook_inject(dom.state.settings, dom.state.format(), "injected.xml", data);
 
 	auto docname = dom.state.info("docx-document-main");
-	if (zip_file_add(zip, docname.c_str(), src, ZIP_FL_OVERWRITE) < 0) {
-		throw std::runtime_error(concat("Could not replace main document ", docname));
-	}
-
-	zip_close(zip);
-
-	return "injected.docx";
+	return zip_replace(dom.original, { { docname, data } }, "DOCX");
 }
 
 }
@@ -22,7 +22,7 @@ using namespace icu;
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_html_fragment(State& state) {
-	auto raw_data = file_load("original");
+	auto raw_data = original_load(state);
 	auto enc = detect_encoding(raw_data);
 
 	auto data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
@@ -34,7 +34,7 @@ std::unique_ptr<DOM> extract_html_fragment(State& state) {
 }
 
 std::string inject_html_fragment(DOM& dom) {
-	auto fragment = file_load(inject_html(dom));
+	auto fragment = inject_html_data(dom);
 
 	auto e = fragment.find("</body>");
 	fragment.erase(e);
@@ -42,11 +42,9 @@ std::string inject_html_fragment(DOM& dom) {
 	auto b = fragment.find("<body>");
 	fragment.erase(0, b + 6);
 
-	file_save("injected.fragment", fragment);
+	hook_inject(dom.state.settings, dom.state.format(), "injected.fragment", fragment);
 
-	hook_inject(dom.state.settings, "injected.fragment");
-
-	return "injected.fragment";
+	return fragment;
 }
 
 }
@@ -20,6 +20,7 @@
 #include "state.hpp"
 #include "dom.hpp"
 #include "formats.hpp"
+#include "sniff.hpp"
 #include <libxml/HTMLparser.h>
 #include <libxml/tree.h>
 #include <libxml/xmlsave.h>
@@ -65,28 +66,23 @@ inline void append_xml(UnicodeString& str, const UnicodeString& xc, bool nls = f
 
 std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeString> data) {
 	if (!data) {
-		auto raw_data = file_load("original");
+		auto raw_data = original_load(state);
 		auto enc = detect_encoding(raw_data);
 		data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
 
 		// If there is no closing tag, this can't be a fully formed valid HTML document
-		if (data->indexOf("</html>") == -1 && data->indexOf("</HTML>") == -1) {
-			// Perform expensive lower-casing and check again, just in case someone uses </Html> or similar
-			auto tmp = *data;
-			tmp.toLower();
-			if (tmp.indexOf("</html>") == -1) {
-				state.format("html-fragment");
-				return extract_html_fragment(state);
-			}
+		// It is usually at the very end, so look there first, and only then through all of it for </Html> or similar
+		std::u16string_view view(data->getBuffer(), SZ(data->length()));
+		auto tail = view.substr(view.size() - std::min(view.size(), sniff_window));
+		if (ifind(tail, "</html>") == std::u16string_view::npos && ifind(view, "</html>") == std::u16string_view::npos) {
+			state.format("html-fragment");
+			return extract_html_fragment(state);
 		}
 	}
 
 	// Find any charset="" charset='' charset= and replace with a placeholder that we will set to UTF-8 in injection
 	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx(R"X(charset\s*=(["']?)\s*([-\w\d]+)\s*(["']?))X", UREGEX_CASE_INSENSITIVE, status);
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Could not create RegexMatcher: ", u_errorName(status)));
-	}
+	auto& rx = rx_matcher(R"X(charset\s*=(["']?)\s*([-\w\d]+)\s*(["']?))X", UREGEX_CASE_INSENSITIVE);
 
 	rx.reset(*data);
 	if (rx.find()) {
@@ -109,9 +105,10 @@ std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeStri
 
 	{
 		// Protect <script> and <style> because they may contain unescaped & and other meta-characters that annoy the XML parser
-		RegexMatcher _rx_script(R"X(<script[^<>]*>(.*?)</script[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE, status);
-		RegexMatcher _rx_style(R"X(<style[^<>]*>(.*?)</style[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE, status);
-		RegexMatcher* rx_ss[]{ &_rx_script, &_rx_style };
+		RegexMatcher* rx_ss[]{
+			&rx_matcher(R"X(<script[^<>]*>(.*?)</script[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE),
+			&rx_matcher(R"X(<style[^<>]*>(.*?)</style[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE),
+		};
 		std::string tmp_str;
 		std::string tmp_p;
 		for (auto& rxs : rx_ss) {
@@ -142,24 +139,24 @@ std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeStri
 
 		// Wipe <wbr>, &shy;, and all other forms soft-hyphens can take
 		UnicodeString tmp;
-		RegexMatcher rx_shy(R"X((<wbr\s*/?>)|(\u00ad)|(&shy;)|(&#173;)|(&#x(0*)ad;))X", UREGEX_CASE_INSENSITIVE, status);
+		auto& rx_shy = rx_matcher(R"X((<wbr\s*/?>)|(\u00ad)|(&shy;)|(&#173;)|(&#x(0*)ad;))X", UREGEX_CASE_INSENSITIVE);
 		rx_shy.reset(*data);
 		tmp = rx_shy.replaceAll("", status);
 		std::swap(tmp, *data);
 
 		// Add spaces around <sub> and <sup> where needed, and record that we've done so
-		RegexMatcher rx_subp_open(R"X(([^>\s])(<su[bp])( |>))X", UREGEX_CASE_INSENSITIVE, status);
+		auto& rx_subp_open = rx_matcher(R"X(([^>\s])(<su[bp])( |>))X", UREGEX_CASE_INSENSITIVE);
 		rx_subp_open.reset(*data);
 		tmp = rx_subp_open.replaceAll("$1 $2 tf-added-before=\"1\"$3", status);
 		std::swap(tmp, *data);
 
-		RegexMatcher rx_subp_close(R"X(<(su[bp])( |>)(.*?)(</\1>)([^<\s]))X", UREGEX_CASE_INSENSITIVE, status);
+		auto& rx_subp_close = rx_matcher(R"X(<(su[bp])( |>)(.*?)(</\1>)([^<\s]))X", UREGEX_CASE_INSENSITIVE);
 		rx_subp_close.reset(*data);
 		tmp = rx_subp_close.replaceAll("<$1 tf-added-after=\"1\"$2$3$4 $5", status);
 		std::swap(tmp, *data);
 
 		tmp.remove();
-		RegexMatcher rx_cdata(R"X(<!\[CDATA\[(.*?)\]\]>)X", UREGEX_DOTALL, status);
+		auto& rx_cdata = rx_matcher(R"X(<!\[CDATA\[(.*?)\]\]>)X", UREGEX_DOTALL);
 		rx_cdata.reset(*data);
 		int32_t last = 0;
 		while (rx_cdata.find()) {
@@ -195,59 +192,89 @@ std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeStri
 	dom->cmdline_tags();
 	dom->save_spaces();
 
-	auto styled = dom->save_styles(true);
-	file_save("styled.xml", x2s(styled));
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
-	}
+	dom->apply_styles();
 
 	return dom;
 }
 
-std::string inject_html(DOM& dom) {
-	auto cntx = xmlSaveToFilename("injected.html", "UTF-8", XML_SAVE_AS_HTML);
+// Serializes the document as HTML and does the fixups that injection needs in one pass over the serializer's buffer
+std::string inject_html_data(DOM& dom) {
+	std::string line{ dom.original.substr(0, dom.original.find('\n')) };
+	bool had_doctype = to_lower(line).find("<!doctype") != std::string::npos;
+
+	auto buf = xmlBufferCreate();
+	auto cntx = xmlSaveToBuffer(buf, "UTF-8", XML_SAVE_AS_HTML);
 	xmlSaveDoc(cntx, dom.xml.get());
 	xmlSaveClose(cntx);
+	std::string_view data(reinterpret_cast<const char*>(buf->content), buf->use);
 
-	std::ifstream in("original", std::ios::binary);
-	in.exceptions(std::ios::badbit | std::ios::failbit);
-	std::string line;
-	std::getline(in, line);
-	bool had_doctype = to_lower(line).find("<!doctype") != std::string::npos;
-	in.close();
+	// Where to replace a stretch of the buffer, at most twice and in order
+	struct Edit {
+		size_t b, e;
+		std::string_view repl;
+	};
+	std::vector<Edit> edits;
 
-	auto content = file_load("injected.html");
-	auto b = content.find(XML_ENC_U8);
-	if (b != std::string::npos) {
-		content.replace(b, 3, "UTF-8");
-		// libxml2's serializer adds this <meta> tag to be helpful, but we already had one
+	auto enc = data.find(XML_ENC_U8);
+	if (enc != std::string_view::npos) {
+		// libxml2's serializer adds this <meta> tag to be helpful, but we already had one, which may be the one that gets this form once its encoding is replaced
 		std::string_view meta{ R"X(<meta http-equiv="Content-Type" content="text/html; charset=UTF-8">)X" };
-		auto m = content.find(meta);
-		if (m != std::string::npos) {
-			content.erase(m, meta.size());
+		auto pre = meta.substr(0, meta.find("UTF-8"));
+		auto m = data.find(meta);
+		if (enc >= pre.size() && data.substr(enc - pre.size(), pre.size()) == pre && data.substr(enc + 3, 2) == "\">" && enc - pre.size() < m) {
+			edits.push_back({ enc - pre.size(), enc + 5, "" });
+		}
+		else if (m < enc) {
+			edits.push_back({ m, m + meta.size(), "" });
+			edits.push_back({ enc, enc + 3, "UTF-8" });
+		}
+		else {
+			edits.push_back({ enc, enc + 3, "UTF-8" });
+			if (m != std::string_view::npos) {
+				edits.push_back({ m, m + meta.size(), "" });
+			}
 		}
 	}
+
+	std::string content;
+	content.reserve(data.size() + 16);
 	if (had_doctype) {
-		content.insert(0, "<!DOCTYPE html>\n");
+		content += "<!DOCTYPE html>\n";
 	}
 
-	b = content.find(TFU_OPEN);
-	while (b != std::string::npos) {
-		auto e = content.find(TFU_CLOSE, b);
-		std::string_view hash{&content[b + 3], e - b - 3};
+	size_t last = 0;
+	size_t edit = 0;
+	auto copy_to = [&](size_t e) {
+		for (; edit < edits.size() && edits[edit].b < e; ++edit) {
+			content.append(data, last, edits[edit].b - last);
+			content += edits[edit].repl;
+			last = edits[edit].e;
+		}
+		content.append(data, last, e - last);
+		last = e;
+	};
+
+	for (auto b = data.find(TFU_OPEN); b != std::string_view::npos; b = data.find(TFU_OPEN, last)) {
+		auto e = data.find(TFU_CLOSE, b);
+		copy_to(b);
+		auto hash = data.substr(b + 3, e - b - 3);
 		auto [topen, tclose, _] = dom.state.style("U", hash);
-		content.erase(content.begin() + PD(b), content.begin() + PD(e) + 3);
-		content.insert(content.begin() + PD(b), tclose.begin(), tclose.end());
-		content.insert(content.begin() + PD(b), topen.begin(), topen.end());
-		b = content.find(TFU_OPEN);
+		content += topen;
+		content += tclose;
+		last = e + 3;
 	}
+	copy_to(data.size());
+	xmlBufferFree(buf);
+
+	return content;
+}
 
-	file_save("injected.html", content);
+std::string inject_html(DOM& dom) {
+	auto content = inject_html_data(dom);
 
-	hook_inject(dom.state.settings, "injected.xml");
+	hook_inject(dom.state.settings, dom.state.format(), "injected.html", content);
 
-	return "injected.html";
+	return content;
 }
 
 }
@@ -35,11 +35,75 @@ struct ustring_hash {
 	size_t operator()(UnicodeString const& str) const { return hash_type{}(ustring_view(str.getBuffer(), str.length())); }
 };
 
-std::unique_ptr<DOM> extract_odt(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
+// The same chaff removal that extract_odt() does on the text of content.xml, but on the parsed tree, for when --stream-zip never has that text.
+// Only looks at the children of the node, as docx_strip_chaff() does. Styles that turn out identical are removed and their names recorded in renamed.
+void odt_strip_chaff(xmlNodePtr node, std::unordered_map<std::string, std::string>& styles, std::unordered_map<std::string, std::string>& renamed) {
+	for (auto child = node->children; child != nullptr;) {
+		auto next = child->next;
+		if (child->type != XML_ELEMENT_NODE) {
+			child = next;
+			continue;
+		}
+
+		for (auto a = child->properties; a != nullptr;) {
+			auto an = a->next;
+			if (!attr_value(a).empty() && (is_attr(a, "fo"_xcv, "language"_xcv) || is_attr(a, "style"_xcv, "language-complex"_xcv) || is_attr(a, "style"_xcv, "language-asian"_xcv)
+				|| is_attr(a, "fo"_xcv, "country"_xcv) || is_attr(a, "style"_xcv, "country-complex"_xcv) || is_attr(a, "style"_xcv, "country-asian"_xcv)
+				|| is_attr(a, "officeooo"_xcv, "paragraph-rsid"_xcv) || is_attr(a, "officeooo"_xcv, "rsid"_xcv))) {
+				xmlRemoveProp(a);
+			}
+			a = an;
+		}
+
+
+		if (is_element(child, "style"_xcv, "text-properties"_xcv) && is_bare(child)) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		}
+		// If the style, minus the unique name, is identical to an already seen style, replace it with the existing one
+		else if (is_element(child, "style"_xcv, "style"_xcv) && child->properties && is_attr(child->properties, "style"_xcv, "name"_xcv) && !attr_value(child->properties).empty()) {
+			auto name = child->properties;
+			child->properties = name->next;
+			auto buf = xmlBufferCreate();
+			xmlNodeDump(buf, child->doc, child, 0, 0);
+			child->properties = name;
+			std::string key(reinterpret_cast<const char*>(buf->content), buf->use);
+			xmlBufferFree(buf);
+
+			auto it = styles.find(key);
+			if (it != styles.end()) {
+				renamed[std::string(x2s(attr_value(name)))] = it->second;
+				xmlUnlinkNode(child);
+				xmlFreeNode(child);
+			}
+			else {
+				styles.emplace(std::move(key), x2s(attr_value(name)));
+			}
+		}
+		child = next;
+	}
+}
+
+void odt_rename_styles(xmlNodePtr node, const std::unordered_map<std::string, std::string>& renamed) {
+	for (auto child = node->children; child != nullptr; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		for (auto a = child->properties; a != nullptr; a = a->next) {
+			if (is_attr(a, "text"_xcv, "style-name"_xcv)) {
+				auto it = renamed.find(std::string(x2s(attr_value(a))));
+				if (it != renamed.end()) {
+					xmlNodeSetContent(reinterpret_cast<xmlNodePtr>(a), XC(it->second.c_str()));
+				}
+			}
+		}
+		odt_rename_styles(child, renamed);
+	}
+}
+
+std::unique_ptr<DOM> extract_odt(State& state, zip_t* zip) {
 	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open ODT/ODP file: ", std::to_string(e)));
+		zip = original_zip(state, "ODT/ODP");
 	}
 
 	zip_stat_t stat{};
@@ -50,88 +114,107 @@ std::unique_ptr<DOM> extract_odt(State& state) {
 		throw std::runtime_error("ODT/ODP content.xml was empty");
 	}
 
-	auto zf = zip_fopen_index(zip, stat.index, 0);
-	if (zf == nullptr) {
-		throw std::runtime_error("Could not open ODT/ODP content.xml");
-	}
-
-	std::string data(stat.size, 0);
-	zip_fread(zf, &data[0], stat.size);
-	zip_fclose(zf);
-
-	zip_close(zip);
-
-	// ToDo: Turn <text:tab> and <text:tab [^>]*> into \t?
-
-	UnicodeString tmp;
-	auto udata = UnicodeString::fromUTF8(data);
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
-
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	rx_replaceAll(R"X( fo:language="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:language-complex="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:language-asian="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( fo:country="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:country-complex="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:country-asian="[^"]+")X", "", udata, tmp);
-
-	// Revision tracking information
-	rx_replaceAll(R"X( officeooo:paragraph-rsid="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( officeooo:rsid="[^"]+")X", "", udata, tmp);
-
-	udata.findAndReplace("<style:text-properties/>", "");
-
-	UnicodeString normed = udata;
-	UnicodeString rpl;
-	std::unordered_map<UnicodeString, UnicodeString, ustring_hash> styles;
-	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_styles(R"X((<style:style style:name=")([^"]+)(".+?</style:style>))X", 0, status);
-
-	rx_styles.reset(udata);
-	while (rx_styles.find()) {
-		tmp.remove();
-
-		auto b1 = rx_styles.start(1, status);
-		auto e1 = rx_styles.end(1, status);
-		tmp.append(udata, b1, e1 - b1);
-
-		auto b3 = rx_styles.start(3, status);
-		auto e3 = rx_styles.end(3, status);
-		tmp.append(udata, b3, e3 - b3);
-
-		// If the style, minus the unique name, is identical to an already seen style, replace it with the existing one
-		auto it = styles.find(tmp);
-		if (it != styles.end()) {
-			auto b0 = rx_styles.start(0, status);
-			auto e0 = rx_styles.end(0, status);
-			tmp.setTo(udata, b0, e0 - b0);
-			normed.findAndReplace(tmp, "");
-
-			auto b2 = rx_styles.start(2, status);
-			auto e2 = rx_styles.end(2, status);
-			tmp.setTo(" text:style-name=\"");
-			tmp.append(udata, b2, e2 - b2);
-			tmp.append("\"");
-			rpl.setTo(" text:style-name=\"");
-			rpl.append(it->second);
-			rpl.append("\"");
-			normed.findAndReplace(tmp, rpl);
+	xmlDocPtr xml = nullptr;
+	if (state.settings->opt_stream_zip) {
+		std::unordered_map<std::string, std::string> styles;
+		std::unordered_map<std::string, std::string> renamed;
+		auto strip = [&](xmlNodePtr node) {
+			odt_strip_chaff(node, styles, renamed);
+		};
+		xml = zip_read_xml(zip, { stat.index }, "content.xml", strip);
+		zip_close(zip);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse content.xml: ", xmlGetLastError()->message));
 		}
-		else {
-			auto b2 = rx_styles.start(2, status);
-			auto e2 = rx_styles.end(2, status);
-			styles[tmp].setTo(udata, b2, e2 - b2);
+		strip(reinterpret_cast<xmlNodePtr>(xml));
+		if (!renamed.empty()) {
+			odt_rename_styles(reinterpret_cast<xmlNodePtr>(xml), renamed);
 		}
 	}
+	else {
+		auto zf = zip_fopen_index(zip, stat.index, 0);
+		if (zf == nullptr) {
+			throw std::runtime_error("Could not open ODT/ODP content.xml");
+		}
+
+		std::string data(stat.size, 0);
+		zip_fread(zf, &data[0], stat.size);
+		zip_fclose(zf);
+
+		zip_close(zip);
+
+		// ToDo: Turn <text:tab> and <text:tab [^>]*> into \t?
+
+		UnicodeString tmp;
+		auto udata = UnicodeString::fromUTF8(data);
+		udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
+
+		// Wipe chaff that's not relevant when translated, or simply superfluous
+		strip_attr(udata, "fo:language", tmp);
+		strip_attr(udata, "style:language-complex", tmp);
+		strip_attr(udata, "style:language-asian", tmp);
+		strip_attr(udata, "fo:country", tmp);
+		strip_attr(udata, "style:country-complex", tmp);
+		strip_attr(udata, "style:country-asian", tmp);
+
+		// Revision tracking information
+		strip_attr(udata, "officeooo:paragraph-rsid", tmp);
+		strip_attr(udata, "officeooo:rsid", tmp);
+
+		replace_all(udata, { u"<style:text-properties/>" }, u"", tmp);
+
+		UnicodeString normed = udata;
+		UnicodeString rpl;
+		std::unordered_map<UnicodeString, UnicodeString, ustring_hash> styles;
+		UErrorCode status = U_ZERO_ERROR;
+		auto& rx_styles = rx_matcher(R"X((<style:style style:name=")([^"]+)(".+?</style:style>))X");
+
+		rx_styles.reset(udata);
+		while (rx_styles.find()) {
+			tmp.remove();
+
+			auto b1 = rx_styles.start(1, status);
+			auto e1 = rx_styles.end(1, status);
+			tmp.append(udata, b1, e1 - b1);
+
+			auto b3 = rx_styles.start(3, status);
+			auto e3 = rx_styles.end(3, status);
+			tmp.append(udata, b3, e3 - b3);
+
+			// If the style, minus the unique name, is identical to an already seen style, replace it with the existing one
+			auto it = styles.find(tmp);
+			if (it != styles.end()) {
+				auto b0 = rx_styles.start(0, status);
+				auto e0 = rx_styles.end(0, status);
+				tmp.setTo(udata, b0, e0 - b0);
+				normed.findAndReplace(tmp, "");
+
+				auto b2 = rx_styles.start(2, status);
+				auto e2 = rx_styles.end(2, status);
+				tmp.setTo(" text:style-name=\"");
+				tmp.append(udata, b2, e2 - b2);
+				tmp.append("\"");
+				rpl.setTo(" text:style-name=\"");
+				rpl.append(it->second);
+				rpl.append("\"");
+				normed.findAndReplace(tmp, rpl);
+			}
+			else {
+				auto b2 = rx_styles.start(2, status);
+				auto e2 = rx_styles.end(2, status);
+				styles[tmp].setTo(udata, b2, e2 - b2);
+			}
+		}
 
-	udata.swap(normed);
+		udata.swap(normed);
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "content.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse content.xml: ", xmlGetLastError()->message));
+		xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "content.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse content.xml: ", xmlGetLastError()->message));
+		}
+		data.clear();
+		data.shrink_to_fit();
 	}
-	data.clear();
-	data.shrink_to_fit();
 
 	auto dom = std::make_unique<DOM>(state, xml);
 	dom->tags[Strs::tags_parents_allow] = make_xmlChars("text:h", "text:p");
@@ -140,43 +223,22 @@ std::unique_ptr<DOM> extract_odt(State& state) {
 	dom->cmdline_tags();
 	dom->save_spaces();
 
-	auto styled = dom->save_styles(true);
-	file_save("styled.xml", x2s(styled));
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
-	}
+	dom->apply_styles();
 
 	return dom;
 }
 
 std::string inject_odt(DOM& dom) {
-	auto cntx = xmlSaveToFilename("injected.xml", "UTF-8", 0);
+	auto buf = xmlBufferCreate();
+	auto cntx = xmlSaveToBuffer(buf, "UTF-8", 0);
 	xmlSaveDoc(cntx, dom.xml.get());
 	xmlSaveClose(cntx);
+	std::string data(reinterpret_cast<const char*>(buf->content), buf->use);
+	xmlBufferFree(buf);
 
-	hook_inject(dom.state.settings, "injected.xml");
-
-	fs::copy("original", "injected.odt");
-
-	int e = 0;
-	auto zip = zip_open("injected.odt", 0, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open ODT/ODP file: ", std::to_string(e)));
-	}
-
-	auto src = zip_source_file(zip, "injected.xml", 0, 0);
-	if (src == nullptr) {
-		throw std::runtime_error("Could not open injected.xml");
-	}
-
-	if (zip_file_add(zip, "content.xml", src, ZIP_FL_OVERWRITE) < 0) {
-		throw std::runtime_error("Could not replace content.xml");
-	}
-
-	zip_close(zip);
+	hook_inject(dom.state.settings, dom.state.format(), "injected.xml", data);
 
-	return "injected.odt";
+	return zip_replace(dom.original, { { "content.xml", data } }, "ODT/ODP");
 }
 
 }
@@ -146,76 +146,150 @@ void pptx_merge_at(State& state, xmlDocPtr xml) {
 	state.commit();
 }
 
-std::unique_ptr<DOM> extract_pptx(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open pptx file: ", std::to_string(e)));
-	}
-
-	std::string data{"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<tf-slides>"};
-	std::string slide;
-	for (int i = 1; ; ++i) {
-		char buffer[64]{};
-		sprintf(buffer, "ppt/slides/slide%d.xml", i);
+// The same chaff removal that extract_pptx() does on the text of the slides, but on the parsed tree, for when --stream-zip never has that text.
+// Only looks at the children of the node, as docx_strip_chaff() does.
+void pptx_strip_chaff(xmlNodePtr node) {
+	for (auto child = node->children; child != nullptr;) {
+		auto next = child->next;
+		if (child->type != XML_ELEMENT_NODE) {
+			child = next;
+			continue;
+		}
 
-		zip_stat_t stat{};
-		if (zip_stat(zip, buffer, 0, &stat) != 0) {
-			// No more slides
-			break;
+		for (auto a = child->properties; a != nullptr;) {
+			auto an = a->next;
+			if (is_attr(a, ""_xcv, "lang"_xcv)) {
+				xmlRemoveProp(a);
+			}
+			a = an;
 		}
-		if (stat.size == 0) {
-			throw std::runtime_error(concat("Empty pptx slide ", buffer));
+
+		if (is_element(child, "a"_xcv, "rPr"_xcv) && is_bare(child)) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
 		}
+		child = next;
+	}
 
-		auto zf = zip_fopen_index(zip, stat.index, 0);
-		if (zf == nullptr) {
-			throw std::runtime_error(concat("Could not open pptx ", buffer));
+	// </a:t>...<a:t> with some text between them become one a:t
+	for (auto child = node->children; child != nullptr; child = child->next) {
+		if (!is_element(child, "a"_xcv, "t"_xcv)) {
+			continue;
 		}
+		for (;;) {
+			auto between = child->next;
+			if (between == nullptr || between->type != XML_TEXT_NODE || !between->content || !between->content[0]) {
+				break;
+			}
+			auto t = between->next;
+			if (t == nullptr || !is_element(t, "a"_xcv, "t"_xcv)) {
+				break;
+			}
+			xmlUnlinkNode(between);
+			xmlFreeNode(between);
+			while (t->children) {
+				auto c = t->children;
+				xmlUnlinkNode(c);
+				xmlAddChild(child, c);
+			}
+			xmlUnlinkNode(t);
+			xmlFreeNode(t);
+		}
+	}
+}
 
-		slide.resize(stat.size, 0);
-		zip_fread(zf, &slide[0], stat.size);
-		zip_fclose(zf);
+std::unique_ptr<DOM> extract_pptx(State& state, zip_t* zip) {
+	if (zip == nullptr) {
+		zip = original_zip(state, "pptx");
+	}
 
-		auto xs = slide.find("?>\r\n");
-		if (xs != std::string::npos) {
-			data.append(slide, xs + 4, std::string::npos);
+	xmlDocPtr xml = nullptr;
+	if (state.settings->opt_stream_zip) {
+		std::vector<zip_uint64_t> slides;
+		for (int i = 1; ; ++i) {
+			char buffer[64]{};
+			sprintf(buffer, "ppt/slides/slide%d.xml", i);
+
+			zip_stat_t stat{};
+			if (zip_stat(zip, buffer, 0, &stat) != 0) {
+				// No more slides
+				break;
+			}
+			if (stat.size == 0) {
+				throw std::runtime_error(concat("Empty pptx slide ", buffer));
+			}
+			slides.push_back(stat.index);
 		}
-		else {
-			xs = slide.find("?>\n");
-			data.append(slide, xs + 3, std::string::npos);
+
+		xml = zip_read_xml(zip, slides, "slides.xml", pptx_strip_chaff, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<tf-slides>", "</tf-slides>");
+		zip_close(zip);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse slides.xml: ", xmlGetLastError()->message));
 		}
+		pptx_strip_chaff(reinterpret_cast<xmlNodePtr>(xml));
 	}
-	data += "</tf-slides>";
+	else {
+		std::string data{"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<tf-slides>"};
+		std::string slide;
+		for (int i = 1; ; ++i) {
+			char buffer[64]{};
+			sprintf(buffer, "ppt/slides/slide%d.xml", i);
+
+			zip_stat_t stat{};
+			if (zip_stat(zip, buffer, 0, &stat) != 0) {
+				// No more slides
+				break;
+			}
+			if (stat.size == 0) {
+				throw std::runtime_error(concat("Empty pptx slide ", buffer));
+			}
 
-	zip_close(zip);
+			auto zf = zip_fopen_index(zip, stat.index, 0);
+			if (zf == nullptr) {
+				throw std::runtime_error(concat("Could not open pptx ", buffer));
+			}
 
-	auto udata = UnicodeString::fromUTF8(data);
+			slide.resize(stat.size, 0);
+			zip_fread(zf, &slide[0], stat.size);
+			zip_fclose(zf);
 
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
+			auto xs = slide.find("?>\r\n");
+			if (xs != std::string::npos) {
+				data.append(slide, xs + 4, std::string::npos);
+			}
+			else {
+				xs = slide.find("?>\n");
+				data.append(slide, xs + 3, std::string::npos);
+			}
+		}
+		data += "</tf-slides>";
+
+		zip_close(zip);
 
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	UnicodeString tmp;
-	UErrorCode status = U_ZERO_ERROR;
+		auto udata = UnicodeString::fromUTF8(data);
 
-	RegexMatcher rx_lang(R"X( lang="[^"]*")X", 0, status);
-	rx_lang.reset(udata);
-	tmp = rx_lang.replaceAll("", status);
-	std::swap(udata, tmp);
+		udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
 
-	udata.findAndReplace("<a:rPr/>", "");
+		// Wipe chaff that's not relevant when translated, or simply superfluous
+		UnicodeString tmp;
+		UErrorCode status = U_ZERO_ERROR;
 
-	RegexMatcher rx_wt(R"X(</a:t>([^<>]+?)<a:t(?=[ >])[^>]*>)X", 0, status);
-	rx_wt.reset(udata);
-	tmp = rx_wt.replaceAll("", status);
-	std::swap(udata, tmp);
+		strip_attr(udata, "lang", tmp, AttrValue::any);
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "slides.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse slides.xml: ", xmlGetLastError()->message));
+		replace_all(udata, { u"<a:rPr/>" }, u"", tmp);
+
+		auto& rx_wt = rx_matcher(R"X(</a:t>([^<>]+?)<a:t(?=[ >])[^>]*>)X");
+		rx_wt.reset(udata);
+		tmp = rx_wt.replaceAll("", status);
+		std::swap(udata, tmp);
+
+		xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "slides.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
+		if (xml == nullptr) {
+			throw std::runtime_error(concat("Could not parse slides.xml: ", xmlGetLastError()->message));
+		}
+		udata.remove();
+		tmp.remove();
 	}
-	udata.remove();
-	tmp.remove();
 
 	pptx_merge_at(state, xml);
 
@@ -224,79 +298,104 @@ std::unique_ptr<DOM> extract_pptx(State& state) {
 	dom->cmdline_tags();
 	dom->save_spaces();
 
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, xml, "UTF-8");
-	data.assign(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
-	cleanup_styles(state, data);
+	dom->cleanup_text_styles();
+	merge_adjacent(reinterpret_cast<xmlNodePtr>(xml), XC("tf-text"));
 
-	auto b = data.rfind("</tf-text><tf-text>");
-	while (b != std::string::npos) {
-		data.erase(b, 19);
-		b = data.rfind("</tf-text><tf-text>");
-	}
+	return dom;
+}
 
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(data.data()), SI(data.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
-	}
-	file_save("styled.xml", data);
+// pptx can't have any text outside a:t, so text that injection left in <tf-text> is moved inside the run before it, else inside the run after it, else into a run of its own.
+// In the same pass, empty runs are removed and the <tf-text> helper elements that we added are unwrapped.
+void pptx_fix_runs(xmlNodePtr node, bool in_text) {
+	for (auto child = node->children; child != nullptr;) {
+		auto next = child->next;
 
-	return dom;
+		if (child->type == XML_TEXT_NODE) {
+			if (!in_text) {
+				child = next;
+				continue;
+			}
+			// Adjacent text nodes serialize as one text, so they move together
+			bool empty = true;
+			for (next = child; next != nullptr && next->type == XML_TEXT_NODE; next = next->next) {
+				empty = empty && !(next->content && next->content[0]);
+			}
+			if (empty) {
+				child = next;
+				continue;
+			}
+
+			xmlNodePtr t = nullptr;
+			xmlNodePtr before = nullptr;
+			// After </a:t></a:r>
+			if (child->prev && is_element(child->prev, "a"_xcv, "r"_xcv) && child->prev->last && is_element(child->prev->last, "a"_xcv, "t"_xcv) && child->prev->last->children) {
+				t = child->prev->last;
+			}
+			// Before <a:r>...<a:t>
+			else if (next && is_element(next, "a"_xcv, "r"_xcv)) {
+				for (auto c = next->children; c != nullptr; c = c->next) {
+					if (is_element(c, "a"_xcv, "t"_xcv)) {
+						t = c;
+						before = c->children;
+						break;
+					}
+				}
+			}
+			if (t == nullptr) {
+				auto ns = xmlSearchNs(node->doc, node, XC("a"));
+				auto r = xmlNewDocNode(node->doc, ns, XC(ns ? "r" : "a:r"), nullptr);
+				t = xmlNewDocNode(node->doc, ns, XC(ns ? "t" : "a:t"), nullptr);
+				xmlAddChild(r, t);
+				xmlAddPrevSibling(child, r);
+			}
+
+			while (child != next) {
+				auto n = child;
+				child = child->next;
+				xmlUnlinkNode(n);
+				if (before) {
+					xmlAddPrevSibling(before, n);
+				}
+				else {
+					xmlAddChild(t, n);
+				}
+			}
+			continue;
+		}
+		if (child->type != XML_ELEMENT_NODE) {
+			child = next;
+			continue;
+		}
+
+		if (child->ns == nullptr && xmlStrcmp(child->name, XC("tf-text")) == 0) {
+			pptx_fix_runs(child, true);
+			unwrap_node(child);
+		}
+		// Exactly <a:r><a:t/></a:r>
+		else if (is_element(child, "a"_xcv, "r"_xcv) && !child->properties && !child->nsDef && child->children && !child->children->next && is_element(child->children, "a"_xcv, "t"_xcv) && !child->children->properties && !child->children->nsDef && !child->children->children) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		}
+		else {
+			pptx_fix_runs(child, false);
+		}
+		child = next;
+	}
 }
 
 std::string inject_pptx(DOM& dom) {
+	pptx_fix_runs(reinterpret_cast<xmlNodePtr>(dom.xml.get()), false);
+
 	auto buf = xmlBufferCreate();
 	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
 	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
 	std::string data(buf->content, buf->content + buf->use);
 	xmlBufferFree(buf);
 
-	auto udata = UnicodeString::fromUTF8(data);
-	UnicodeString tmp;
-	UErrorCode status = U_ZERO_ERROR;
-
-	// pptx can't have any text outside a:t
-	// Move text from after </a:t></a:r> inside it
-	RegexMatcher rx_after_r(R"X((</a:t></a:r>)([^<>]+))X", 0, status);
-	rx_after_r.reset(udata);
-	tmp = rx_after_r.replaceAll("$2$1", status);
-	std::swap(udata, tmp);
-
-	// Move text from before <a:r><a:t> inside it
-	RegexMatcher rx_before_r(R"X(([^<>]+)(<a:r(?=[ >][^>]*>).*?<a:t(?=[ >])[^>]*>))X", 0, status);
-	rx_before_r.reset(udata);
-	tmp = rx_before_r.replaceAll("$2$1", status);
-	std::swap(udata, tmp);
-
-	// Remove empty text elements
-	RegexMatcher rx_snip_empty(R"X(<a:r><a:t/></a:r>)X", 0, status);
-	rx_snip_empty.reset(udata);
-	tmp = rx_snip_empty.replaceAll("", status);
-	std::swap(udata, tmp);
-
-	// Remove the <tf-text> helper elements that we added
-	RegexMatcher rx_snip_tf(R"X(</?tf-text>)X", 0, status);
-	rx_snip_tf.reset(udata);
-	tmp = rx_snip_tf.replaceAll("", status);
-	std::swap(udata, tmp);
-
-	data.clear();
-	udata.toUTF8String(data);
-	file_save("injected.xml", data);
-
-	hook_inject(dom.state.settings, "injected.xml");
-
-	fs::copy("original", "injected.pptx");
-
-	int er = 0;
-	auto zip = zip_open("injected.pptx", 0, &er);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open pptx file: ", std::to_string(er)));
-	}
+	hook_inject(dom.state.settings, dom.state.format(), "injected.xml", data);
 
 	std::deque<std::string> slides;
+	std::vector<std::pair<std::string, std::string_view>> entries;
 	size_t b = data.find("<p:sld ");
 	size_t e = data.find("</p:sld>", b);
 	int i = 0;
@@ -309,23 +408,13 @@ std::string inject_pptx(DOM& dom) {
 		auto& slide = slides.back();
 		slide = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n";
 		slide.append(data, b, (e - b) + 8);
-
-		auto src = zip_source_buffer(zip, slide.c_str(), slide.size(), 0);
-		if (src == nullptr) {
-			throw std::runtime_error(concat("Could not create buffer for ", buffer));
-		}
-
-		if (zip_file_add(zip, buffer, src, ZIP_FL_OVERWRITE) < 0) {
-			throw std::runtime_error(concat("Could not replace ", buffer));
-		}
+		entries.emplace_back(buffer, slide);
 
 		b = data.find("<p:sld ", e);
 		e = data.find("</p:sld>", b);
 	}
 
-	zip_close(zip);
-
-	return "injected.pptx";
+	return zip_replace(dom.original, entries, "pptx");
 }
 
 }
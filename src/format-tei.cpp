@@ -26,13 +26,14 @@
 #include <libxml/xmlsave.h>
 #include <unicode/regex.h>
 #include <unicode/ustring.h>
+#include <array>
 #include <memory>
 using namespace icu;
 
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_tei(State& state) {
-	auto raw_data = file_load("original");
+	auto raw_data = original_load(state);
 	auto enc = detect_encoding(raw_data);
 	UnicodeString data = to_ustring(raw_data, enc);
 	UnicodeString tmp;
@@ -57,12 +58,7 @@ std::unique_ptr<DOM> extract_tei(State& state) {
 	dom->cmdline_tags();
 	dom->save_spaces();
 
-	auto styled = dom->save_styles(true);
-	file_save("styled.xml", x2s(styled));
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
-	}
+	dom->apply_styles();
 
 	if (state.settings->opt_verbose) {
 		std::cerr << "TEI ready for extraction" << std::endl;
@@ -75,24 +71,71 @@ std::string inject_tei(DOM& dom) {
 	auto buf = xmlBufferCreate();
 	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
 	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
-	std::string data(buf->content, buf->content + buf->use);
+	std::string_view xml(reinterpret_cast<const char*>(buf->content), buf->use);
+
+	// Turn the <lb> that extraction added back into plain <lb/>, eating the space it added around them, and remove the markers from any others.
+	// This is one pass, where a match is only taken if the earlier, more specific rules would not have taken the space it eats.
+	std::array<std::string_view, 4> lb_2{ {
+		" <lb tf-added-before=\"1\" tf-added-before=\"1\"/> ",
+		" <lb tf-added-before=\"1\" tf-added-after=\"1\"/> ",
+		" <lb tf-added-after=\"1\" tf-added-before=\"1\"/> ",
+		" <lb tf-added-after=\"1\" tf-added-after=\"1\"/> ",
+	} };
+	std::string_view lb_b{ " <lb tf-added-before=\"1\"/>" };
+	std::string_view lb_a{ "<lb tf-added-after=\"1\"/> " };
+	std::string_view at_b{ " tf-added-before=\"1\"" };
+	std::string_view at_a{ " tf-added-after=\"1\"" };
+
+	auto is_at = [&](size_t p, std::string_view what) {
+		return p <= xml.size() && xml.compare(p, what.size(), what) == 0;
+	};
+	// Length of the <lb> with both markers at p, or 0
+	auto lb_2_at = [&](size_t p) -> size_t {
+		for (auto lb : lb_2) {
+			if (is_at(p, lb)) {
+				return lb.size();
+			}
+		}
+		return 0;
+	};
+
+	std::string data;
+	data.reserve(xml.size());
+	size_t last = 0;
+	for (auto i = xml.find("tf-added-"); i != std::string_view::npos; i = xml.find("tf-added-", i + 1)) {
+		size_t b = 0;
+		size_t e = 0;
+		std::string_view repl{ "<lb/>" };
+		if (i >= 5 && i - 5 >= last && lb_2_at(i - 5)) {
+			b = i - 5;
+			e = b + lb_2_at(b);
+		}
+		else if (i >= 5 && i - 5 >= last && is_at(i - 5, lb_b)) {
+			b = i - 5;
+			e = b + lb_b.size();
+		}
+		else if (i >= 4 && i - 4 >= last && is_at(i - 4, lb_a) && !lb_2_at(i - 4 + lb_a.size() - 1) && !is_at(i - 4 + lb_a.size() - 1, lb_b)) {
+			b = i - 4;
+			e = b + lb_a.size();
+		}
+		else if (i >= 1 && i - 1 >= last && (is_at(i - 1, at_b) || is_at(i - 1, at_a))) {
+			b = i - 1;
+			e = b + (is_at(b, at_b) ? at_b.size() : at_a.size());
+			repl = {};
+		}
+		else {
+			continue;
+		}
+		data.append(xml, last, b - last);
+		data += repl;
+		last = e;
+	}
+	data.append(xml, last);
 	xmlBufferFree(buf);
 
-	auto udata = UnicodeString::fromUTF8(data);
-	UnicodeString tmp;
-
-	rx_replaceAll(R"X( <lb tf-added-(before|after)=\"1\" tf-added-(before|after)=\"1\"/> )X", "<lb/>", udata, tmp);
-	rx_replaceAll(R"X( <lb tf-added-before=\"1\"/>)X", "<lb/>", udata, tmp);
-	rx_replaceAll(R"X(<lb tf-added-after=\"1\"/> )X", "<lb/>", udata, tmp);
-	rx_replaceAll(R"X( tf-added-(before|after)=\"1\")X", "", udata, tmp);
-
-	data.clear();
-	udata.toUTF8String(data);
-	file_save("injected.xml", data);
-
-	hook_inject(dom.state.settings, "injected.xml");
+	hook_inject(dom.state.settings, dom.state.format(), "injected.xml", data);
 
-	return "injected.xml";
+	return data;
 }
 
 }
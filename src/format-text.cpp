@@ -22,28 +22,51 @@ using namespace icu;
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_text(State& state, bool by_line) {
-	auto raw_data = file_load("original");
+	auto raw_data = original_load(state);
 	auto enc = detect_encoding(raw_data);
 
 	auto data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
-	data->findAndReplace("&", "&amp;");
-	data->findAndReplace("<", "&lt;");
-	data->findAndReplace(">", "&gt;");
-	data->findAndReplace("\"", "&quot;");
-	data->findAndReplace("'", "&apos;");
+	UnicodeString tmp;
+
+	// Escape in one pass, where UnicodeString::findAndReplace() would shift the rest of the text once per match
+	auto append = [&](std::u16string_view ent) {
+		tmp.append(ent.data(), SI32(ent.size()));
+	};
+	for (int32_t i = 0; i < data->length(); ++i) {
+		auto c = data->charAt(i);
+		if (c == '&') {
+			append(u"&amp;");
+		}
+		else if (c == '<') {
+			append(u"&lt;");
+		}
+		else if (c == '>') {
+			append(u"&gt;");
+		}
+		else if (c == '"') {
+			append(u"&quot;");
+		}
+		else if (c == '\'') {
+			append(u"&apos;");
+		}
+		else {
+			tmp.append(c);
+		}
+	}
+	std::swap(*data, tmp);
 
 	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_multiline(UnicodeString::fromUTF8(R"X(\n[\s\p{Zs}]*(\n[\s\p{Zs}]*)+)X"), 0, status);
+	auto& rx_multiline = rx_matcher(R"X(\n[\s\p{Zs}]*(\n[\s\p{Zs}]*)+)X");
 	rx_multiline.reset(*data);
 	*data = rx_multiline.replaceAll(UnicodeString::fromUTF8("</p><p>"), status);
 
 	if (by_line) {
-		data->findAndReplace("\n", "</p><p>");
+		replace_all(*data, { u"\n" }, u"</p><p>", tmp);
 	}
 	else {
-		data->findAndReplace("\n", "<br>\n");
+		replace_all(*data, { u"\n" }, u"<br>\n", tmp);
 	}
-	data->findAndReplace("</p><p>", "</p>\n<p>");
+	replace_all(*data, { u"</p><p>" }, u"</p>\n<p>", tmp);
 
 	data->insert(0, "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-16\"></head><body><p>");
 	data->append("</p></body></html>");
@@ -52,34 +75,64 @@ std::unique_ptr<DOM> extract_text(State& state, bool by_line) {
 }
 
 std::string inject_text(DOM& dom, bool by_line) {
-	auto txt = file_load(inject_html(dom));
-
-	auto e = txt.find("</p></body>");
-	txt.erase(e);
-
-	auto b = txt.find("<body><p>");
-	txt.erase(0, b + 9);
-
-	std::string tmp;
-	replace_all("<p>", "", txt, tmp);
-	replace_all("<br>", "", txt, tmp);
-	if (by_line) {
-		replace_all("</p>", "", txt, tmp);
-	}
-	else {
-		replace_all("</p>", "\n", txt, tmp);
+	auto html = inject_html_data(dom);
+	std::string_view body{ html };
+
+	auto e = body.find("</p></body>");
+	body = body.substr(0, e);
+
+	auto b = body.find("<body><p>");
+	body.remove_prefix(b + 9);
+
+	// Drop the paragraph tags and decode the entities in one pass, which is the same as doing each in turn because the decoded text is never looked at again
+	std::string txt;
+	txt.reserve(body.size());
+	size_t last = 0;
+	for (auto i = body.find_first_of("<&"); i != std::string_view::npos; i = body.find_first_of("<&", last)) {
+		txt.append(body, last, i - last);
+		last = i + 1;
+		auto rest = body.substr(i);
+		if (rest.compare(0, 3, "<p>") == 0) {
+			last = i + 3;
+		}
+		else if (rest.compare(0, 4, "<br>") == 0) {
+			last = i + 4;
+		}
+		else if (rest.compare(0, 4, "</p>") == 0) {
+			if (!by_line) {
+				txt += '\n';
+			}
+			last = i + 4;
+		}
+		else if (rest.compare(0, 4, "&lt;") == 0) {
+			txt += '<';
+			last = i + 4;
+		}
+		else if (rest.compare(0, 4, "&gt;") == 0) {
+			txt += '>';
+			last = i + 4;
+		}
+		else if (rest.compare(0, 6, "&quot;") == 0) {
+			txt += '"';
+			last = i + 6;
+		}
+		else if (rest.compare(0, 6, "&apos;") == 0) {
+			txt += '\'';
+			last = i + 6;
+		}
+		else if (rest.compare(0, 5, "&amp;") == 0) {
+			txt += '&';
+			last = i + 5;
+		}
+		else {
+			txt += body[i];
+		}
 	}
-	replace_all("&lt;", "<", txt, tmp);
-	replace_all("&gt;", ">", txt, tmp);
-	replace_all("&quot;", "\"", txt, tmp);
-	replace_all("&apos;", "'", txt, tmp);
-	replace_all("&amp;", "&", txt, tmp);
-
-	file_save("injected.txt", txt);
+	txt.append(body, last);
 
-	hook_inject(dom.state.settings, "injected.txt");
+	hook_inject(dom.state.settings, dom.state.format(), "injected.txt", txt);
 
-	return "injected.txt";
+	return txt;
 }
 
 }
@@ -20,19 +20,30 @@
 #define e5bd51be_FORMATS_HPP_
 
 #include "dom.hpp"
+#include <zip.h>
+#include <functional>
 
 namespace Transfuse {
 
-std::unique_ptr<DOM> extract_docx(State& state);
+// The original document, from memory if the state holds it, otherwise from the state folder
+std::string original_load(State& state);
+zip_t* original_zip(State& state, std::string_view what);
+// Parses the ZIP entries as one document while they are being decompressed, without holding a copy of them.
+// Each element is passed to closed once all of it has been parsed, so chaff can be dropped before the rest of the tree is built.
+// If head is given, it must have the XML declaration, and the entries' own declarations are skipped.
+xmlDocPtr zip_read_xml(zip_t* zip, const std::vector<zip_uint64_t>& entries, const char* url, const std::function<void(xmlNodePtr)>& closed, std::string_view head = {}, std::string_view tail = {});
+
+std::unique_ptr<DOM> extract_docx(State& state, zip_t* zip = nullptr);
 std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeString> data = {});
 std::unique_ptr<DOM> extract_html_fragment(State& state);
-std::unique_ptr<DOM> extract_odt(State& state);
-std::unique_ptr<DOM> extract_pptx(State& state);
+std::unique_ptr<DOM> extract_odt(State& state, zip_t* zip = nullptr);
+std::unique_ptr<DOM> extract_pptx(State& state, zip_t* zip = nullptr);
 std::unique_ptr<DOM> extract_tei(State& state);
 std::unique_ptr<DOM> extract_text(State& state, bool by_line = false);
 
 std::string inject_docx(DOM&);
 std::string inject_html(DOM&);
+std::string inject_html_data(DOM&);
 std::string inject_html_fragment(DOM&);
 std::string inject_odt(DOM&);
 std::string inject_pptx(DOM&);
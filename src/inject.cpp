@@ -20,36 +20,723 @@
 #include "stream.hpp"
 #include "dom.hpp"
 #include "formats.hpp"
-#include <unicode/regex.h>
-#include <unicode/utext.h>
+#include "markers.hpp"
+#include "cache.hpp"
+#include "bundle.hpp"
+#include "memory.hpp"
+#include <libxml/parser.h>
+#include <libxml/xmlsave.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <array>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdexcept>
 using namespace icu;
 
 namespace Transfuse {
 
-std::pair<fs::path,std::string> inject(Settings& settings) {
+inline bool is_digits(const xmlChar* c) {
+	if (c == nullptr || *c == 0) {
+		return false;
+	}
+	for (; *c; ++c) {
+		if (*c < '0' || *c > '9') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Merges adjacent texts and drops empty ones among the children of a node, as parsing would have left them
+static void merge_texts(xmlNodePtr node) {
+	for (auto child = node->children; child != nullptr; ) {
+		auto next = child->next;
+		if (child->type != XML_TEXT_NODE) {
+			child = next;
+			continue;
+		}
+		if (next && next->type == XML_TEXT_NODE) {
+			xmlNodeAddContent(child, next->content);
+			xmlUnlinkNode(next);
+			xmlFreeNode(next);
+			continue;
+		}
+		if (child->content == nullptr || child->content[0] == 0) {
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+		}
+		child = next;
+	}
+}
+
+// Copying nodes out of their tree declares the namespaces they use on the copy, so once put in place the copy uses those in scope there instead, unless the original declared them itself
+static void adopt_ns(xmlNodePtr copy, xmlNodePtr orig) {
+	std::function<void(xmlNodePtr, xmlNsPtr, xmlNsPtr)> redirect = [&](xmlNodePtr node, xmlNsPtr from, xmlNsPtr to) {
+		for (; node != nullptr; node = node->next) {
+			if (node->type != XML_ELEMENT_NODE) {
+				continue;
+			}
+			if (node->ns == from) {
+				node->ns = to;
+			}
+			for (auto attr = node->properties; attr != nullptr; attr = attr->next) {
+				if (attr->ns == from) {
+					attr->ns = to;
+				}
+			}
+			redirect(node->children, from, to);
+		}
+	};
+
+	for (auto def = &copy->nsDef; *def != nullptr; ) {
+		auto ns = *def;
+		bool own = false;
+		for (auto o = orig->nsDef; o != nullptr && !own; o = o->next) {
+			own = xmlStrEqual(o->prefix, ns->prefix);
+		}
+		auto found = own ? nullptr : xmlSearchNs(copy->doc, copy->parent, ns->prefix);
+		if (found == nullptr || !xmlStrEqual(found->href, ns->href)) {
+			def = &ns->next;
+			continue;
+		}
+		*def = ns->next;
+		ns->next = nullptr;
+		if (copy->ns == ns) {
+			copy->ns = found;
+		}
+		for (auto attr = copy->properties; attr != nullptr; attr = attr->next) {
+			if (attr->ns == ns) {
+				attr->ns = found;
+			}
+		}
+		redirect(copy->children, ns, found);
+		xmlFreeNs(ns);
+	}
+}
+
+// Rebuilds the tags that inline and protected-inline markers stand for as real nodes, parsing each style's tags once and copying them to where they are used
+// The content of a styled span goes where a <tf-here/> placeholder is, which stands in for the gap between the opening and closing tags
+struct Inlines {
+	State& state;
+	xmlDocPtr doc;
+	xmlNodePtr context = nullptr;
+	std::string tmp;
+
+	// The nodes of a style's tags are the children of an unlinked element, which is nullptr if they could not be made
+	struct Tags {
+		xmlNodePtr nodes = nullptr;
+		bool drop = false;
+	};
+	std::unordered_map<std::string, Tags> parsed;
+
+	// Where the content of an open span goes, which for a dropped span is nowhere
+	struct Span {
+		xmlNodePtr here = nullptr;
+		bool drop = false;
+	};
+	// The spans opened by one marker, and where in the text their content starts
+	struct Group {
+		size_t count = 0;
+		size_t content = 0;
+	};
+
+	Inlines(State& state, xmlDocPtr doc)
+	  : state(state)
+	  , doc(doc)
+	{}
+
+	~Inlines() {
+		for (auto& it : parsed) {
+			xmlFreeNode(it.second.nodes);
+		}
+	}
+
+	static bool has_inlines(std::string_view frag) {
+		MarkerScanner scan(frag);
+		Marker m;
+		while (scan.next(m)) {
+			if (m.kind == marker_kind(TFI_OPEN_B) || m.kind == marker_kind(TFI_CLOSE) || m.kind == marker_kind(TFP_OPEN)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// The tags of a style, parsed in the context of the node they go in, with any markers they hold themselves rebuilt as well
+	Tags tags(std::string_view tag, std::string_view hash, bool span) {
+		auto key = concat(tag, ":", hash);
+		if (auto it = parsed.find(key); it != parsed.end()) {
+			return it->second;
+		}
+		// A style that holds itself is never finished, and is then left out
+		parsed[key] = Tags{};
+
+		auto [topen, tclose, tflags] = state.style(tag, hash);
+		if (topen.empty() && tclose.empty()) {
+			std::cerr << (span ? "Inline tag " : "Protected inline tag ") << key << " did not exist in this document." << std::endl;
+			return {};
+		}
+		std::string xml{ topen };
+		if (span) {
+			xml += TF_SENTINEL;
+		}
+		xml += tclose;
+
+		xmlNodePtr nodes = nullptr;
+		if (xmlParseInNodeContext(context, xml.data(), SI(xml.size()), XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING, &nodes) != XML_ERR_OK) {
+			xmlFreeNodeList(nodes);
+			std::cerr << (span ? "Inline tag " : "Protected inline tag ") << key << " was not well-formed." << std::endl;
+			return {};
+		}
+
+		// Copies look up the namespaces they use from where they were copied, so the wrapper declares all that are in scope where the tags were parsed
+		auto wrap = xmlNewDocNode(doc, nullptr, XC("tf-here"), nullptr);
+		if (auto list = xmlGetNsList(doc, context)) {
+			for (auto ns = list; *ns != nullptr; ++ns) {
+				xmlNewNs(wrap, (*ns)->href, (*ns)->prefix);
+			}
+			xmlFree(list);
+		}
+		while (nodes) {
+			auto n = nodes;
+			nodes = nodes->next;
+			xmlUnlinkNode(n);
+			xmlAddChild(wrap, n);
+		}
+
+		std::vector<xmlNodePtr> marked;
+		std::function<void(xmlNodePtr)> walk = [&](xmlNodePtr node) {
+			for (auto child = node->children; child != nullptr; child = child->next) {
+				if (child->type == XML_ELEMENT_NODE) {
+					if (auto attr = xmlHasProp(child, XC("tf-unique")); attr && attr->children && is_digits(attr->children->content)) {
+						xmlRemoveProp(attr);
+					}
+					walk(child);
+				}
+				else if (child->type == XML_TEXT_NODE && child->content) {
+					marked.push_back(child);
+				}
+			}
+		};
+		walk(wrap);
+
+		// Split the text that has the sentinel around a placeholder
+		for (auto text : marked) {
+			auto content = XV2SV(xmlChar_view(text->content));
+			auto s = content.find(TF_SENTINEL);
+			if (s == std::string_view::npos) {
+				continue;
+			}
+			auto here = xmlNewDocNode(doc, nullptr, XC("tf-here"), nullptr);
+			xmlAddNextSibling(text, here);
+			if (s + 3 < content.size()) {
+				xmlAddNextSibling(here, xmlNewDocTextLen(doc, XC(content.data() + s + 3), SI(content.size() - s - 3)));
+			}
+			tmp.assign(content.begin(), content.begin() + PD(s));
+			xmlNodeSetContent(text, XC(tmp.c_str()));
+			merge_texts(here->parent);
+			break;
+		}
+		marked.clear();
+		walk(wrap);
+
+		// Restored tags may themselves hold markers
+		std::vector<std::string> escaped;
+		std::unordered_map<xmlNodePtr, std::string_view> texts;
+		std::vector<xmlNodePtr> parents;
+		std::unordered_set<xmlNodePtr> seen;
+		escaped.reserve(marked.size());
+		for (auto text : marked) {
+			if (text->parent == nullptr || text->content == nullptr) {
+				continue;
+			}
+			escaped.emplace_back();
+			escape_xml(escaped.back(), x2s(text->content));
+			if (!has_inlines(escaped.back())) {
+				escaped.pop_back();
+				continue;
+			}
+			if (seen.insert(text->parent).second) {
+				parents.push_back(text->parent);
+			}
+			texts[text] = escaped.back();
+		}
+		for (auto parent : parents) {
+			restore(parent, texts);
+		}
+
+		auto& rv = parsed[key];
+		rv.nodes = wrap;
+		rv.drop = (tflags.find('P') != std::string_view::npos);
+		return rv;
+	}
+
+	// Rebuilds the markers in those of the parent's text children that are in texts, which hold them escaped as in a serialized document
+	// A styled span may hold elements that were never made into styles, such as an empty <i class="fa"/> in a link, so it can open in one text and close in a later one, and the nodes between are moved into it
+	void restore(xmlNodePtr parent, const std::unordered_map<xmlNodePtr, std::string_view>& texts) {
+		std::vector<Span> spans;
+		std::vector<Group> groups;
+		std::vector<xmlNodePtr> touched{ parent };
+		xmlNodePtr here = nullptr;
+
+		auto dropping = [&]() {
+			return !spans.empty() && spans.back().drop;
+		};
+		auto add = [&](xmlNodePtr n) {
+			if (dropping()) {
+				xmlFreeNode(n);
+				return;
+			}
+			xmlAddPrevSibling(spans.empty() ? here : spans.back().here, n);
+		};
+		// Copies the tags in, returning the placeholder in the copy, if any
+		auto add_copy = [&](xmlNodePtr wrap) -> xmlNodePtr {
+			if (dropping()) {
+				return nullptr;
+			}
+			xmlNodePtr inner = nullptr;
+			auto nodes = xmlDocCopyNodeList(doc, wrap->children);
+			std::function<void(xmlNodePtr)> find = [&](xmlNodePtr node) {
+				for (; node != nullptr && inner == nullptr; node = node->next) {
+					if (node->type == XML_ELEMENT_NODE && xmlStrcmp(node->name, XC("tf-here")) == 0) {
+						inner = node;
+					}
+					else if (node->type == XML_ELEMENT_NODE) {
+						find(node->children);
+					}
+				}
+			};
+			find(nodes);
+			for (auto orig = wrap->children; nodes != nullptr; orig = orig->next) {
+				auto n = nodes;
+				nodes = nodes->next;
+				xmlUnlinkNode(n);
+				add(n);
+				if (n->type == XML_ELEMENT_NODE) {
+					adopt_ns(n, orig);
+				}
+			}
+			return inner;
+		};
+		auto end_spans = [&]() {
+			for (auto& span : spans) {
+				if (span.here) {
+					xmlUnlinkNode(span.here);
+					xmlFreeNode(span.here);
+				}
+			}
+			spans.clear();
+			groups.clear();
+		};
+
+		for (auto child = parent->children, next = child; child != nullptr; child = next) {
+			next = child->next;
+			auto it = texts.find(child);
+			if (it == texts.end()) {
+				if (!spans.empty() && !dropping()) {
+					xmlUnlinkNode(child);
+					xmlAddPrevSibling(spans.back().here, child);
+				}
+				continue;
+			}
+
+			// A block can't go on inside a span from another block, so spans an earlier text left open end here, unless this text starts by closing them
+			// Streams may drop such a close, as nothing was opened in the block it is in
+			auto frag = it->second;
+			if (!spans.empty() && frag.substr(0, 3) != TFI_CLOSE) {
+				end_spans();
+			}
+			if (spans.empty() && !has_inlines(frag)) {
+				unescape_xml(tmp, frag);
+				if (tmp.empty()) {
+					xmlUnlinkNode(child);
+					xmlFreeNode(child);
+				}
+				else {
+					xmlNodeSetContent(child, XC(tmp.c_str()));
+				}
+				continue;
+			}
+
+			here = xmlNewDocNode(doc, nullptr, XC("tf-here"), nullptr);
+			xmlAddPrevSibling(child, here);
+			xmlUnlinkNode(child);
+			xmlFreeNode(child);
+
+			size_t last = 0;
+			auto text = [&](size_t e) {
+				if (e > last) {
+					unescape_xml(tmp, frag.substr(last, e - last));
+					add(xmlNewDocTextLen(doc, XC(tmp.data()), SI(tmp.size())));
+				}
+			};
+
+			MarkerScanner scan(frag);
+			Marker m;
+			while (scan.next(m)) {
+				if (m.kind == marker_kind(TFI_OPEN_B)) {
+					auto ie = scan.skip_to(marker_kind(TFI_OPEN_E));
+					if (ie == std::string_view::npos) {
+						break;
+					}
+					text(m.offset);
+					last = scan.pos;
+
+					auto list = frag.substr(m.offset + 3, ie - m.offset - 3);
+					size_t count = 0;
+					for (size_t b = 0; b < list.size(); ) {
+						auto e = std::min(list.find(';', b), list.size());
+						std::string entry(list.substr(b, e - b));
+						b = e + 1;
+						trim_wb(entry);
+						auto c = entry.find(':');
+						if (c == std::string::npos) {
+							continue;
+						}
+
+						auto style = tags(std::string_view(entry).substr(0, c), std::string_view(entry).substr(c + 1), true);
+						Span span;
+						span.drop = dropping() || style.drop;
+						if (!dropping()) {
+							if (style.nodes) {
+								span.here = add_copy(style.nodes);
+							}
+							// A style that could not be made still gets its content, just without tags around it
+							if (span.here == nullptr) {
+								span.here = xmlNewDocNode(doc, nullptr, XC("tf-here"), nullptr);
+								add(span.here);
+							}
+							touched.push_back(span.here->parent);
+						}
+						spans.push_back(span);
+						++count;
+					}
+					groups.push_back({ count, last });
+				}
+				else if (m.kind == marker_kind(TFI_CLOSE)) {
+					if (groups.empty()) {
+						continue;
+					}
+					text(m.offset);
+					last = scan.pos;
+					// An empty span that ends the text is one whose content was outside the block, so it is left open for what follows, as if the stream had not closed it
+					if (m.offset == groups.back().content && last == frag.size()) {
+						continue;
+					}
+					for (size_t i = 0; i < groups.back().count; ++i) {
+						if (spans.back().here) {
+							xmlUnlinkNode(spans.back().here);
+							xmlFreeNode(spans.back().here);
+						}
+						spans.pop_back();
+					}
+					groups.pop_back();
+				}
+				else if (m.kind == marker_kind(TFP_OPEN)) {
+					auto pb = scan.pos;
+					auto pe = scan.skip_to(marker_kind(TFP_CLOSE));
+					if (pe == std::string_view::npos) {
+						break;
+					}
+					auto body = frag.substr(pb, pe - pb);
+					auto c = body.rfind(':');
+					if (c == 0 || c == std::string_view::npos || c + 1 == body.size()) {
+						continue;
+					}
+					text(m.offset);
+					last = scan.pos;
+
+					if (auto style = tags(body.substr(0, c), body.substr(c + 1), false); style.nodes) {
+						add_copy(style.nodes);
+					}
+				}
+			}
+			text(frag.size());
+
+			xmlUnlinkNode(here);
+			xmlFreeNode(here);
+		}
+
+		// Spans that were never closed end with their parent
+		end_spans();
+
+		for (auto node : touched) {
+			merge_texts(node);
+		}
+	}
+};
+
+// Turns a block from the stream or cache into XML ready to be put in the document
+static void block_to_xml(Settings& settings, std::string& buf, std::string& tmp) {
+	if (settings.opt_inject_raw) {
+		tmp = buf;
+	}
+	else if (settings.stream != Streams::cg) {
+		reduce_ws(buf);
+		assign_xml(tmp, buf);
+	}
+	else {
+		assign_xml(tmp, buf, true);
+	}
+	buf.swap(tmp);
+}
+
+// Fills the blocks into the skeleton, and then has the document's format build the injected document from that
+// Blocks that are not in the map were left out of the stream, and are asked of missing() instead
+static std::string inject_blocks(State& state, xmlDocPtr xml, std::unordered_map<std::string, std::string>& blocks, const std::vector<std::string>& block_order, const std::function<bool(std::string_view, std::string&)>& missing, std::string_view original) {
+	Settings& settings = *state.settings;
+	std::unique_ptr<xmlDoc, decltype(&xmlFreeDoc)> xml_h(xml, &mem_free_doc);
+	std::string tmp;
+	std::string buffer;
+
+	if (settings.opt_verbose) {
+		std::cerr << "Filling blocks" << std::endl;
+	}
+
+	// Gather the escaped text of every text node and attribute that has markers, with blocks filled in, into one string separated by \0
+	// The style cleanup and tag restoration then run once over only that, and see each text exactly as they would in the serialized document
+	std::vector<xmlNodePtr> marked;
+	std::string joined;
+	std::string esc;
+
+	auto fill = [&](xmlNodePtr text, bool attr) {
+		esc.clear();
+		escape_xml(esc, x2s(text->content), attr);
+		if (!marked.empty()) {
+			joined += '\0';
+		}
+		marked.push_back(text);
+
+		size_t last = 0;
+		MarkerScanner scan(esc);
+		Marker m;
+		while (scan.next(m)) {
+			if (m.kind == marker_kind(TFB_OPEN_B)) {
+				joined.append(esc.begin() + PD(last), esc.begin() + PD(m.offset));
+				auto ib = scan.pos;
+				auto ie = scan.skip_to(marker_kind(TFB_OPEN_E));
+				last = scan.pos;
+				if (ie == std::string::npos) {
+					continue;
+				}
+				auto id = std::string_view(esc).substr(ib, ie - ib);
+				tmp.assign(id.begin(), id.end());
+				if (auto it = blocks.find(tmp); it != blocks.end()) {
+					joined += it->second;
+					blocks.erase(it);
+				}
+				else {
+					// Left out of the stream because it was cached or a repeat
+					if (!missing || !missing(id, buffer)) {
+						continue;
+					}
+					joined += buffer;
+				}
+				scan.skip_to(marker_kind(TFB_CLOSE_E));
+				last = scan.pos;
+			}
+			else if (m.kind == marker_kind(TFB_CLOSE_B)) {
+				joined.append(esc.begin() + PD(last), esc.begin() + PD(m.offset));
+				scan.skip_to(marker_kind(TFB_CLOSE_E));
+				last = scan.pos;
+			}
+		}
+		joined.append(esc.begin() + PD(last), esc.end());
+	};
+
+	auto has_markers = [](const xmlChar* c) {
+		if (c == nullptr) {
+			return false;
+		}
+		Marker m;
+		return MarkerScanner(xmlChar_view(c)).next(m);
+	};
+
+	std::function<void(xmlNodePtr)> walk = [&](xmlNodePtr node) {
+		for (auto child = node->children; child != nullptr; child = child->next) {
+			if (child->type == XML_ELEMENT_NODE) {
+				if (auto attr = xmlHasProp(child, XC("tf-unique")); attr && attr->children && is_digits(attr->children->content)) {
+					xmlRemoveProp(attr);
+				}
+				for (auto attr = child->properties; attr != nullptr; attr = attr->next) {
+					if (attr->children && attr->children->type == XML_TEXT_NODE && has_markers(attr->children->content)) {
+						fill(attr->children, true);
+					}
+				}
+				walk(child);
+			}
+			else if (child->type == XML_TEXT_NODE && has_markers(child->content)) {
+				fill(child, false);
+			}
+		}
+	};
+	walk(reinterpret_cast<xmlNodePtr>(xml));
+
+	for (auto& id : block_order) {
+		if (blocks.count(id)) {
+			std::cerr << "Block " << id << " did not exist in this document." << std::endl;
+		}
+	}
+	blocks.clear();
+
+	cleanup_styles(state, joined);
+
+	// Put each text back where it came from, with the tags that markers stand for rebuilt as nodes
+	// Texts are handled together with the other texts of their parent, since a styled span may go from one to another
+	{
+		Inlines inlines(state, xml);
+		std::unordered_map<xmlNodePtr, std::string_view> texts;
+		std::vector<xmlNodePtr> parents;
+		std::unordered_set<xmlNodePtr> seen;
+		size_t b = 0;
+		for (auto text : marked) {
+			auto e = std::min(joined.find('\0', b), joined.size());
+			auto frag = std::string_view(joined).substr(b, e - b);
+			b = e + 1;
+
+			// Attributes can't hold tags, so only the text of what is rebuilt is kept
+			if (text->parent && text->parent->type == XML_ATTRIBUTE_NODE) {
+				if (!Inlines::has_inlines(frag)) {
+					unescape_xml(tmp, frag);
+					xmlNodeSetContent(text, XC(tmp.c_str()));
+					continue;
+				}
+				auto wrap = xmlNewDocNode(xml, nullptr, XC("tf-here"), nullptr);
+				auto t = xmlAddChild(wrap, xmlNewDocText(xml, XC("")));
+				inlines.context = text->parent->parent;
+				inlines.restore(wrap, { { t, frag } });
+				auto value = xmlNodeGetContent(wrap);
+				xmlNodeSetContent(text, value);
+				xmlFree(value);
+				xmlFreeNode(wrap);
+				continue;
+			}
+
+			if (seen.insert(text->parent).second) {
+				parents.push_back(text->parent);
+			}
+			texts[text] = frag;
+		}
+		for (auto parent : parents) {
+			inlines.context = parent;
+			inlines.restore(parent, texts);
+		}
+	}
+
+	if (settings.opt_debug) {
+		auto cntx = xmlSaveToFilename("debug-inject-020-filled.xml", "UTF-8", 0);
+		xmlSaveDoc(cntx, xml);
+		xmlSaveClose(cntx);
+	}
+
+	xml_h.release();
+	auto dom = std::make_unique<DOM>(state, xml);
+	dom->restore_spaces();
+	dom->original = original;
+
+	// The injected document is built in memory, and only left in the state folder if that is kept
+	std::string fname;
+	std::string data;
+	auto format = state.format();
+
+	if (format == "docx") {
+		fname = "injected.docx";
+		data = inject_docx(*dom);
+	}
+	else if (format == "pptx") {
+		fname = "injected.pptx";
+		data = inject_pptx(*dom);
+	}
+	else if (format == "odt" || format == "odp") {
+		fname = "injected.odt";
+		data = inject_odt(*dom);
+	}
+	else if (format == "html") {
+		fname = "injected.html";
+		data = inject_html(*dom);
+	}
+	else if (format == "html-fragment") {
+		fname = "injected.fragment";
+		data = inject_html_fragment(*dom);
+	}
+	else if (format == "text") {
+		fname = "injected.txt";
+		data = inject_text(*dom);
+	}
+	else if (format == "tei") {
+		fname = "injected.xml";
+		data = inject_tei(*dom);
+	}
+	else if (format == "line") {
+		fname = "injected.txt";
+		data = inject_text(*dom, true);
+	}
+
+	if (settings.opt_keep && !fname.empty()) {
+		file_save(fname, data);
+	}
+
+	return data;
+}
+
+std::pair<fs::path,std::string> inject(Settings& settings, Fused* fused) {
 	fs::path& tmpdir = settings.tmpdir;
-	std::istream& in = *settings.in;
+	// Fused clean has the stream, state, skeleton and original in memory, but the blocks are read from the stream the same way
+	std::istringstream fused_in;
+	size_t fused_size = 0;
+	if (fused) {
+		fused_in.str(fused->stream);
+		fused_size = fused->stream.size();
+		fused->stream.clear();
+		fused->stream.shrink_to_fit();
+	}
+	std::istream& in = fused ? fused_in : *settings.in;
 	Stream& stream = settings.stream;
 
 	std::ios::sync_with_stdio(false);
 	in.tie(nullptr);
 
-	std::array<char, 4096> inbuf{};
-	in.rdbuf()->pubsetbuf(inbuf.data(), inbuf.size());
 	in.exceptions(std::ios::badbit);
+	StreamInput input(in, &in == &std::cin);
+	std::vector<std::unique_ptr<std::istream>> shards;
+	for (auto& fn : settings.infiles) {
+		shards.emplace_back(new std::ifstream(fn, std::ios::binary));
+		if (!shards.back()->good()) {
+			throw std::runtime_error(concat("Could not read file ", fn.string()));
+		}
+		input.append(*shards.back());
+	}
 
 	std::unique_ptr<StreamBase> sformat;
 
 	std::string buffer;
-	while (buffer.empty()) {
-		std::getline(in, buffer);
+	bool binary = (stream == Streams::binary) || (stream == Streams::detect && input.need(BinaryStream::magic.size()) && input.view().starts_with(BinaryStream::magic));
+	if (binary) {
+		if (!BinaryStream::get_header(input, buffer)) {
+			throw std::runtime_error("Could not read binary stream header");
+		}
+	}
+	else {
+		std::string_view line;
+		while (input.getline(line) && line.empty()) {
+		}
+		buffer = line;
 	}
 
-	if (stream == Streams::detect) {
+	if (binary) {
+		if (settings.opt_verbose) {
+			std::cerr << "Stream format: Binary" << std::endl;
+		}
+		sformat.reset(new BinaryStream(&settings));
+	}
+	else if (stream == Streams::detect) {
 		if (buffer.find("[transfuse:") != std::string::npos) {
 			if (settings.opt_verbose) {
 				std::cerr << "Stream format: Apertium" << std::endl;
@@ -85,247 +772,165 @@ std::pair<fs::path,std::string> inject(Settings& settings) {
 		sformat.reset(new VISLStream(&settings));
 	}
 
-	if (tmpdir.empty()) {
-		tmpdir = sformat->get_tmpdir(buffer);
+	if (!fused) {
+		if (tmpdir.empty()) {
+			tmpdir = sformat->get_tmpdir(buffer);
+		}
+
+		if (tmpdir.empty()) {
+			throw std::runtime_error("Could not read state folder path from Transfuse stream header");
+		}
+		if (!fs::exists(tmpdir)) {
+			throw std::runtime_error(concat("State folder did not exist: ", tmpdir.string()));
+		}
+
+		if (settings.opt_verbose) {
+			std::cerr << "State folder: " << tmpdir << std::endl;
+		}
+
+		fs::current_path(tmpdir);
 	}
 
-	if (tmpdir.empty()) {
-		throw std::runtime_error("Could not read state folder path from Transfuse stream header");
+	// The skeleton is parsed once, and blocks are then filled straight into its text nodes and attributes
+	std::unique_ptr<Bundle> bundle;
+	xmlDocPtr xml = nullptr;
+	if (fused) {
+		// The parsed document was budgeted for by extraction, so what is left is the blocks that get parsed into it
+		mem_budget(settings, "injecting this document", mem_projected("skeleton", fused_size, false));
+		xml = fused->dom->xml.release();
+		// Read back from the state folder the skeleton would be UTF-8, and fragments parsed into it must be read as such
+		xmlFree(const_cast<xmlChar*>(xml->encoding));
+		xml->encoding = xmlStrdup(XC("UTF-8"));
+		fused->dom.reset();
 	}
-	if (!fs::exists(tmpdir)) {
-		throw std::runtime_error(concat("State folder did not exist: ", tmpdir.string()));
+	else if (!fs::exists("state.sqlite3") && fs::exists("state.tfs")) {
+		if (settings.opt_verbose) {
+			std::cerr << "State bundle: " << (tmpdir / "state.tfs") << std::endl;
+		}
+		bundle = std::make_unique<Bundle>(tmpdir / "state.tfs");
+		auto skel = bundle->skeleton();
+		mem_budget(settings, "injecting this document", mem_projected("skeleton", skel.size(), false));
+		xml = xmlReadMemory(skel.data(), SI(skel.size()), "content.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
 	}
+	else if (!fs::exists("original") || !fs::exists("content.xml") || !fs::exists("state.sqlite3")) {
+		throw std::runtime_error(concat("Given folder did not have expected state files: ", tmpdir.string()));
+	}
+	else {
+		mem_budget(settings, "injecting this document", mem_projected("skeleton", SZ(fs::file_size("content.xml")), false));
+		xml = xmlReadFile("content.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
+	}
+	if (xml == nullptr) {
+		throw std::runtime_error(concat("Could not parse content.xml: ", xmlGetLastError()->message));
+	}
+	mem_phase(settings, "inject-parse");
+	std::unique_ptr<xmlDoc, decltype(&xmlFreeDoc)> xml_h(xml, &mem_free_doc);
+	std::string tmp_b;
 
-	if (settings.opt_verbose) {
-		std::cerr << "State folder: " << tmpdir << std::endl;
+	// Translations are kept in the state so that an incremental extraction of a later revision can reuse them
+	bool record = settings.opt_keep && settings.mode != "clean" && !bundle;
+	std::unique_ptr<State> state_h;
+	if (!fused) {
+		state_h = std::make_unique<State>(&settings, !record);
 	}
+	State& state = fused ? *fused->state : *state_h;
 
-	fs::current_path(tmpdir);
+	// Extraction may have left out repeats of identical blocks, which then get the translation of the first one
+	bool dedupe = !state.info("dedupe").empty();
+	std::unordered_map<std::string, std::string> by_key;
 
-	if (!fs::exists("original") || !fs::exists("content.xml") || !fs::exists("state.sqlite3")) {
-		throw std::runtime_error(concat("Given folder did not have expected state files: ", tmpdir.string()));
+	std::unique_ptr<TMCache> tm;
+	if (settings.cache.empty()) {
+		settings.cache = path(state.info("cache"));
+	}
+	if (!settings.cache.empty()) {
+		if (settings.opt_verbose) {
+			std::cerr << "Translation cache: " << settings.cache << std::endl;
+		}
+		tm = std::make_unique<TMCache>(settings.cache, true);
 	}
 
-	auto content = file_load("content.xml");
-	std::string tmp_b;
-	std::string tmp_e;
+	auto to_xml = [&](std::string& buf) {
+		block_to_xml(settings, buf, tmp_b);
+	};
 
 	// Read all blocks from the input stream and put them back in the document
 	if (settings.opt_verbose) {
 		std::cerr << "Reading stream blocks" << std::endl;
 	}
-	std::string tmp;
 	std::string bid;
-	size_t last_e = 0;
-	while (sformat->get_block(in, buffer, bid)) {
+	// Stream order is kept only to report unknown blocks in a stable order
+	std::unordered_map<std::string, std::string> blocks;
+	std::vector<std::string> block_order;
+	if (record) {
+		state.begin();
+	}
+	while (sformat->get_block(input, buffer, bid)) {
 		if (bid.empty()) {
 			continue;
 		}
-		if (settings.opt_inject_raw) {
-			tmp_b += buffer;
-		}
-		else if (stream != Streams::cg) {
-			reduce_ws(buffer);
-			assign_xml(tmp_b, buffer);
-		}
-		else {
-			assign_xml(tmp_b, buffer, true);
-		}
-		buffer.swap(tmp_b);
-
-		tmp_b = TFB_OPEN_B;
-		tmp_b += bid;
-		tmp_b += TFB_OPEN_E;
-
-		tmp_e = TFB_CLOSE_B;
-		tmp_e += bid;
-		tmp_e += TFB_CLOSE_E;
-
-		auto b = content.find(tmp_b, last_e);
-		auto e = content.find(tmp_e, b + tmp_b.size());
-		if (b != std::string::npos && e != std::string::npos) {
-			tmp.append(content.begin() + PD(last_e), content.begin() + PD(b));
-			tmp += buffer;
-			last_e = e + tmp_e.size();
-		}
-		else {
-			std::cerr << "Block " << bid << " did not exist in this document or was out-of-order." << std::endl;
-		}
-	}
-	tmp.append(content.begin() + PD(last_e), content.end());
-	content.swap(tmp);
-
-	if (settings.opt_verbose) {
-		std::cerr << "Removing leftover markers" << std::endl;
-	}
-
-	// Remove remaining block open markers
-	tmp.clear();
-	last_e = 0;
-	size_t b = 0;
-	while ((b = content.find(TFB_OPEN_B, last_e)) != std::string::npos) {
-		tmp.append(content.begin() + PD(last_e), content.begin() + PD(b));
-		last_e = content.find(TFB_OPEN_E, b) + 3;
-	}
-	tmp.append(content.begin() + PD(last_e), content.end());
-	content.swap(tmp);
-
-	// Remove remaining block close markers
-	tmp.clear();
-	last_e = 0;
-	while ((b = content.find(TFB_CLOSE_B, last_e)) != std::string::npos) {
-		tmp.append(content.begin() + PD(last_e), content.begin() + PD(b));
-		last_e = content.find(TFB_CLOSE_E, b) + 3;
-		if (settings.opt_verbose) {
-			std::cerr << "\tC " << tmp.size() << std::endl;
-		}
-	}
-	tmp.append(content.begin() + PD(last_e), content.end());
-	content.swap(tmp);
-
-	State state(&settings, true);
-
-	cleanup_styles(state, content);
-
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-	std::string tag_close;
-
-	RegexMatcher rx_inlines(R"X(\ue011([^\ue012]+)\ue012([^\ue011-\ue013]*)\ue013)X", 0, status);
-	RegexMatcher rx_prots(R"X(\ue020([^\ue021]+?):([^\ue021:]+)\ue021)X", 0, status);
-
-	bool did = true;
-	while (did) {
-		did = false;
-
-		// Turn inline tags back into original forms
-		tmp.resize(0);
-		tmp.reserve(content.size());
-		utext_openUTF8(tmp_ut, content);
-
-		rx_inlines.reset(&tmp_ut);
-		int32_t last = 0;
-		while (rx_inlines.find()) {
-			auto mb = rx_inlines.start(0, status);
-			auto me = rx_inlines.end(0, status);
-			tmp.append(content.begin() + last, content.begin() + mb);
-			last = me;
-			did = true;
-
-			auto tb = rx_inlines.start(1, status);
-			auto te = rx_inlines.end(1, status);
-			tmp_b.assign(content.begin() + tb, content.begin() + te);
-
-			tag_close.clear();
-			b = 0;
-			bool drop = false;
-			while (b < tmp_b.size()) {
-				auto e = tmp_b.find(';', b);
-				tmp_e.assign(tmp_b, b, e - b);
-				trim_wb(tmp_e);
-				auto c = tmp_e.find(':');
-				auto tag = std::string_view(&tmp_e[0], c);
-				auto hash = std::string_view(&tmp_e[c + 1]);
-
-				auto [topen, tclose, tflags] = state.style(tag, hash);
-				if (topen.empty() && tclose.empty()) {
-					std::cerr << "Inline tag " << tmp_b << ":" << tmp_e << " did not exist in this document." << std::endl;
-				}
-				tmp += topen;
-				if (tflags.find('P') != std::string_view::npos) {
-					drop = true;
-				}
-				tag_close.insert(tag_close.begin(), tclose.begin(), tclose.end());
-				b = std::max(e, e + 1);
+		if (tm || record || dedupe) {
+			auto key = state.block(bid).first;
+			if (tm && !key.empty()) {
+				tm->put(key, buffer);
 			}
-
-			auto bb = rx_inlines.start(2, status);
-			auto be = rx_inlines.end(2, status);
-			if (!drop) {
-				tmp.append(content.begin() + bb, content.begin() + be);
+			if (dedupe && !key.empty()) {
+				by_key[std::string(key)] = buffer;
 			}
-			tmp += tag_close;
-		}
-		tmp.append(content.begin() + last, content.end());
-		content.swap(tmp);
-
-		// Turn protected-inlines back into original form
-		tmp.resize(0);
-		tmp.reserve(content.size());
-		utext_openUTF8(tmp_ut, content);
-
-		rx_prots.reset(&tmp_ut);
-		last = 0;
-		while (rx_prots.find()) {
-			auto mb = rx_prots.start(0, status);
-			auto me = rx_prots.end(0, status);
-			tmp.append(content.begin() + last, content.begin() + mb);
-			last = me;
-			did = true;
-
-			auto tb = rx_prots.start(1, status);
-			auto te = rx_prots.end(1, status);
-			tmp_b.assign(content.begin() + tb, content.begin() + te);
-
-			auto hb = rx_prots.start(2, status);
-			auto he = rx_prots.end(2, status);
-			tmp_e.assign(content.begin() + hb, content.begin() + he);
-
-			auto [topen, tclose, _] = state.style(tmp_b, tmp_e);
-			if (topen.empty() && tclose.empty()) {
-				std::cerr << "Protected inline tag " << tmp_b << ":" << tmp_e << " did not exist in this document." << std::endl;
+			if (record && !key.empty()) {
+				state.block(bid, key, buffer);
 			}
-			tmp += topen;
-			tmp += tclose;
 		}
-		tmp.append(content.begin() + last, content.end());
-		content.swap(tmp);
+		to_xml(buffer);
+		if (blocks.emplace(bid, std::move(buffer)).second) {
+			block_order.push_back(bid);
+		}
 	}
-	utext_close(&tmp_ut);
-
-	rx_replaceAll(R"X( tf-unique="\d+")X", "", content, tmp);
 
-	if (settings.opt_debug) {
-		file_save("debug-inject-020-filled.xml", content);
+	if (record) {
+		state.commit();
 	}
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(content.data()), SI(content.size()), "content.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlGetLastError()->message));
+	if (tm) {
+		auto n = tm->commit();
+		if (settings.opt_verbose) {
+			std::cerr << "Added to cache: " << n << std::endl;
+		}
+		tm.reset();
 	}
 
-	auto dom = std::make_unique<DOM>(state, xml);
-	dom->restore_spaces();
-
-	std::string fname;
-	auto format = state.format();
-
-	if (format == "docx") {
-		fname = inject_docx(*dom);
-	}
-	else if (format == "pptx") {
-		fname = inject_pptx(*dom);
+	std::string_view original;
+	std::string original_b;
+	if (fused) {
+		original = fused->original;
 	}
-	else if (format == "odt" || format == "odp") {
-		fname = inject_odt(*dom);
-	}
-	else if (format == "html") {
-		fname = inject_html(*dom);
-	}
-	else if (format == "html-fragment") {
-		fname = inject_html_fragment(*dom);
-	}
-	else if (format == "text") {
-		fname = inject_text(*dom);
+	else if (bundle) {
+		original = bundle->original();
 	}
-	else if (format == "tei") {
-		fname = inject_tei(*dom);
-	}
-	else if (format == "line") {
-		fname = inject_text(*dom, true);
+	else {
+		original_b = file_load("original");
+		original = original_b;
 	}
 
-	return {tmpdir, fname};
+	mem_phase(settings, "inject-read");
+
+	auto missing = [&](std::string_view id, std::string& body) {
+		auto [key, bbody] = state.block(id);
+		if (bbody.empty() && dedupe) {
+			if (auto kt = by_key.find(std::string(key)); kt != by_key.end()) {
+				bbody = kt->second;
+			}
+		}
+		if (bbody.empty()) {
+			return false;
+		}
+		body = bbody;
+		to_xml(body);
+		return true;
+	};
+
+	auto rv = inject_blocks(state, xml_h.release(), blocks, block_order, missing, original);
+	mem_phase(settings, "inject-build");
+	return { tmpdir, std::move(rv) };
 }
 
 }
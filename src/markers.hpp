@@ -0,0 +1,135 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_MARKERS_HPP_
+#define e5bd51be_MARKERS_HPP_
+
+#include "shared.hpp"
+#include <unicode/uchar.h>
+#include <unicode/utf8.h>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+
+namespace Transfuse {
+
+// All internal markers are U+E000 to U+E03F, which in UTF-8 is EE 80 xx, so the final byte alone identifies the marker
+constexpr inline uint8_t marker_kind(const char* marker) {
+	return static_cast<uint8_t>(marker[2]);
+}
+
+struct Marker {
+	size_t offset = 0;
+	uint8_t kind = 0;
+};
+
+// Yields the offset and kind of each marker in a buffer. Lead byte 0xEE is rare in real text, so skipping to it with memchr() lets libc's vectorized search do nearly all the work.
+template<typename Char>
+struct MarkerScanner {
+	std::basic_string_view<Char> buf;
+	size_t pos = 0;
+
+	MarkerScanner(std::basic_string_view<Char> buf)
+	  : buf(buf)
+	{}
+
+	bool next(Marker& m) {
+		auto data = reinterpret_cast<const char*>(buf.data());
+		while (pos + 2 < buf.size()) {
+			auto p = static_cast<const char*>(memchr(data + pos, '\xee', buf.size() - pos - 2));
+			if (p == nullptr) {
+				break;
+			}
+			pos = SZ(p - data);
+			auto b1 = static_cast<uint8_t>(p[1]);
+			auto b2 = static_cast<uint8_t>(p[2]);
+			if (b1 == 0x80 && b2 >= 0x80 && b2 <= 0xbf) {
+				m.offset = pos;
+				m.kind = b2;
+				pos += 3;
+				return true;
+			}
+			++pos;
+		}
+		pos = buf.size();
+		return false;
+	}
+
+	// Advances to just past the next marker of the given kind, returning the offset of that marker or npos
+	size_t skip_to(uint8_t kind) {
+		Marker m;
+		while (next(m)) {
+			if (m.kind == kind) {
+				return m.offset;
+			}
+		}
+		return std::basic_string_view<Char>::npos;
+	}
+};
+
+template<typename Str>
+MarkerScanner(const Str&) -> MarkerScanner<typename Str::value_type>;
+
+// Offset just past the run of whitespace that starts at b, where whitespace is what ICU's \s matches
+template<typename Char>
+inline size_t skip_space(std::basic_string_view<Char> buf, size_t b) {
+	auto data = reinterpret_cast<const uint8_t*>(buf.data());
+	auto n = SI32(buf.size());
+	auto i = SI32(b);
+	while (i < n) {
+		auto p = i;
+		UChar32 c = 0;
+		U8_NEXT(data, p, n, c);
+		if (!u_isUWhiteSpace(c)) {
+			break;
+		}
+		i = p;
+	}
+	return SZ(i);
+}
+
+// Offset of the start of the run of whitespace that ends at e, not looking further back than floor
+template<typename Char>
+inline size_t skip_space_back(std::basic_string_view<Char> buf, size_t e, size_t floor) {
+	auto data = reinterpret_cast<const uint8_t*>(buf.data());
+	auto i = SI32(e);
+	while (i > SI32(floor)) {
+		auto p = i;
+		UChar32 c = 0;
+		U8_PREV(data, 0, p, c);
+		if (!u_isUWhiteSpace(c)) {
+			break;
+		}
+		i = p;
+	}
+	return SZ(i);
+}
+
+// If a protected region closing at b is followed by only whitespace and another opening, returns the offset just past that opening, so the two can be merged
+template<typename Char>
+inline size_t merged_open(std::basic_string_view<Char> buf, size_t b) {
+	auto e = skip_space(buf, b);
+	if (e + 2 < buf.size() && static_cast<uint8_t>(buf[e]) == 0xee && static_cast<uint8_t>(buf[e + 1]) == 0x80 && static_cast<uint8_t>(buf[e + 2]) == marker_kind(TFP_OPEN)) {
+		return e + 3;
+	}
+	return std::basic_string_view<Char>::npos;
+}
+
+}
+
+#endif
@@ -0,0 +1,484 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "memory.hpp"
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/catalog.h>
+#include <unicode/uclean.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+	#include <malloc.h>
+	#define tf_usable_size _msize
+#elif defined(__APPLE__)
+	#include <malloc/malloc.h>
+	#define tf_usable_size malloc_size
+#else
+	#include <malloc.h>
+	#define tf_usable_size malloc_usable_size
+#endif
+#ifndef _WIN32
+	#include <sys/resource.h>
+#endif
+
+namespace Transfuse {
+
+namespace {
+
+// Sizes come from the allocator itself rather than a header of our own, so freeing what a library allocated before the hooks went in is harmless
+struct Counter {
+	std::atomic<size_t> now{0};
+	std::atomic<size_t> peak{0};
+};
+
+Counter c_xml;
+Counter c_icu;
+std::atomic<size_t> c_peak{0};
+bool c_tracking = false;
+size_t c_budget = 0;
+std::atomic<bool> c_refused{false};
+std::vector<MemPhase> phases;
+size_t phase_rss = 0;
+bool c_hooked_xml = false;
+bool c_hooked_icu = false;
+
+// libxml allocates nodes, attributes, names and short strings by the million, and then frees them all along with the document.
+// Blocks up to arena_small are carved out of slabs that each hold a single size class, where the class sits at the start of the slab so that it can be found from a block's address alone.
+// Freed blocks go on a list per class for reuse. Larger blocks come from malloc, but are remembered so that releasing the arena frees those too.
+constexpr size_t arena_step = 16;
+constexpr size_t arena_small = 1024;
+constexpr size_t arena_slab = 64 << 10;
+constexpr size_t arena_slabs = 16;
+
+struct Arena {
+	std::vector<void*> chunks;
+	std::vector<char*> spare;
+	std::unordered_set<uintptr_t> slabs;
+	std::unordered_set<void*> large;
+	std::array<void*, arena_small / arena_step + 1> free{};
+	std::array<char*, arena_small / arena_step + 1> next{};
+	std::array<char*, arena_small / arena_step + 1> end{};
+	// What the blocks still in use add to the libxml counter
+	size_t counted = 0;
+
+	char* slab_of(void* p) {
+		auto base = reinterpret_cast<uintptr_t>(p) & ~uintptr_t{ arena_slab - 1 };
+		return slabs.count(base) ? reinterpret_cast<char*>(base) : nullptr;
+	}
+
+	bool owns(void* p) {
+		return slab_of(p) || large.count(p);
+	}
+
+	size_t size(void* p) {
+		if (auto slab = slab_of(p)) {
+			return *reinterpret_cast<size_t*>(slab) * arena_step;
+		}
+		return tf_usable_size(p);
+	}
+
+	void* allocate(size_t n) {
+		if (n > arena_small) {
+			auto p = malloc(n);
+			if (p) {
+				large.insert(p);
+			}
+			return p;
+		}
+
+		auto c = (std::max(n, size_t{ 1 }) + arena_step - 1) / arena_step;
+		if (auto p = free[c]) {
+			free[c] = *reinterpret_cast<void**>(p);
+			return p;
+		}
+		if (next[c] + c * arena_step > end[c]) {
+			if (spare.empty()) {
+				// One extra slab's worth so that the chunk holds arena_slabs aligned slabs wherever malloc put it
+				auto chunk = malloc(arena_slab * (arena_slabs + 1));
+				if (chunk == nullptr) {
+					return nullptr;
+				}
+				chunks.push_back(chunk);
+				auto base = (reinterpret_cast<uintptr_t>(chunk) + arena_slab - 1) & ~uintptr_t{ arena_slab - 1 };
+				for (size_t i = arena_slabs; i > 0; --i) {
+					spare.push_back(reinterpret_cast<char*>(base + (i - 1) * arena_slab));
+				}
+			}
+			auto slab = spare.back();
+			spare.pop_back();
+			slabs.insert(reinterpret_cast<uintptr_t>(slab));
+			*reinterpret_cast<size_t*>(slab) = c;
+			next[c] = slab + arena_step;
+			end[c] = slab + arena_slab;
+		}
+		auto p = next[c];
+		next[c] += c * arena_step;
+		return p;
+	}
+
+	void deallocate(void* p) {
+		if (auto slab = slab_of(p)) {
+			auto c = *reinterpret_cast<size_t*>(slab);
+			*reinterpret_cast<void**>(p) = free[c];
+			free[c] = p;
+		}
+		else {
+			large.erase(p);
+			::free(p);
+		}
+	}
+
+	void* reallocate(void* p, size_t n) {
+		if (!slab_of(p)) {
+			auto np = realloc(p, n);
+			if (np) {
+				large.erase(p);
+				large.insert(np);
+			}
+			return np;
+		}
+		auto old = size(p);
+		if (n <= old) {
+			return p;
+		}
+		auto np = allocate(n);
+		if (np) {
+			memcpy(np, p, old);
+			deallocate(p);
+		}
+		return np;
+	}
+
+	~Arena() {
+		for (auto p : large) {
+			::free(p);
+		}
+		for (auto chunk : chunks) {
+			::free(chunk);
+		}
+	}
+};
+
+Arena* c_arena = nullptr;
+
+inline void raise(std::atomic<size_t>& peak, size_t v) {
+	auto p = peak.load(std::memory_order_relaxed);
+	while (v > p && !peak.compare_exchange_weak(p, v, std::memory_order_relaxed)) {
+	}
+}
+
+inline void count(Counter& c, size_t add, size_t sub) {
+	if (!c_tracking) {
+		return;
+	}
+	auto now = c.now.fetch_add(add - sub, std::memory_order_relaxed) + add - sub;
+	raise(c.peak, now);
+	raise(c_peak, c_xml.now.load(std::memory_order_relaxed) + c_icu.now.load(std::memory_order_relaxed));
+}
+
+inline bool refuse(size_t grow) {
+	if (c_budget && c_xml.now.load(std::memory_order_relaxed) + c_icu.now.load(std::memory_order_relaxed) + grow > c_budget) {
+		c_refused = true;
+		return true;
+	}
+	return false;
+}
+
+void* track_malloc(Counter& c, size_t n) {
+	if (refuse(n)) {
+		return nullptr;
+	}
+	auto p = malloc(n);
+	if (p) {
+		count(c, tf_usable_size(p), 0);
+	}
+	return p;
+}
+
+void* track_realloc(Counter& c, void* p, size_t n) {
+	if (p == nullptr) {
+		return track_malloc(c, n);
+	}
+	auto old = tf_usable_size(p);
+	if (n > old && refuse(n - old)) {
+		return nullptr;
+	}
+	auto np = realloc(p, n);
+	if (np) {
+		count(c, tf_usable_size(np), old);
+	}
+	return np;
+}
+
+void track_free(Counter& c, void* p) {
+	if (p) {
+		auto n = tf_usable_size(p);
+		// Blocks from before the hooks went in were never counted
+		count(c, 0, std::min(n, c.now.load(std::memory_order_relaxed)));
+		free(p);
+	}
+}
+
+void* xml_malloc(size_t n) {
+	if (c_arena == nullptr) {
+		return track_malloc(c_xml, n);
+	}
+	if (refuse(n)) {
+		return nullptr;
+	}
+	auto p = c_arena->allocate(n);
+	if (p) {
+		c_arena->counted += c_arena->size(p);
+		count(c_xml, c_arena->size(p), 0);
+	}
+	return p;
+}
+
+void* xml_realloc(void* p, size_t n) {
+	if (p == nullptr) {
+		return xml_malloc(n);
+	}
+	if (c_arena == nullptr || !c_arena->owns(p)) {
+		return track_realloc(c_xml, p, n);
+	}
+	auto old = c_arena->size(p);
+	if (n > old && refuse(n - old)) {
+		return nullptr;
+	}
+	auto np = c_arena->reallocate(p, n);
+	if (np) {
+		c_arena->counted += c_arena->size(np) - old;
+		count(c_xml, c_arena->size(np), old);
+	}
+	return np;
+}
+
+void xml_free(void* p) {
+	if (c_arena == nullptr || p == nullptr || !c_arena->owns(p)) {
+		return track_free(c_xml, p);
+	}
+	c_arena->counted -= c_arena->size(p);
+	count(c_xml, 0, c_arena->size(p));
+	c_arena->deallocate(p);
+}
+
+char* xml_strdup(const char* str) {
+	auto n = strlen(str) + 1;
+	auto p = static_cast<char*>(xml_malloc(n));
+	if (p) {
+		memcpy(p, str, n);
+	}
+	return p;
+}
+
+void* U_CALLCONV icu_malloc(const void*, size_t n) {
+	return track_malloc(c_icu, n);
+}
+
+void* U_CALLCONV icu_realloc(const void*, void* p, size_t n) {
+	return track_realloc(c_icu, p, n);
+}
+
+void U_CALLCONV icu_free(const void*, void* p) {
+	track_free(c_icu, p);
+}
+
+// The arena needs libxml's allocator but not ICU's, so a run that doesn't track memory leaves ICU alone
+void mem_hook_xml() {
+	if (c_hooked_xml) {
+		return;
+	}
+	if (xmlMemSetup(xml_free, xml_malloc, xml_realloc, xml_strdup) != 0) {
+		throw std::runtime_error("Could not set libxml memory functions");
+	}
+	c_hooked_xml = true;
+}
+
+void mem_hook_icu() {
+	if (c_hooked_icu) {
+		return;
+	}
+	UErrorCode status = U_ZERO_ERROR;
+	u_setMemoryFunctions(nullptr, icu_malloc, icu_realloc, icu_free, &status);
+	if (U_FAILURE(status)) {
+		throw std::runtime_error(concat("Could not set ICU memory functions: ", u_errorName(status)));
+	}
+	c_hooked_icu = true;
+}
+
+}
+
+void mem_track(size_t budget) {
+	c_tracking = true;
+	c_budget = budget;
+	mem_hook_xml();
+	mem_hook_icu();
+	phase_rss = mem_rss();
+}
+
+MemArena::MemArena(bool enable) {
+	if (!enable || c_arena) {
+		return;
+	}
+	mem_hook_xml();
+	// What libxml sets up once per process must not end up in the arena
+	xmlInitParser();
+#ifdef LIBXML_CATALOG_ENABLED
+	xmlInitializeCatalog();
+#endif
+	c_arena = new Arena;
+	active = true;
+}
+
+MemArena::~MemArena() {
+	if (!active) {
+		return;
+	}
+	// The last error is kept by libxml until the next one, and its strings would be in the arena
+	xmlResetLastError();
+	auto arena = c_arena;
+	c_arena = nullptr;
+	count(c_xml, 0, std::min(arena->counted, c_xml.now.load(std::memory_order_relaxed)));
+	delete arena;
+}
+
+void mem_free_doc(xmlDocPtr doc) {
+	if (c_arena && c_arena->owns(doc)) {
+		return;
+	}
+	xmlFreeDoc(doc);
+}
+
+void mem_phase(Settings& settings, std::string_view name) {
+	if (!c_tracking) {
+		return;
+	}
+	auto& p = phases.emplace_back();
+	p.name = name;
+	p.rss = mem_rss();
+	p.rss_growth = p.rss - std::min(p.rss, phase_rss);
+	p.heap = c_peak.exchange(c_xml.now + c_icu.now);
+	p.heap_xml = c_xml.peak.exchange(c_xml.now);
+	p.heap_icu = c_icu.peak.exchange(c_icu.now);
+	phase_rss = p.rss;
+
+	if (settings.opt_verbose) {
+		std::cerr << "Memory after " << name << ": peak RSS " << mem_mib(p.rss) << " MiB (+" << mem_mib(p.rss_growth) << "), peak heap " << mem_mib(p.heap) << " MiB (libxml " << mem_mib(p.heap_xml) << ", ICU " << mem_mib(p.heap_icu) << ")" << std::endl;
+	}
+	if (c_refused) {
+		throw std::runtime_error(concat("Exceeded --max-memory of ", mem_mib(c_budget), " MiB during ", name));
+	}
+}
+
+const std::vector<MemPhase>& mem_phases() {
+	return phases;
+}
+
+void mem_save(const fs::path& fn) {
+	std::ofstream out(fn, std::ios::binary);
+	out.exceptions(std::ios::badbit | std::ios::failbit);
+	out << "phase\trss\trss_growth\theap\theap_libxml\theap_icu\n";
+	for (auto& p : phases) {
+		out << p.name << '\t' << p.rss << '\t' << p.rss_growth << '\t' << p.heap << '\t' << p.heap_xml << '\t' << p.heap_icu << '\n';
+	}
+}
+
+size_t mem_rss() {
+#ifdef _WIN32
+	return 0;
+#else
+	rusage ru{};
+	getrusage(RUSAGE_SELF, &ru);
+	#ifdef __APPLE__
+	return SZ(ru.ru_maxrss);
+	#else
+	return SZ(ru.ru_maxrss) * 1024;
+	#endif
+#endif
+}
+
+size_t mem_projected(std::string_view format, size_t bytes, bool stream_zip) {
+	// Peak RSS per byte of document XML or text, as measured on generated documents of 2k and 16k paragraphs and then rounded up,
+	// on top of what the program and its libraries take by themselves
+	size_t base = 12 << 20;
+	size_t factor = 40;
+	if (format == "docx") {
+		factor = stream_zip ? 9 : 13;
+	}
+	else if (format == "pptx") {
+		factor = stream_zip ? 13 : 18;
+	}
+	else if (format == "odt" || format == "odp") {
+		factor = stream_zip ? 14 : 20;
+	}
+	else if (format == "text" || format == "line") {
+		factor = 14;
+	}
+	else if (format == "skeleton") {
+		factor = 28;
+	}
+	return base + factor * bytes;
+}
+
+void mem_budget(Settings& settings, std::string_view what, size_t projected) {
+	if (!settings.max_memory) {
+		return;
+	}
+	if (projected > settings.max_memory) {
+		throw std::runtime_error(concat("Projected peak memory of ", mem_mib(projected), " MiB for ", what, " exceeds --max-memory of ", mem_mib(settings.max_memory), " MiB"));
+	}
+	if (settings.opt_verbose) {
+		std::cerr << "Projected peak memory: " << mem_mib(projected) << " MiB (" << projected << " bytes)" << std::endl;
+	}
+}
+
+size_t mem_parse(std::string_view value) {
+	size_t rv = 0;
+	size_t i = 0;
+	for (; i < value.size() && value[i] >= '0' && value[i] <= '9'; ++i) {
+		rv = rv * 10 + SZ(value[i] - '0');
+	}
+	if (i == 0 || i + 1 < value.size()) {
+		throw std::runtime_error(concat("Could not parse memory size: ", value));
+	}
+	if (i < value.size()) {
+		switch (value[i]) {
+		case 'k': case 'K': rv <<= 10; break;
+		case 'm': case 'M': rv <<= 20; break;
+		case 'g': case 'G': rv <<= 30; break;
+		default:
+			throw std::runtime_error(concat("Could not parse memory size: ", value));
+		}
+	}
+	return rv;
+}
+
+std::string mem_mib(size_t bytes) {
+	auto tenths = (bytes * 10 + (1 << 19)) >> 20;
+	return concat(std::to_string(tenths / 10), ".", std::to_string(tenths % 10));
+}
+
+}
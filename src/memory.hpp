@@ -0,0 +1,78 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_MEMORY_HPP_
+#define e5bd51be_MEMORY_HPP_
+
+#include "filesystem.hpp"
+#include "shared.hpp"
+#include <libxml/tree.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Transfuse {
+
+// Peaks of one phase of a run, in bytes. RSS is the process' high-water mark, which only ever grows, so rss_growth is how much this phase added to it.
+struct MemPhase {
+	std::string name;
+	size_t rss = 0;
+	size_t rss_growth = 0;
+	size_t heap = 0;
+	size_t heap_xml = 0;
+	size_t heap_icu = 0;
+};
+
+// Routes libxml and ICU allocations through counters, and refuses those that would take the two past budget, if that isn't 0. Must run before either library is used.
+// Without it, allocations are not counted and ICU keeps its own allocator.
+void mem_track(size_t budget);
+// Ends the current phase and starts the next one. Throws if an allocation was refused during it, because then the libraries may have quietly given up on part of the document.
+void mem_phase(Settings& settings, std::string_view name);
+const std::vector<MemPhase>& mem_phases();
+// Writes the phases as tab-separated values with a header line
+void mem_save(const fs::path& fn);
+
+// Puts what libxml allocates for one document in an arena of size-classed slabs, which is released as a whole when this goes out of scope.
+// Nothing libxml allocated in the meantime may outlive it. Does nothing if disabled or if an arena is already active.
+// Installs libxml's allocator on first use, which stays for the rest of the process.
+struct MemArena {
+	bool active = false;
+
+	MemArena(bool enable = true);
+	~MemArena();
+	MemArena(const MemArena&) = delete;
+	MemArena& operator=(const MemArena&) = delete;
+};
+
+// Frees a document, unless it lives in the active arena, which will release it along with everything else
+void mem_free_doc(xmlDocPtr doc);
+
+// Peak resident set size of the process so far
+size_t mem_rss();
+// Rough peak RSS for a document whose XML or text is this many bytes, in the format or "skeleton" for injection
+size_t mem_projected(std::string_view format, size_t bytes, bool stream_zip);
+// Throws if a projection is over --max-memory, naming what it was for, such as "this docx document"
+void mem_budget(Settings& settings, std::string_view what, size_t projected);
+
+// Sizes such as 512M or 2G, in binary units
+size_t mem_parse(std::string_view value);
+std::string mem_mib(size_t bytes);
+
+}
+
+#endif
@@ -20,6 +20,13 @@
 #include <unicode/ucnv.h>
 #include <unicode/utf8.h>
 #include <libxml/tree.h>
+#include <zip.h>
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <dlfcn.h>
+#endif
 #include <stdexcept>
 using namespace icu;
 
@@ -110,8 +117,100 @@ UnicodeString to_ustring(std::string_view data, std::string_view enc) {
 	return rv;
 }
 
-void hook_inject(Settings* settings, std::string_view fn) {
+namespace {
+
+// Keeps one plugin loaded, and unloads it when another is asked for or at exit
+struct HookPlugin {
+	std::string path;
+	transfuse_hook_inject_t func = nullptr;
+#ifdef _WIN32
+	HMODULE handle = nullptr;
+#else
+	void* handle = nullptr;
+#endif
+
+	void close() {
+		if (handle) {
+#ifdef _WIN32
+			FreeLibrary(handle);
+#else
+			dlclose(handle);
+#endif
+		}
+		handle = nullptr;
+		func = nullptr;
+		path.clear();
+	}
+
+	~HookPlugin() {
+		close();
+	}
+};
+
+transfuse_hook_inject_t hook_plugin(std::string_view path) {
+	static HookPlugin plugin;
+	if (plugin.func && plugin.path == path) {
+		return plugin.func;
+	}
+	plugin.close();
+
+	std::string fn{ path };
+#ifdef _WIN32
+	plugin.handle = LoadLibraryA(fn.c_str());
+	if (plugin.handle == nullptr) {
+		throw std::runtime_error(concat("Could not load hook plugin ", fn, ": error ", std::to_string(GetLastError())));
+	}
+	plugin.func = reinterpret_cast<transfuse_hook_inject_t>(GetProcAddress(plugin.handle, "transfuse_hook_inject"));
+#else
+	plugin.handle = dlopen(fn.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (plugin.handle == nullptr) {
+		throw std::runtime_error(concat("Could not load hook plugin ", fn, ": ", dlerror()));
+	}
+	plugin.func = reinterpret_cast<transfuse_hook_inject_t>(dlsym(plugin.handle, "transfuse_hook_inject"));
+#endif
+	if (plugin.func == nullptr) {
+		plugin.close();
+		throw std::runtime_error(concat("Hook plugin ", fn, " does not export transfuse_hook_inject()"));
+	}
+	plugin.path = fn;
+	return plugin.func;
+}
+
+}
+
+void hook_inject(Settings* settings, std::string_view format, std::string_view fn, std::string& data) {
+	if (!settings->hook_inject_plugin.empty()) {
+		auto func = hook_plugin(settings->hook_inject_plugin);
+		std::string f{ format };
+		std::string n{ fn };
+		// The plugin may hand back a pointer into the data it was given, so the replacement is collected separately
+		struct {
+			std::string data;
+			bool set = false;
+			bool failed = false;
+		} repl;
+		// Nothing may unwind through the plugin's frames, so failure is returned to it instead
+		auto replace = [](void* ctx, const char* d, size_t s) -> int {
+			auto r = static_cast<decltype(repl)*>(ctx);
+			try {
+				r->data.assign(d, s);
+				r->set = true;
+				return 0;
+			}
+			catch (...) {
+				r->failed = true;
+				return 1;
+			}
+		};
+		if (func(f.c_str(), n.c_str(), data.data(), data.size(), &repl, replace) != 0 || repl.failed) {
+			throw std::runtime_error(concat("Hook plugin ", settings->hook_inject_plugin, " failed on ", fn));
+		}
+		if (repl.set) {
+			data.swap(repl.data);
+		}
+	}
 	if (!settings->hook_inject.empty()) {
+		file_save(fn, data);
 		std::string cmd{ settings->hook_inject };
 		cmd += ' ';
 		cmd += '"';
@@ -120,7 +219,61 @@ void hook_inject(Settings* settings, std::string_view fn) {
 		cmd += fn;
 		cmd += '"';
 		system(cmd.c_str());
+		data = file_load(fn);
+	}
+}
+
+std::string zip_replace(std::string_view archive, const std::vector<std::pair<std::string, std::string_view>>& entries, std::string_view what) {
+	zip_error_t error;
+	zip_error_init(&error);
+	auto src = zip_source_buffer_create(archive.data(), archive.size(), 0, &error);
+	if (src == nullptr) {
+		throw std::runtime_error(concat("Could not create buffer for ", what, " file: ", zip_error_strerror(&error)));
+	}
+	auto zip = zip_open_from_source(src, 0, &error);
+	if (zip == nullptr) {
+		zip_source_free(src);
+		throw std::runtime_error(concat("Could not open ", what, " file: ", zip_error_strerror(&error)));
+	}
+	// Closing the archive writes it back into the source, which must outlive that to be read from
+	zip_source_keep(src);
+
+	for (auto& entry : entries) {
+		auto esrc = zip_source_buffer(zip, entry.second.data(), entry.second.size(), 0);
+		if (esrc == nullptr) {
+			zip_discard(zip);
+			zip_source_free(src);
+			throw std::runtime_error(concat("Could not create buffer for ", entry.first));
+		}
+		if (zip_file_add(zip, entry.first.c_str(), esrc, ZIP_FL_OVERWRITE) < 0) {
+			zip_source_free(esrc);
+			zip_discard(zip);
+			zip_source_free(src);
+			throw std::runtime_error(concat("Could not replace ", entry.first));
+		}
+	}
+
+	if (zip_close(zip) < 0) {
+		std::string msg{ zip_strerror(zip) };
+		zip_discard(zip);
+		zip_source_free(src);
+		throw std::runtime_error(concat("Could not write ", what, " file: ", msg));
 	}
+
+	zip_stat_t stat;
+	zip_stat_init(&stat);
+	if (zip_source_stat(src, &stat) < 0 || !(stat.valid & ZIP_STAT_SIZE) || zip_source_open(src) < 0) {
+		zip_source_free(src);
+		throw std::runtime_error(concat("Could not read back ", what, " file"));
+	}
+	std::string rv(stat.size, 0);
+	auto got = zip_source_read(src, &rv[0], stat.size);
+	zip_source_close(src);
+	zip_source_free(src);
+	if (got < 0 || static_cast<zip_uint64_t>(got) != stat.size) {
+		throw std::runtime_error(concat("Could not read back ", what, " file"));
+	}
+	return rv;
 }
 
 }
@@ -20,9 +20,11 @@
 #define e5bd51be_SHARED_HPP_
 
 #include "filesystem.hpp"
+#include "transfuse-hook.h"
 #include <unicode/unistr.h>
 #include <map>
 #include <set>
+#include <vector>
 #include <string>
 #include <string_view>
 #include <fstream>
@@ -83,6 +85,11 @@ constexpr inline int64_t SI64(T t) {
 	return static_cast<int64_t>(t);
 }
 
+template<typename T>
+constexpr inline uint32_t UI32(T t) {
+	return static_cast<uint32_t>(t);
+}
+
 template<typename T>
 constexpr inline uint64_t UI64(T t) {
 	return static_cast<uint64_t>(t);
@@ -280,6 +287,7 @@ namespace Streams {
 	const std::string_view apertium{ "apertium" };
 	const std::string_view visl{ "visl" };
 	const std::string_view cg{ "cg" };
+	const std::string_view binary{ "binary" };
 }
 using Stream = std::string_view;
 
@@ -305,6 +313,8 @@ struct Settings {
 
 	fs::path tmpdir;
 	fs::path infile;
+	// Further stream files for inject, read as if concatenated after infile
+	std::vector<fs::path> infiles;
 	std::istream* in = nullptr;
 	std::unique_ptr<std::istream> _in;
 	std::ostream* out = nullptr;
@@ -320,13 +330,27 @@ struct Settings {
 	bool opt_no_extend = false;
 	bool opt_extract_more = false;
 	bool opt_mangle_xml = false;
+	bool opt_incremental = false;
+	bool opt_dedupe = false;
+	bool opt_bundle = false;
+	bool opt_stream_zip = false;
+	bool opt_no_arena = false;
 
 	std::string_view hook_inject;
+	std::string_view hook_inject_plugin;
+	fs::path cache;
+	size_t shards = 0;
+	size_t max_memory = 0;
+	fs::path memory_stats;
+	std::string_view cache_pair;
 
 	std::map<std::string_view, std::set<std::string_view>> tags;
 };
 
-void hook_inject(Settings* settings, std::string_view fn);
+// Runs the inject hooks, if any, on the data: first the plugin, then the program on the data as the file fn, reading back what it made of it
+void hook_inject(Settings* settings, std::string_view format, std::string_view fn, std::string& data);
+// Copies a ZIP archive in memory with the given entries added or replaced
+std::string zip_replace(std::string_view archive, const std::vector<std::pair<std::string, std::string_view>>& entries, std::string_view what);
 
 }
 
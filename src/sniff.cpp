@@ -0,0 +1,210 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sniff.hpp"
+#include "shared.hpp"
+#include "formats.hpp"
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace Transfuse {
+
+std::string_view to_string(Confidence c) {
+	switch (c) {
+	case Confidence::extension:
+		return "extension";
+	case Confidence::magic:
+		return "magic";
+	case Confidence::bounded:
+		return "bounded";
+	case Confidence::full:
+		return "full";
+	}
+	return "";
+}
+
+namespace {
+
+// Closing tags that tell what a document is, in order of precedence
+enum Tell : uint8_t {
+	tell_html = (1 << 0),
+	tell_tei = (1 << 1),
+	tell_inline = (1 << 2),
+};
+
+// Which telling closing tags the data has, found in one pass instead of a find() per tag
+uint8_t scan_tells(std::string_view data) {
+	constexpr std::string_view inlines[] = { "b", "a", "i", "span", "p", "u", "strong", "em", "s", "q", "font" };
+	uint8_t rv = 0;
+	char name[8]{};
+	for (auto b = ifind(data, "</"); b != std::string_view::npos; b = ifind(data, "</", b + 2)) {
+		size_t n = 0;
+		auto i = b + 2;
+		for (; i < data.size() && n < sizeof(name); ++i, ++n) {
+			auto c = data[i];
+			if (c >= 'A' && c <= 'Z') {
+				c = static_cast<char>(c + ('a' - 'A'));
+			}
+			if (c < 'a' || c > 'z') {
+				break;
+			}
+			name[n] = c;
+		}
+		if (n == 0 || i >= data.size() || data[i] != '>') {
+			continue;
+		}
+		std::string_view tag(name, n);
+		if (tag == "html") {
+			rv |= tell_html;
+		}
+		else if (tag == "tei") {
+			rv |= tell_tei;
+		}
+		else if (std::find(std::begin(inlines), std::end(inlines), tag) != std::end(inlines)) {
+			rv |= tell_inline;
+		}
+	}
+	return rv;
+}
+
+std::string_view from_tells(uint8_t tells) {
+	if (tells & tell_html) {
+		return "html";
+	}
+	if (tells & tell_tei) {
+		return "tei";
+	}
+	if (tells & tell_inline) {
+		return "html-fragment";
+	}
+	return "text";
+}
+
+}
+
+Sniff sniff(State& state, const fs::path& infile) {
+	Sniff rv;
+
+	auto ext = infile.extension().string();
+	if (!ext.empty()) {
+		ext = ext.substr(1);
+	}
+	to_lower(ext);
+
+	rv.confidence = Confidence::extension;
+	if (ext == "docx") {
+		rv.format = "docx";
+	}
+	else if (ext == "pptx") {
+		rv.format = "pptx";
+	}
+	else if (ext == "odt") {
+		rv.format = "odt";
+	}
+	else if (ext == "odp") {
+		rv.format = "odp";
+	}
+	else if (ext == "xml") {
+		rv.format = "tei";
+	}
+	else if (ext == "html" || ext == "htm") {
+		rv.format = "html";
+	}
+	else if (ext == "text" || ext == "txt") {
+		rv.format = "text";
+	}
+	if (rv.format != "auto") {
+		return rv;
+	}
+
+	// Only the first and last sniff_window bytes are read, unless the document is small enough that this would be all of it anyway
+	std::string_view head;
+	std::string_view tail;
+	std::string head_b;
+	std::string tail_b;
+	if (state.original.data()) {
+		auto size = state.original.size();
+		head = state.original.substr(0, (size > 2 * sniff_window) ? sniff_window : size);
+		if (size > 2 * sniff_window) {
+			tail = state.original.substr(size - sniff_window);
+		}
+	}
+	else {
+		std::ifstream in("original", std::ios::binary);
+		in.exceptions(std::ios::badbit | std::ios::failbit);
+		in.seekg(0, std::istream::end);
+		auto size = SZ(in.tellg());
+		in.seekg(0, std::istream::beg);
+		head_b.resize((size > 2 * sniff_window) ? sniff_window : size);
+		in.read(&head_b[0], SS(head_b.size()));
+		head = head_b;
+		if (size > 2 * sniff_window) {
+			tail_b.resize(sniff_window);
+			in.seekg(SS(size - sniff_window), std::istream::beg);
+			in.read(&tail_b[0], SS(tail_b.size()));
+			tail = tail_b;
+		}
+	}
+
+	if (head.size() >= 4 && head[0] == 'P' && head[1] == 'K' && ((head[2] == '\x03' && head[3] == '\x04') || (head[2] == '\x05' && head[3] == '\x06') || (head[2] == '\x07' && head[3] == '\x08'))) {
+		rv.confidence = Confidence::magic;
+		rv.zip = original_zip(state, "zip");
+		if (zip_name_locate(rv.zip, "word/document.xml", 0) >= 0) {
+			rv.format = "docx";
+		}
+		else if (zip_name_locate(rv.zip, "ppt/slides/slide1.xml", 0) >= 0) {
+			rv.format = "pptx";
+		}
+		else if (zip_name_locate(rv.zip, "[Content_Types].xml", 0) >= 0) {
+			rv.format = "docx";
+		}
+		else if (zip_name_locate(rv.zip, "content.xml", 0) >= 0) {
+			// ODP == ODT
+			rv.format = "odt";
+		}
+		else {
+			zip_close(rv.zip);
+			rv.zip = nullptr;
+		}
+		return rv;
+	}
+
+	uint8_t tells = scan_tells(head);
+	tells |= scan_tells(tail);
+	if (tail.empty()) {
+		rv.confidence = Confidence::full;
+	}
+	else if (tells) {
+		rv.confidence = Confidence::bounded;
+	}
+	else {
+		// Neither end said anything, so look at all of it, without the lower-cased copy that a plain find() would need
+		rv.confidence = Confidence::full;
+		if (state.original.data()) {
+			tells = scan_tells(state.original);
+		}
+		else {
+			tells = scan_tells(file_load("original"));
+		}
+	}
+	rv.format = from_tells(tells);
+	return rv;
+}
+
+}
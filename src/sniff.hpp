@@ -0,0 +1,96 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_SNIFF_HPP_
+#define e5bd51be_SNIFF_HPP_
+
+#include "filesystem.hpp"
+#include "state.hpp"
+#include <zip.h>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace Transfuse {
+
+// How sure sniff() is of the format it found, from most to least certain
+enum class Confidence {
+	extension, // The file name said so
+	magic,     // A ZIP archive with the entries that only the format has
+	bounded,   // A telling tag in the first or last sniff_window bytes
+	full,      // Had to look through all of the document
+};
+
+std::string_view to_string(Confidence);
+
+struct Sniff {
+	std::string_view format{ "auto" };
+	Confidence confidence = Confidence::full;
+	// The archive, if the original is one, left open for the format's extraction to take over
+	zip_t* zip = nullptr;
+};
+
+// How much of each end of a document sniff() looks at before giving up and looking at all of it
+constexpr size_t sniff_window = 64 * 1024;
+
+// Works out the format of the original from the file name, and otherwise from its contents
+Sniff sniff(State& state, const fs::path& infile);
+
+// Offset of the first ASCII case-insensitive match of needle, which must be lower-case and start with a non-letter, or npos
+// The first character is found with memchr() for byte data, so most of the data is skipped over with vector instructions
+template<typename C>
+inline size_t ifind(std::basic_string_view<C> hay, std::string_view needle, size_t b = 0) {
+	if (needle.empty() || hay.size() < needle.size()) {
+		return std::string_view::npos;
+	}
+	auto last = hay.size() - needle.size();
+	while (b <= last) {
+		if constexpr (sizeof(C) == 1) {
+			auto p = static_cast<const C*>(memchr(hay.data() + b, needle[0], last - b + 1));
+			if (p == nullptr) {
+				break;
+			}
+			b = SZ(p - hay.data());
+		}
+		else {
+			b = hay.find(static_cast<C>(needle[0]), b);
+			if (b == std::string_view::npos || b > last) {
+				break;
+			}
+		}
+		size_t i = 1;
+		for (; i < needle.size(); ++i) {
+			auto c = hay[b + i];
+			if (c >= 'A' && c <= 'Z') {
+				c = static_cast<C>(c + ('a' - 'A'));
+			}
+			if (c != static_cast<C>(needle[i])) {
+				break;
+			}
+		}
+		if (i == needle.size()) {
+			return b;
+		}
+		++b;
+	}
+	return std::string_view::npos;
+}
+
+}
+
+#endif
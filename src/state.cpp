@@ -17,15 +17,19 @@
 
 #include "state.hpp"
 #include "shared.hpp"
+#include "bundle.hpp"
 #include "base64.hpp"
 #include <xxhash.h>
 #include <sqlite3.h>
 #include <array>
 #include <map>
+#include <vector>
+#include <unordered_map>
 #include <stdexcept>
 
 // SQLite use is completely contained in this file and hidden from the rest of the codebase
 // Only begin() and commit() hint at there being a database for storage, but they would also be useful for other storage backends
+// A state folder that only has a bundle is read from that instead, and is then read-only
 
 namespace Transfuse {
 
@@ -68,6 +72,8 @@ enum Stmt {
 	info_ins,
 	style_ins,
 	style_sel,
+	block_ins,
+	block_sel,
 	num_stmts
 };
 
@@ -78,14 +84,30 @@ struct State::impl {
 	std::string tmp_s;
 
 	std::map<std::string, std::map<std::string, std::tuple<std::string, std::string, std::string>>> styles;
+	std::map<std::string, std::pair<std::string, std::string>, std::less<>> blocks;
 
 	sqlite3* db = nullptr;
 	std::array<sqlite3_stmt_h, num_stmts> stmts;
+	std::unique_ptr<Bundle> bundle;
 
 	auto& stm(Stmt s) {
 		return stmts[s];
 	}
 
+	void load_blocks() {
+		if (!blocks.empty() || !stm(block_sel)) {
+			return;
+		}
+		std::string i;
+		stm(block_sel).reset();
+		while (sqlite3_step(stm(block_sel)) == SQLITE_ROW) {
+			i = reinterpret_cast<const char*>(sqlite3_column_text(stm(block_sel), 0));
+			auto& kb = blocks[i];
+			kb.first = reinterpret_cast<const char*>(sqlite3_column_text(stm(block_sel), 1));
+			kb.second.assign(reinterpret_cast<const char*>(sqlite3_column_text(stm(block_sel), 2)), SZ(sqlite3_column_bytes(stm(block_sel), 2)));
+		}
+	}
+
 	~impl() {
 		for (auto& stm : stmts) {
 			stm.clear();
@@ -94,16 +116,22 @@ struct State::impl {
 	}
 };
 
-State::State(Settings* settings, bool ro)
+State::State(Settings* settings, bool ro, bool memory)
   : settings(settings)
   , s(std::make_unique<impl>())
 {
+	if (ro && !fs::exists("state.sqlite3") && fs::exists("state.tfs")) {
+		s->bundle = std::make_unique<Bundle>(fs::current_path() / "state.tfs");
+		return;
+	}
+
 	if (sqlite3_initialize() != SQLITE_OK) {
 		throw std::runtime_error("sqlite3_initialize() errored");
 	}
 
 	int flags = ro ? (SQLITE_OPEN_READONLY) : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
-	if (sqlite3_open_v2((fs::current_path() / "state.sqlite3").string().c_str(), &s->db, flags, nullptr) != SQLITE_OK) {
+	auto fn = memory ? std::string(":memory:") : (fs::current_path() / "state.sqlite3").string();
+	if (sqlite3_open_v2(fn.c_str(), &s->db, flags, nullptr) != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3_open_v2() error: ", sqlite3_errmsg(s->db)));
 	}
 
@@ -117,6 +145,10 @@ State::State(Settings* settings, bool ro)
 			throw std::runtime_error(concat("sqlite3 error while creating inlines table: ", sqlite3_errmsg(s->db)));
 		}
 
+		if (sqlite3_exec(s->db, "CREATE TABLE IF NOT EXISTS blocks (id TEXT PRIMARY KEY NOT NULL, key TEXT NOT NULL, body TEXT DEFAULT '')") != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error while creating blocks table: ", sqlite3_errmsg(s->db)));
+		}
+
 		if (sqlite3_prepare_v2(s->db, "INSERT OR REPLACE INTO info (key, value) VALUES (:key, :value)", -1, &s->stm(info_ins)(), nullptr) != SQLITE_OK) {
 			throw std::runtime_error(concat("sqlite3 error preparing insert into info table: ", sqlite3_errmsg(s->db)));
 		}
@@ -124,6 +156,10 @@ State::State(Settings* settings, bool ro)
 		if (sqlite3_prepare_v2(s->db, "INSERT OR REPLACE INTO styles (tag, hash, otag, ctag, flags) VALUES (:tag, :hash, :otag, :ctag, :flags)", -1, &s->stm(style_ins)(), nullptr) != SQLITE_OK) {
 			throw std::runtime_error(concat("sqlite3 error preparing insert into styles table: ", sqlite3_errmsg(s->db)));
 		}
+
+		if (sqlite3_prepare_v2(s->db, "INSERT OR REPLACE INTO blocks (id, key, body) VALUES (:id, :key, :body)", -1, &s->stm(block_ins)(), nullptr) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error preparing insert into blocks table: ", sqlite3_errmsg(s->db)));
+		}
 	}
 
 	// All the reading prepared statements
@@ -134,18 +170,27 @@ State::State(Settings* settings, bool ro)
 	if (sqlite3_prepare_v2(s->db, "SELECT tag, hash, otag, ctag, flags FROM styles", -1, &s->stm(style_sel)(), nullptr) != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3 error preparing select from styles table: ", sqlite3_errmsg(s->db)));
 	}
+
+	// State folders from before the translation cache have no blocks table, which just means no blocks were cached
+	sqlite3_prepare_v2(s->db, "SELECT id, key, body FROM blocks", -1, &s->stm(block_sel)(), nullptr);
 }
 
 State::~State() {
 }
 
 void State::begin() {
+	if (s->bundle) {
+		return;
+	}
 	if (sqlite3_exec(s->db, "BEGIN") != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3 error while beginning transaction: ", sqlite3_errmsg(s->db)));
 	}
 }
 
 void State::commit() {
+	if (s->bundle) {
+		return;
+	}
 	if (sqlite3_exec(s->db, "COMMIT") != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3 error while committing transaction: ", sqlite3_errmsg(s->db)));
 	}
@@ -188,6 +233,9 @@ std::string_view State::stream() {
 }
 
 void State::info(std::string_view key, std::string_view val) {
+	if (s->bundle) {
+		throw std::runtime_error("State bundle is read-only");
+	}
 	s->stm(info_ins).reset();
 	if (sqlite3_bind_text(s->stm(info_ins), 1, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(s->db)));
@@ -201,6 +249,10 @@ void State::info(std::string_view key, std::string_view val) {
 }
 
 std::string State::info(std::string_view key) {
+	if (s->bundle) {
+		return std::string(s->bundle->info(key));
+	}
+
 	std::string rv;
 
 	s->stm(info_sel).reset();
@@ -227,6 +279,9 @@ xmlChar_view State::style(xmlChar_view _name, xmlChar_view _otag, xmlChar_view _
 	auto h32 = XXH32(s->tmp_s.data(), s->tmp_s.size(), 0);
 	base64_url(s->tmp_s, h32);
 
+	if (s->bundle) {
+		throw std::runtime_error("State bundle is read-only");
+	}
 	s->stm(style_ins).reset();
 	if (sqlite3_bind_text(s->stm(style_ins), 1, name.data(), SI(name.size()), SQLITE_STATIC) != SQLITE_OK) {
 		throw std::runtime_error(concat("sqlite3 error trying to bind text for tag: ", sqlite3_errmsg(s->db)));
@@ -251,6 +306,10 @@ xmlChar_view State::style(xmlChar_view _name, xmlChar_view _otag, xmlChar_view _
 }
 
 std::tuple<std::string_view, std::string_view, std::string_view> State::style(std::string_view tag, std::string_view hash) {
+	if (s->bundle) {
+		return s->bundle->style(tag, hash);
+	}
+
 	if (s->styles.empty()) {
 		std::string t;
 		std::string h;
@@ -282,4 +341,107 @@ std::tuple<std::string_view, std::string_view, std::string_view> State::style(st
 	return oc->second;
 }
 
+void State::block(std::string_view id, std::string_view key, std::string_view body) {
+	if (s->bundle) {
+		throw std::runtime_error("State bundle is read-only");
+	}
+	s->stm(block_ins).reset();
+	if (sqlite3_bind_text(s->stm(block_ins), 1, id.data(), SI(id.size()), SQLITE_STATIC) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error trying to bind text for id: ", sqlite3_errmsg(s->db)));
+	}
+	if (sqlite3_bind_text(s->stm(block_ins), 2, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(s->db)));
+	}
+	if (sqlite3_bind_text(s->stm(block_ins), 3, body.empty() ? "" : body.data(), SI(body.size()), SQLITE_STATIC) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error trying to bind text for body: ", sqlite3_errmsg(s->db)));
+	}
+	if (sqlite3_step(s->stm(block_ins)) != SQLITE_DONE) {
+		throw std::runtime_error(concat("sqlite3 error inserting into blocks table: ", sqlite3_errmsg(s->db)));
+	}
+
+	if (!s->blocks.empty()) {
+		auto& kb = s->blocks[std::string(id)];
+		kb.first = key;
+		kb.second = body;
+	}
+}
+
+std::pair<std::string_view, std::string_view> State::block(std::string_view id) {
+	if (s->bundle) {
+		Bundle::Block blk;
+		if (s->bundle->block(id, blk)) {
+			return { blk.key, blk.body };
+		}
+		return {};
+	}
+
+	s->load_blocks();
+
+	auto it = s->blocks.find(id);
+	if (it == s->blocks.end()) {
+		return {};
+	}
+	return it->second;
+}
+
+std::unordered_map<std::string, std::string> State::translated() {
+	std::unordered_map<std::string, std::string> rv;
+	if (s->bundle) {
+		for (size_t i = 0; i < s->bundle->blocks(); ++i) {
+			auto blk = s->bundle->block(i);
+			if (!blk.body.empty()) {
+				rv[std::string(blk.key)] = blk.body;
+			}
+		}
+		return rv;
+	}
+
+	s->load_blocks();
+	for (auto& it : s->blocks) {
+		if (!it.second.second.empty()) {
+			rv[it.second.first] = it.second.second;
+		}
+	}
+	return rv;
+}
+
+void State::bundle(const fs::path& fn, std::string_view skeleton, std::string_view original) {
+	std::vector<std::vector<std::string>> data[3];
+	const char* sqls[3] = {
+		"SELECT key, value FROM info",
+		"SELECT tag, hash, otag, ctag, flags FROM styles",
+		"SELECT id, key, body FROM blocks",
+	};
+	for (size_t t = 0; t < 3; ++t) {
+		sqlite3_stmt_h stm;
+		if (sqlite3_prepare_v2(s->db, sqls[t], -1, &stm(), nullptr) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error preparing select for bundle: ", sqlite3_errmsg(s->db)));
+		}
+		while (sqlite3_step(stm) == SQLITE_ROW) {
+			auto& row = data[t].emplace_back();
+			for (int c = 0; c < sqlite3_column_count(stm); ++c) {
+				// Same as the other readers: only block bodies are taken at their full length
+				auto text = reinterpret_cast<const char*>(sqlite3_column_text(stm, c));
+				if (!text) {
+					row.emplace_back();
+				}
+				else if (t == 2 && c == 2) {
+					row.emplace_back(text, SZ(sqlite3_column_bytes(stm, c)));
+				}
+				else {
+					row.emplace_back(text);
+				}
+			}
+		}
+	}
+
+	std::vector<Bundle::Row> rows[3];
+	for (size_t t = 0; t < 3; ++t) {
+		for (auto& row : data[t]) {
+			rows[t].emplace_back(row.begin(), row.end());
+		}
+	}
+	Bundle::write(fn, original, skeleton, std::move(rows[0]), std::move(rows[1]), rows[2]);
+}
+
 }
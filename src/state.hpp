@@ -25,13 +25,17 @@
 #include <string>
 #include <string_view>
 #include <memory>
+#include <unordered_map>
 
 namespace Transfuse {
 
 struct State {
 	Settings* settings;
+	// The original document when it is held in memory, as in fused clean mode, instead of in the state folder; an empty document still has non-null data()
+	std::string_view original;
 
-	State(Settings*, bool ro = false);
+	// A memory state lives in an in-memory database, for when there is no state folder at all
+	State(Settings*, bool ro = false, bool memory = false);
 	~State();
 
 	void begin();
@@ -55,6 +59,14 @@ struct State {
 	}
 	std::tuple<std::string_view, std::string_view, std::string_view> style(std::string_view tag, std::string_view hash);
 
+	void block(std::string_view id, std::string_view key, std::string_view body = "");
+	std::pair<std::string_view, std::string_view> block(std::string_view id);
+	// Translations recorded by a previous injection, by block key
+	std::unordered_map<std::string, std::string> translated();
+
+	// Writes the whole state, the skeleton, and the original document to a single bundle file
+	void bundle(const fs::path&, std::string_view skeleton, std::string_view original);
+
 protected:
 	struct impl;
 	std::unique_ptr<impl> s;
@@ -19,12 +19,13 @@
 #include "xml.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
-#include <unicode/utext.h>
-#include <unicode/regex.h>
+#include "markers.hpp"
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <string>
 #include <memory>
-using namespace icu;
+#include <cstring>
 
 namespace Transfuse {
 
@@ -44,18 +45,31 @@ static void escape_meta(xmlString& s, xmlChar_view xc) {
 }
 
 static void escape_body(xmlString& s, std::string_view xc) {
-	for (size_t i = 0; i < xc.size(); ++i) {
-		if (xc[i] == '^' || xc[i] == '$' || xc[i] == '[' || xc[i] == ']' || xc[i] == '{' || xc[i] == '}' || xc[i] == '/' || xc[i] == '\\' || xc[i] == '@' || xc[i] == '<' || xc[i] == '>') {
-			s += '\\';
+	auto escape_run = [&](size_t b, size_t e) {
+		for (; b < e; ++b) {
+			auto c = xc[b];
+			if (c == '^' || c == '$' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '\\' || c == '@' || c == '<' || c == '>') {
+				s += '\\';
+			}
+			s += static_cast<xmlChar>(c);
 		}
-		else if (xc[i] == '\xee' && xc[i + 1] == '\x80' && xc[i + 2] == '\x91') {
+	};
+
+	MarkerScanner scan(xc);
+	Marker m;
+	size_t last = 0;
+	while (scan.next(m)) {
+		escape_run(last, m.offset);
+		last = scan.pos;
+
+		if (m.kind == marker_kind(TFI_OPEN_B)) {
+			auto b = m.offset + 3;
+			auto e = scan.skip_to(marker_kind(TFI_OPEN_E));
+			auto wbs = xc.substr(b, e - b);
+			last = scan.pos;
 			s += "[[";
-			i += 3;
-			auto b = xc.find(TFI_OPEN_E, i);
-			auto wbs = xc.substr(i, b - i);
-			i = b + 2;
 			b = 0;
-			size_t e = 0;
+			e = 0;
 			while (b < wbs.size()) {
 				e = wbs.find(';', b);
 				s += "t:";
@@ -69,110 +83,116 @@ static void escape_body(xmlString& s, std::string_view xc) {
 				b = std::max(e, e + 1);
 			}
 			s += "]]";
-			continue;
 		}
-		else if (xc[i] == '\xee' && xc[i + 1] == '\x80' && xc[i + 2] == '\x93') {
+		else if (m.kind == marker_kind(TFI_CLOSE)) {
 			s += "[[/]]";
-			i += 2;
-			continue;
 		}
-		else if (xc[i] == '\xee' && xc[i + 1] == '\x80' && xc[i + 2] >= '\xa0' && xc[i + 2] <= '\xa1') {
-			if (xc[i + 2] == '\xa0') {
-				s += "[tf:";
-			}
-			else if (xc[i + 2] == '\xa1') {
-				s += "]";
-			}
-			i += 2;
-			continue;
+		else if (m.kind == marker_kind(TFP_OPEN)) {
+			s += "[tf:";
+		}
+		else if (m.kind == marker_kind(TFP_CLOSE)) {
+			s += "]";
+		}
+		else {
+			s.append(xc.begin() + m.offset, xc.begin() + last);
 		}
-		s += static_cast<xmlChar>(xc[i]);
 	}
+	escape_run(last, xc.size());
 }
 static void escape_body(xmlString& s, xmlChar_view xc) {
 	return escape_body(s, std::string_view(reinterpret_cast<const char*>(xc.data()), xc.size()));
 }
 
 // Stores the protected content as a style, but leaves the markers for later superblank treatment
+// Regions with only whitespace between them are merged, and regions at the beginning or end of a block tag are left as-is, all in one forward scan
 void ApertiumStream::protect_to_styles(xmlString& styled, State& state) {
 	if (state.settings->opt_verbose) {
 		std::cerr << "Protected to inline (Apertium)" << std::endl;
 	}
 
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-
-	// Merge protected regions if they only have whitespace between them
-	RegexMatcher rx_pmerge(R"X(\uE021([\s\r\n\p{Z}]*)\uE020)X", 0, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_pmerge.reset(&tmp_ut);
-
+	xmlChar_view sv{ styled };
 	xmlString ns;
 	ns.reserve(styled.size());
-
-	int32_t last = 0;
-	while (rx_pmerge.find()) {
-		auto b = rx_pmerge.start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
-		auto b1 = rx_pmerge.start(1, status);
-		auto e1 = rx_pmerge.end(1, status);
-		ns.append(styled.begin() + b1, styled.begin() + e1);
-		last = rx_pmerge.end(status);
-	}
-	ns.append(styled.begin() + last, styled.end());
-
-	styled.swap(ns);
-
-	// Find all protected regions and store their contents
-	RegexMatcher rx_prots(R"X(\uE020(.*?)\uE021)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_start(R"X(>[\s\p{Zs}]*$)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_end(R"X(^[\s\p{Zs}]*<)X", UREGEX_DOTALL, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots.reset(&tmp_ut);
-
-	ns.resize(0);
-	ns.reserve(styled.size());
 	xmlString tmp;
+	bool in_prot = false;
+
+	// Whether a block tag ends just before the region, looking back no further than 100 bytes
+	auto at_block_start = [&]() {
+		auto floor = (ns.size() > 100) ? ns.size() - 100 : 0;
+		auto i = skip_space_back(xmlChar_view(ns), ns.size(), floor);
+		return (i > floor && ns[i - 1] == '>');
+	};
+
+	// Whether a block tag starts just after the region, skipping over regions that will be merged away
+	auto at_block_end = [&](size_t i) {
+		for (;;) {
+			i = skip_space(sv, i);
+			if (i + 2 < sv.size() && sv[i] == 0xee && sv[i + 1] == 0x80 && sv[i + 2] == marker_kind(TFP_CLOSE)) {
+				auto m = merged_open(sv, i + 3);
+				if (m != xmlChar_view::npos) {
+					i = m;
+					continue;
+				}
+			}
+			return (i < sv.size() && sv[i] == '<');
+		}
+	};
 
-	UText tmp_pfx = UTEXT_INITIALIZER;
-	UText tmp_sfx = UTEXT_INITIALIZER;
-	last = 0;
-	while (rx_prots.find(last, status)) {
-		auto b = rx_prots.start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
+	MarkerScanner scan(sv);
+	Marker m;
+	size_t last = 0;
+	while (scan.next(m)) {
+		if (m.kind != marker_kind(TFP_OPEN) && m.kind != marker_kind(TFP_CLOSE)) {
+			continue;
+		}
+		auto& out = in_prot ? tmp : ns;
+		out.append(sv.substr(last, m.offset - last));
+		last = scan.pos;
 
-		auto b1 = rx_prots.start(1, status);
-		auto e1 = rx_prots.end(1, status);
-		tmp.assign(styled.begin() + b1, styled.begin() + e1);
-		last = rx_prots.end(status);
+		if (m.kind == marker_kind(TFP_OPEN)) {
+			if (in_prot) {
+				tmp += TFP_OPEN;
+			}
+			in_prot = true;
+			continue;
+		}
 
-		utext_openUTF8(tmp_pfx, ns);
-		utext_openUTF8(tmp_sfx, xmlChar_view(styled).substr(SZ(last)));
+		auto mo = merged_open(sv, scan.pos);
+		if (mo != xmlChar_view::npos) {
+			// Keep the whitespace, drop the close and open
+			out.append(sv.substr(scan.pos, mo - 3 - scan.pos));
+			scan.pos = last = mo;
+			continue;
+		}
 
-		rx_block_start.reset(&tmp_pfx);
-		if (rx_block_start.find(std::max(SI32(ns.size()) - 100, 0), status)) {
-			// If we are at the beginning of a block tag, just leave the protected inline as-is
-			ns += tmp;
+		if (!in_prot) {
+			ns += TFP_CLOSE;
 			continue;
 		}
+		in_prot = false;
 
-		rx_block_end.reset(&tmp_sfx);
-		if (rx_block_end.find()) {
-			// If we are at the end of a block tag, just leave the protected inline as-is
+		if (at_block_start() || at_block_end(scan.pos)) {
+			// If we are at the beginning or end of a block tag, just leave the protected inline as-is
 			ns += tmp;
-			continue;
 		}
+		else {
+			auto hash = state.style(XC("P"), tmp, XC(""));
+			ns += TFP_OPEN;
+			ns += "P:";
+			ns += hash;
+			ns += TFP_CLOSE;
+		}
+		tmp.clear();
+	}
 
-		auto hash = state.style(XC("P"), tmp, XC(""));
+	if (in_prot) {
+		tmp.append(sv.substr(last));
 		ns += TFP_OPEN;
-		ns += "P:";
-		ns += hash;
-		ns += TFP_CLOSE;
+		ns += tmp;
+	}
+	else {
+		ns.append(sv.substr(last));
 	}
-
-	ns.append(styled.begin() + last, styled.end());
 	styled.swap(ns);
 }
 
@@ -223,30 +243,123 @@ fs::path ApertiumStream::get_tmpdir(std::string& line) {
 	return {};
 }
 
-std::istream& ApertiumStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+// Handles the contents of a just closed [...] blank, which is in unesc
+void ApertiumStream::close_blank(std::string& str, std::string& block_id) {
+	if (unesc[0] == '[' && unesc[1] == '[' && unesc[2] == '/' && unesc[3] == ']' && unesc[4] == ']') {
+		if (!wbs.empty()) {
+			str += TFI_CLOSE;
+		}
+	}
+	else if (unesc[0] == '[' && unesc[1] == '[') {
+		wbs.clear();
+		wbs_seen.clear();
+		wb.assign(unesc.begin() + 2, unesc.end() - 2);
+		std::string_view wbv{ wb };
+		size_t b = 0;
+		while (b < wbv.size()) {
+			size_t e = wbv.find(';', b);
+			auto t = wbv.substr(b, e - b);
+			trim_wb(t);
+			// Deduplicate, and discard non-markup data
+			if (t.size() >= 2 && t[0] == 't' && t[1] == ':') {
+				t.remove_prefix(2);
+				if (wbs_seen.insert(t).second) {
+					wbs.push_back(t);
+				}
+			}
+			b = std::max(e, e + 1);
+		}
+		if (!wbs.empty()) {
+			str += TFI_OPEN_B;
+			for (auto& t : wbs) {
+				str += t;
+				str += ";";
+			}
+			str += TFI_OPEN_E;
+		}
+	}
+	else {
+		auto bb = unesc.find("[tf-block:");
+		auto eb = unesc.find("]", bb);
+		auto bp = unesc.find("[tf:");
+		auto ep = unesc.find("]", bp);
+		if (bb != std::string::npos && eb != std::string::npos) {
+			block_id.assign(unesc.begin() + PD(bb) + 10, unesc.begin() + PD(eb));
+		}
+		else if (bp != std::string::npos && ep != std::string::npos) {
+			str += TFP_OPEN;
+			str.append(unesc.begin() + 4, unesc.end() - 1);
+			str += TFP_CLOSE;
+		}
+		else if (unesc.compare("[]") == 0) {
+			if (!str.empty() && str.back() == '.') {
+				str.pop_back();
+			}
+		}
+		else {
+			str.append(unesc.begin() + 1, unesc.end() - 1);
+		}
+	}
+	unesc.clear();
+}
+
+// Bytes that interrupt a plain run of text: \0 ends the block, \ escapes the next byte, and [ ] open and close blanks
+// Outside blanks, ] has no special meaning, so it is last and left out there
+constexpr std::array<char, 4> stops{ '\0', '\\', '[', ']' };
+
+bool ApertiumStream::get_block(StreamInput& in, std::string& str, std::string& block_id) {
 	str.clear();
 	block_id.clear();
 
-	if (!in || in.peek() == std::ios::traits_type::eof()) {
-		return in;
+	if (!in.fill()) {
+		return false;
 	}
 
 	wbs.clear();
+	wbs_seen.clear();
 	unesc.clear();
 
 	bool in_blank = false;
 	bool in_wblank = false;
 
-	char c = 0;
-	int p = 0;
-	while (in.get(c)) {
-		if (c == '\\' && (p = in.peek()) != 0 && p != std::ios::traits_type::eof()) {
-			auto n = static_cast<char>(in.get());
-			if (in_blank) {
-				unesc += n;
+	while (in.fill()) {
+		auto& out = in_blank ? unesc : str;
+
+		// Copy the longest run of ordinary bytes in one go. Each stop byte is searched for with memchr() only once it has been passed, so every byte is scanned at most once per stop.
+		// The text is still copied into str, since escapes and blanks make it differ from the input.
+		auto run = in.view();
+		auto b = run.data();
+		auto e = b + run.size();
+		if (stop_gen != in.generation()) {
+			stop_at.fill(nullptr);
+			stop_gen = in.generation();
+		}
+		auto stop = e;
+		for (size_t k = 0; k < stops.size() - (in_blank ? 0 : 1); ++k) {
+			if (stop_at[k] == nullptr || stop_at[k] < b) {
+				auto p = static_cast<const char*>(memchr(b, stops[k], run.size()));
+				stop_at[k] = p ? p : e;
+			}
+			stop = std::min(stop, stop_at[k]);
+		}
+		auto i = SZ(stop - b);
+		out.append(b, i);
+		in.consume(i);
+		if (i == run.size()) {
+			continue;
+		}
+
+		auto c = run[i];
+		in.consume(1);
+
+		if (c == '\\') {
+			// A backslash escapes the next byte, unless that is \0 or end of input
+			if (in.fill() && in.view()[0] != 0) {
+				out += in.view()[0];
+				in.consume(1);
 			}
 			else {
-				str += n;
+				out += c;
 			}
 			continue;
 		}
@@ -260,84 +373,22 @@ std::istream& ApertiumStream::get_block(std::istream& in, std::string& str, std:
 				in_wblank = true;
 			}
 			in_blank = true;
-		}
-		else if (in_wblank && c == ']') {
-			// Do nothing
-		}
-		else if (in_blank && c == ']') {
-			// Do nothing
-		}
-
-		if (in_blank) {
 			unesc += c;
-		}
-		else {
-			str += c;
+			continue;
 		}
 
-		if (in_wblank && c == ']') {
+		// Only ] inside a blank is left
+		unesc += c;
+		if (in_wblank) {
 			in_wblank = false;
 		}
-		else if (in_blank && c == ']') {
+		else {
 			in_blank = false;
-			if (unesc[0] == '[' && unesc[1] == '[' && unesc[2] == '/' && unesc[3] == ']' && unesc[4] == ']') {
-				if (!wbs.empty()) {
-					str += TFI_CLOSE;
-				}
-			}
-			else if (unesc[0] == '[' && unesc[1] == '[') {
-				wbs.clear();
-				wb.assign(unesc.begin() + 2, unesc.end() - 2);
-				size_t b = 0;
-				while (b < wb.size()) {
-					size_t e = wb.find(';', b);
-					unesc.assign(wb, b, e - b);
-					trim_wb(unesc);
-					// Deduplicate, and discard non-markup data
-					if (unesc[0] == 't' && unesc[1] == ':') {
-						unesc.erase(0, 2);
-						if (std::find(wbs.begin(), wbs.end(), unesc) == wbs.end()) {
-							wbs.push_back(unesc);
-						}
-					}
-					b = std::max(e, e + 1);
-				}
-				if (!wbs.empty()) {
-					str += TFI_OPEN_B;
-					for (auto& t : wbs) {
-						str += t;
-						str += ";";
-					}
-					str += TFI_OPEN_E;
-				}
-			}
-			else {
-				auto bb = unesc.find("[tf-block:");
-				auto eb = unesc.find("]", bb);
-				auto bp = unesc.find("[tf:");
-				auto ep = unesc.find("]", bp);
-				if (bb != std::string::npos && eb != std::string::npos) {
-					block_id.assign(unesc.begin() + PD(bb) + 10, unesc.begin() + PD(eb));
-				}
-				else if (bp != std::string::npos && ep != std::string::npos) {
-					str += TFP_OPEN;
-					str.append(unesc.begin() + 4, unesc.end() - 1);
-					str += TFP_CLOSE;
-				}
-				else if (unesc.compare("[]") == 0) {
-					if (str.back() == '.') {
-						str.pop_back();
-					}
-				}
-				else {
-					str.append(unesc.begin() + 1, unesc.end() - 1);
-				}
-			}
-			unesc.clear();
+			close_blank(str, block_id);
 		}
 	}
 
-	return in;
+	return true;
 }
 
 }
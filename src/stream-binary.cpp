@@ -0,0 +1,268 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "filesystem.hpp"
+#include "xml.hpp"
+#include "shared.hpp"
+#include "stream.hpp"
+#include "markers.hpp"
+#include <algorithm>
+#include <vector>
+#include <string>
+using namespace std::string_literals;
+
+namespace Transfuse {
+
+template<typename Str>
+inline void put_u32(Str& s, size_t v) {
+	auto le = to_little_endian(UI32(v));
+	s.append(reinterpret_cast<const typename Str::value_type*>(&le), sizeof(le));
+}
+
+inline uint32_t get_u32(std::string_view s, size_t off) {
+	if (off + sizeof(uint32_t) > s.size()) {
+		throw std::runtime_error("Binary stream frame was truncated");
+	}
+	uint32_t v = 0;
+	memcpy(&v, s.data() + off, sizeof(v));
+	return to_little_endian(v);
+}
+
+inline void patch_u32(xmlString& s, size_t off, size_t v) {
+	auto le = to_little_endian(UI32(v));
+	memcpy(&s[off], &le, sizeof(le));
+}
+
+// Output functions
+
+void BinaryStream::stream_header(xmlString& s, fs::path tmpdir) {
+	auto path = tmpdir.string();
+	s.append(XC(magic.data()), magic.size());
+	s += 'H';
+	put_u32(s, path.size());
+	s.append(XC(path.data()), path.size());
+}
+
+void BinaryStream::block_open(xmlString& s, xmlChar_view xc) {
+	frame = s.size();
+	flags = 0;
+	s += 'B';
+	put_u32(s, 0);
+	put_u32(s, xc.size());
+	s += xc;
+}
+
+// Splits the internal markers out of the text, so that the body is exactly what should be translated
+void BinaryStream::block_body(xmlString& s, xmlChar_view xcv) {
+	std::string_view xc(reinterpret_cast<const char*>(xcv.data()), xcv.size());
+
+	body.clear();
+	spans.clear();
+	open.clear();
+
+	MarkerScanner scan(xc);
+	Marker m;
+	size_t last = 0;
+	while (scan.next(m)) {
+		body.append(xc.begin() + PD(last), xc.begin() + PD(m.offset));
+		last = scan.pos;
+
+		if (m.kind == marker_kind(TFI_OPEN_B) || m.kind == marker_kind(TFP_OPEN)) {
+			auto e = scan.skip_to(marker_kind(m.kind == marker_kind(TFP_OPEN) ? TFP_CLOSE : TFI_OPEN_E));
+			if (e == std::string_view::npos) {
+				// Unterminated, so not ours to interpret
+				body.append(xc.begin() + PD(m.offset), xc.end());
+				last = xc.size();
+				break;
+			}
+			Span sp;
+			sp.kind = (m.kind == marker_kind(TFP_OPEN)) ? 'P' : 'I';
+			sp.begin = sp.end = UI32(body.size());
+			sp.name = xc.substr(last, e - last);
+			if (sp.kind == 'I') {
+				open.push_back(spans.size());
+			}
+			spans.push_back(sp);
+			last = scan.pos;
+		}
+		else if (m.kind == marker_kind(TFI_CLOSE) && !open.empty()) {
+			spans[open.back()].end = UI32(body.size());
+			spans[open.back()].closed = UI32(spans.size());
+			open.pop_back();
+		}
+		else {
+			body.append(xc.begin() + PD(m.offset), xc.begin() + PD(last));
+		}
+	}
+	body.append(xc.begin() + PD(last), xc.end());
+	for (auto i : open) {
+		spans[i].end = UI32(body.size());
+		spans[i].closed = UI32(spans.size());
+	}
+
+	put_u32(s, body.size());
+	s.append(XC(body.data()), body.size());
+	put_u32(s, spans.size());
+	for (auto& sp : spans) {
+		s += static_cast<xmlChar>(sp.kind);
+		put_u32(s, sp.begin);
+		put_u32(s, sp.end);
+		put_u32(s, sp.closed);
+		put_u32(s, sp.name.size());
+		s.append(XC(sp.name.data()), sp.name.size());
+	}
+}
+
+void BinaryStream::block_term_header(xmlString&) {
+	flags |= 1;
+}
+
+void BinaryStream::block_close(xmlString& s, xmlChar_view) {
+	s += static_cast<xmlChar>(flags);
+	patch_u32(s, frame + 1, s.size() - frame - 5);
+}
+
+// Input functions
+
+bool BinaryStream::get_header(StreamInput& in, std::string& path) {
+	if (!in.need(magic.size() + 5) || !in.view().starts_with(magic)) {
+		return false;
+	}
+	in.consume(magic.size());
+	auto v = in.view();
+	if (v[0] != 'H') {
+		return false;
+	}
+	auto len = get_u32(v, 1);
+	if (!in.need(5 + len)) {
+		throw std::runtime_error("Binary stream header was truncated");
+	}
+	path.assign(in.view().substr(5, len));
+	in.consume(5 + len);
+	return true;
+}
+
+fs::path BinaryStream::get_tmpdir(std::string& path) {
+	return fs::path(path);
+}
+
+bool BinaryStream::get_block(StreamInput& in, std::string& str, std::string& block_id) {
+	str.clear();
+	block_id.clear();
+
+	std::string_view v;
+	for (;;) {
+		if (!in.fill()) {
+			return false;
+		}
+		// Concatenated shards each repeat the magic and header
+		if (in.need(magic.size()) && in.view().starts_with(magic)) {
+			in.consume(magic.size());
+			continue;
+		}
+		if (!in.need(5)) {
+			throw std::runtime_error("Binary stream frame was truncated");
+		}
+		auto type = in.view()[0];
+		auto len = get_u32(in.view(), 1);
+		if (!in.need(5 + len)) {
+			throw std::runtime_error("Binary stream frame was truncated");
+		}
+		v = in.view().substr(5, len);
+		in.consume(5 + len);
+		if (type == 'B') {
+			break;
+		}
+		if (type != 'H') {
+			throw std::runtime_error(concat("Unknown binary stream frame type: ", std::to_string(static_cast<uint8_t>(type))));
+		}
+	}
+
+	size_t off = 0;
+	auto get_str = [&]() {
+		auto n = get_u32(v, off);
+		off += 4;
+		if (off + n > v.size()) {
+			throw std::runtime_error("Binary stream frame was truncated");
+		}
+		auto rv = v.substr(off, n);
+		off += n;
+		return rv;
+	};
+
+	block_id.assign(get_str());
+	auto text = get_str();
+
+	spans.clear();
+	auto n = get_u32(v, off);
+	off += 4;
+	for (uint32_t i = 0; i < n; ++i) {
+		if (off >= v.size()) {
+			throw std::runtime_error("Binary stream frame was truncated");
+		}
+		Span sp;
+		sp.kind = v[off++];
+		sp.begin = get_u32(v, off);
+		sp.end = get_u32(v, off + 4);
+		sp.closed = get_u32(v, off + 8);
+		off += 12;
+		sp.name = get_str();
+		if (sp.begin > sp.end || sp.end > text.size() || sp.closed > n || (sp.kind == 'I' && sp.closed <= i) || (sp.kind != 'I' && sp.kind != 'P')) {
+			throw std::runtime_error(concat("Invalid span in binary stream block ", block_id));
+		}
+		spans.push_back(sp);
+	}
+
+	// Order the markers by offset, then by when they happened: opening span i is sequence 2i+1, and a close that happened after c opened spans is sequence 2c
+	// Closes with the same sequence are nested, so the last opened closes first
+	events.clear();
+	for (size_t i = 0; i < spans.size(); ++i) {
+		auto& sp = spans[i];
+		events.emplace_back(sp.begin, 2 * i + 1, i);
+		if (sp.kind == 'I') {
+			events.emplace_back(sp.end, 2 * SZ(sp.closed), spans.size() - i);
+		}
+	}
+	std::sort(events.begin(), events.end());
+
+	str.reserve(text.size() + spans.size() * 16);
+	size_t last = 0;
+	for (auto& ev : events) {
+		auto at = std::get<0>(ev);
+		str.append(text.begin() + PD(last), text.begin() + at);
+		last = at;
+		if (std::get<1>(ev) % 2 == 0) {
+			str += TFI_CLOSE;
+			continue;
+		}
+		auto& sp = spans[std::get<2>(ev)];
+		if (sp.kind == 'P') {
+			str += TFP_OPEN;
+			str += sp.name;
+			str += TFP_CLOSE;
+			continue;
+		}
+		str += TFI_OPEN_B;
+		str += sp.name;
+		str += TFI_OPEN_E;
+	}
+	str.append(text.begin() + PD(last), text.end());
+
+	return true;
+}
+
+}
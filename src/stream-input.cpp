@@ -0,0 +1,115 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stream.hpp"
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace Transfuse {
+
+StreamInput::StreamInput(std::istream& in, bool is_stdin)
+  : ins{ &in }
+{
+#ifndef _WIN32
+	// If stdin was redirected from a regular file, map it instead of reading it, starting from wherever the file offset currently is
+	if (is_stdin) {
+		struct stat st {};
+		auto off = lseek(STDIN_FILENO, 0, SEEK_CUR);
+		if (off >= 0 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > off) {
+			auto p = mmap(nullptr, SZ(st.st_size), PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+			if (p != MAP_FAILED) {
+				madvise(p, SZ(st.st_size), MADV_SEQUENTIAL);
+				mapped = static_cast<const char*>(p);
+				mapped_size = SZ(st.st_size);
+				data = mapped;
+				size = mapped_size;
+				pos = SZ(off);
+				cur = 1;
+			}
+		}
+	}
+#else
+	(void)is_stdin;
+#endif
+}
+
+StreamInput::~StreamInput() {
+#ifndef _WIN32
+	if (mapped) {
+		munmap(const_cast<char*>(mapped), mapped_size);
+	}
+#endif
+}
+
+// Reads another chunk, keeping the unconsumed tail so that a line or run can span chunk boundaries, and moving on to the next stream when one runs dry
+bool StreamInput::more() {
+	if (cur >= ins.size()) {
+		return false;
+	}
+
+	if (mapped && data == mapped) {
+		buf.assign(data + pos, size - pos);
+	}
+	else {
+		buf.erase(0, pos);
+	}
+	++refills;
+	auto old = buf.size();
+	std::streamsize n = 0;
+	for (; cur < ins.size(); ++cur) {
+		buf.resize(old + chunk);
+		n = ins[cur]->rdbuf()->sgetn(&buf[old], SS(chunk));
+		if (n > 0) {
+			break;
+		}
+		n = 0;
+	}
+	buf.resize(old + SZ(n));
+
+	data = buf.data();
+	size = buf.size();
+	pos = 0;
+	return (n > 0);
+}
+
+bool StreamInput::getline(std::string_view& line) {
+	size_t scanned = 0;
+	for (;;) {
+		auto v = view();
+		auto nl = v.find('\n', scanned);
+		if (nl != std::string_view::npos) {
+			line = v.substr(0, nl);
+			consume(nl + 1);
+			return true;
+		}
+		scanned = v.size();
+		if (!more()) {
+			v = view();
+			if (v.empty()) {
+				return false;
+			}
+			line = v;
+			consume(v.size());
+			return true;
+		}
+	}
+}
+
+}
@@ -19,32 +19,36 @@
 #include "xml.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
-#include <unicode/utext.h>
-#include <unicode/regex.h>
+#include "markers.hpp"
+#include <unicode/uchar.h>
+#include <unicode/utf8.h>
 #include <memory>
-using namespace icu;
 
 namespace Transfuse {
 
 // Output functions
 
 static void escape_body(xmlString& s, std::string_view xc) {
-	for (size_t i = 0; i < xc.size(); ++i) {
-		if (xc[i] == '\xee' && xc[i + 1] == '\x80' && xc[i + 2] >= '\x91' && xc[i + 2] <= '\x93') {
-			if (xc[i + 2] == '\x91') {
-				s += "<STYLE:";
-			}
-			else if (xc[i + 2] == '\x92') {
-				s += ">";
-			}
-			else if (xc[i + 2] == '\x93') {
-				s += "</STYLE>";
-			}
-			i += 2;
-			continue;
+	MarkerScanner scan(xc);
+	Marker m;
+	size_t last = 0;
+	while (scan.next(m)) {
+		s.append(xc.begin() + last, xc.begin() + m.offset);
+		last = scan.pos;
+		if (m.kind == marker_kind(TFI_OPEN_B)) {
+			s += "<STYLE:";
+		}
+		else if (m.kind == marker_kind(TFI_OPEN_E)) {
+			s += ">";
+		}
+		else if (m.kind == marker_kind(TFI_CLOSE)) {
+			s += "</STYLE>";
+		}
+		else {
+			s.append(xc.begin() + m.offset, xc.begin() + last);
 		}
-		s += static_cast<xmlChar>(xc[i]);
 	}
+	s.append(xc.begin() + last, xc.end());
 }
 static void escape_body(xmlString& s, xmlChar_view xc) {
 	return escape_body(s, std::string_view(reinterpret_cast<const char*>(xc.data()), xc.size()));
@@ -56,219 +60,142 @@ void VISLStream::protect_to_styles(xmlString& styled, State& state) {
 		std::cerr << "Protected to inline (VISL)" << std::endl;
 	}
 
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-
-	// Merge protected regions if they only have whitespace between them
-	RegexMatcher rx_pmerge(R"X(\uE021([\s\r\n\p{Z}]*)\uE020)X", 0, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_pmerge.reset(&tmp_ut);
-
 	xmlString ns;
-	ns.reserve(styled.size());
-
-	int32_t last = 0;
-	while (rx_pmerge.find()) {
-		auto b = rx_pmerge.start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
-		auto b1 = rx_pmerge.start(1, status);
-		auto e1 = rx_pmerge.end(1, status);
-		ns.append(styled.begin() + b1, styled.begin() + e1);
-		last = rx_pmerge.end(status);
-	}
-	ns.append(styled.begin() + last, styled.end());
-
-	styled.swap(ns);
-
-	// Find all protected regions and convert them to styles on the surrounding tokens
-	RegexMatcher rx_prots(R"X(\uE020(.*?)\uE021)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_start(R"X(>[\s\p{Zs}]*$)X", 0, status);
-	RegexMatcher rx_block_end(R"X(^[\s\p{Zs}]*<)X", 0, status);
-
-	RegexMatcher rx_tag_start(R"X(<([-:_\p{L}\p{N}\p{M}]+))X", 0, status);
-
-	RegexMatcher rx_pfx_style(R"X(\ue013[\s\p{Zs}]*$)X", 0, status);
-	RegexMatcher rx_pfx_token(R"X([^<>\s\p{Z}\ue011-\ue013]+[\s\p{Zs}]*$)X", 0, status);
-	RegexMatcher rx_sfx_token(R"X(^[\s\p{Zs}]*[^<>\s\p{Z}\ue011-\ue013]+)X", 0, status);
-
-	RegexMatcher rx_ifx_start(R"X((\ue011[^\ue012]+\ue012)[\s\p{Zs}]*$)X", 0, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots.reset(&tmp_ut);
-
-	ns.resize(0);
-	ns.reserve(styled.size());
-	xmlString tmp_lxs[2];
-
-	UText tmp_pfx = UTEXT_INITIALIZER;
-	UText tmp_sfx = UTEXT_INITIALIZER;
-	UText tmp_p = UTEXT_INITIALIZER;
-	int64_t ni = 0;
-	for (size_t i = 0; i < 100; ++i) {
-		last = 0;
-		while (rx_prots.find(last, status)) {
-			auto b = rx_prots.start(status);
-			ns.append(styled.begin() + last, styled.begin() + b);
-
-			auto b1 = rx_prots.start(1, status);
-			auto e1 = rx_prots.end(1, status);
-			tmp_lxs[0].assign(styled.begin() + b1, styled.begin() + e1);
-			utext_openUTF8(tmp_p, tmp_lxs[0]);
-			last = rx_prots.end(status);
-
-			auto sfx = xmlChar_view(styled).substr(SZ(last));
-			utext_openUTF8(tmp_pfx, ns);
-			utext_openUTF8(tmp_sfx, sfx);
-
-			utext_setNativeIndex(&tmp_pfx, std::max(SI32(ns.size()) - 100, 0));
-			ni = utext_getNativeIndex(&tmp_pfx);
-			rx_block_start.reset(&tmp_pfx);
-			if (rx_block_start.find(ni, status)) {
-				// If we are at the beginning of a block tag, just leave the protected inline as-is
-				ns += tmp_lxs[0];
+	xmlString tmp;
+
+	// Whether a block tag ends just before the region, looking back no further than 100 bytes
+	auto at_block_start = [&]() {
+		auto floor = (ns.size() > 100) ? ns.size() - 100 : 0;
+		auto i = skip_space_back(xmlChar_view(ns), ns.size(), floor);
+		return (i > floor && ns[i - 1] == '>');
+	};
+
+	// Stream tokens for the names of the tags in a region, or a stand-in if it only has comments and the like
+	auto append_tag_names = [&](xmlChar_view p) {
+		auto data = p.data();
+		auto n = SI32(p.size());
+		bool had_tags = false;
+		for (int32_t i = 0; i < n;) {
+			if (p[SZ(i)] != '<') {
+				++i;
 				continue;
 			}
-
-			rx_block_end.reset(&tmp_sfx);
-			if (rx_block_end.find()) {
-				// If we are at the end of a block tag, just leave the protected inline as-is
-				ns += tmp_lxs[0];
-				continue;
+			auto b = ++i;
+			while (i < n) {
+				auto q = i;
+				UChar32 c = 0;
+				U8_NEXT(data, q, n, c);
+				if (c != '-' && c != ':' && c != '_' && !(U_GET_GC_MASK(c) & (U_GC_L_MASK | U_GC_N_MASK | U_GC_M_MASK))) {
+					break;
+				}
+				i = q;
 			}
-
-			auto hash = state.style(XC("P"), tmp_lxs[0], XC(""), "P");
-			ns += TFI_OPEN_B "P:";
-			ns += hash;
-			ns += TFI_OPEN_E;
-
-			bool had_tags = false;
-			rx_tag_start.reset(&tmp_p);
-			while (rx_tag_start.find()) {
-				auto tb = rx_tag_start.start(1, status);
-				auto te = rx_tag_start.end(1, status);
+			if (i > b) {
 				ns += TFP_STREAM_B;
-				ns.append(tmp_lxs[0].begin() + tb, tmp_lxs[0].begin() + te);
+				ns.append(p.substr(SZ(b), SZ(i - b)));
 				ns += TFP_STREAM_E;
 				had_tags = true;
 			}
-			if (!had_tags) {
-				ns += TFP_STREAM_B;
-				ns += "xml-special";
-				ns += TFP_STREAM_E;
-			}
+		}
+		if (!had_tags) {
+			ns += TFP_STREAM_B;
+			ns += "xml-special";
+			ns += TFP_STREAM_E;
+		}
+	};
 
-			ns += TFI_CLOSE;
+	// Each region runs from an opening to the first close after it. The first pass also merges regions that only have whitespace between them.
+	// A region left as-is can have had further openings inside it, which a later pass then pairs with whatever close comes after them.
+	auto convert = [&](bool merge) {
+		xmlChar_view sv{ styled };
+		ns.clear();
+		ns.reserve(styled.size());
+		tmp.clear();
+		bool in_prot = false;
+		bool again = false;
+
+		// Whether a block tag starts just after the region, skipping over regions that will be merged away
+		auto at_block_end = [&](size_t i) {
+			for (;;) {
+				i = skip_space(sv, i);
+				if (merge && i + 2 < sv.size() && sv[i] == 0xee && sv[i + 1] == 0x80 && sv[i + 2] == marker_kind(TFP_CLOSE)) {
+					auto m = merged_open(sv, i + 3);
+					if (m != xmlChar_view::npos) {
+						i = m;
+						continue;
+					}
+				}
+				return (i < sv.size() && sv[i] == '<');
+			}
+		};
 
-			/*
-			utext_setNativeIndex(&tmp_pfx, std::max(SI32(ns.size()) - 100, 0));
-			ni = utext_getNativeIndex(&tmp_pfx);
-			rx_ifx_start.reset(&tmp_pfx);
-			if (rx_ifx_start.find(ni, status)) {
-				// We're inside at the start of an existing style, so wrap whole inside
-				auto hash = state.style(XC("P"), tmp_lxs[0], XC(""));
-				auto last_s = rx_ifx_start.end(1, status);
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				auto first_c = styled.find(XC(TFI_CLOSE), SZ(last));
-				ns.append(styled, SZ(last), first_c - SZ(last));
-				ns += TFI_CLOSE;
-				last += SI32(first_c) - last;
+		MarkerScanner scan(sv);
+		Marker m;
+		size_t last = 0;
+		while (scan.next(m)) {
+			if (m.kind != marker_kind(TFP_OPEN) && m.kind != marker_kind(TFP_CLOSE)) {
 				continue;
 			}
+			auto& out = in_prot ? tmp : ns;
+			out.append(sv.substr(last, m.offset - last));
+			last = scan.pos;
 
-			utext_setNativeIndex(&tmp_pfx, std::max(SI32(ns.size()) - 100, 0));
-			ni = utext_getNativeIndex(&tmp_pfx);
-			rx_pfx_style.reset(&tmp_pfx);
-			if (rx_pfx_style.find(ni, status)) {
-				// Create a new style around the immediately preceding style
-				auto hash = state.style(XC("P"), XC(""), tmp_lxs[0]);
-				auto last_s = ns.rfind(XC(TFI_OPEN_B));
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				ns += TFI_CLOSE;
+			if (m.kind == marker_kind(TFP_OPEN)) {
+				if (in_prot) {
+					tmp += TFP_OPEN;
+				}
+				in_prot = true;
 				continue;
 			}
 
-			utext_setNativeIndex(&tmp_pfx, std::max(SI32(ns.size()) - 100, 0));
-			ni = utext_getNativeIndex(&tmp_pfx);
-			rx_pfx_token.reset(&tmp_pfx);
-			if (rx_pfx_token.find(ni, status)) {
-				// Create a new style around the immediately preceding token
-				auto hash = state.style(XC("P"), XC(""), tmp_lxs[0]);
-				auto last_s = rx_pfx_token.start(status);
-
-				if (last_s <= std::max(SI32(ns.size()) - 100, 0)) {
-					// If we are in the middle of a very long token (e.g. URL), encompass the whole token
-					UChar32 cp = 0;
-					utext_setNativeIndex(&tmp_pfx, last_s);
-					while ((cp = UTEXT_PREVIOUS32(&tmp_pfx)) != U_SENTINEL && (cp != '>' && cp != TFI_CLOSE_UC && !u_isWhitespace(cp))) {
-						// UTEXT_PREVIOUS32 already changed tmp_pfx
-					}
-					UTEXT_NEXT32(&tmp_pfx);
-					last_s = SI(utext_getNativeIndex(&tmp_pfx));
-				}
-				else {
-					// Move to next entity if there is one, to avoid cutting entities in half
-					auto amp = ns.find('&', last_s);
-					if (amp != xmlString::npos) {
-						last_s = SI(amp);
-					}
+			if (merge) {
+				auto mo = merged_open(sv, scan.pos);
+				if (mo != xmlChar_view::npos) {
+					// Keep the whitespace, drop the close and open
+					out.append(sv.substr(scan.pos, mo - 3 - scan.pos));
+					scan.pos = last = mo;
+					continue;
 				}
+			}
 
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				ns += TFI_CLOSE;
+			if (!in_prot) {
+				ns += TFP_CLOSE;
 				continue;
 			}
+			in_prot = false;
 
-			rx_sfx_token.reset(&tmp_sfx);
-			if (rx_sfx_token.find()) {
-				// Create a new style around the immediately succeeding token
-				auto hash = state.style(XC("P"), tmp_lxs[0], XC(""));
-				auto e = rx_sfx_token.end(status);
-				tmp_lxs[1] = sfx.substr(0, e);
+			if (at_block_start() || at_block_end(scan.pos)) {
+				// If we are at the beginning or end of a block tag, just leave the protected inline as-is
+				ns += tmp;
+				if (tmp.find(XC(TFP_OPEN)) != xmlString::npos) {
+					again = true;
+				}
+			}
+			else {
+				auto hash = state.style(XC("P"), tmp, XC(""), "P");
 				ns += TFI_OPEN_B "P:";
 				ns += hash;
 				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
+				append_tag_names(tmp);
 				ns += TFI_CLOSE;
-				last += e;
-				continue;
-			}
-
-			if (state.settings->opt_verbose) {
-				std::cerr << "Could not attach protected tag: " << XV2SV(tmp_lxs[0]) << std::endl;
 			}
-			//*/
+			tmp.clear();
 		}
 
-		if (last == 0) {
-			break;
+		if (in_prot) {
+			tmp.append(sv.substr(last));
+			ns += TFP_OPEN;
+			ns += tmp;
+		}
+		else {
+			ns.append(sv.substr(last));
 		}
-
-		ns.append(styled.begin() + last, styled.end());
 		styled.swap(ns);
-		utext_openUTF8(tmp_ut, styled);
-		rx_prots.reset(&tmp_ut);
-		ns.resize(0);
-		ns.reserve(styled.size());
-	}
+		return again;
+	};
 
-	utext_close(&tmp_pfx);
-	utext_close(&tmp_sfx);
+	for (size_t i = 0; i < 100 && convert(i == 0); ++i) {
+	}
 }
 
 void VISLStream::stream_header(xmlString& s, fs::path tmpdir) {
@@ -306,84 +233,107 @@ fs::path VISLStream::get_tmpdir(std::string& line) {
 	return {};
 }
 
-std::istream& VISLStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+// Lines that start with <s id="...">, as opposed to merely containing it
+inline bool block_id_line(std::string_view line, std::string& block_id) {
+	if (!line.starts_with("<s id=\"")) {
+		return false;
+	}
+	auto eb = line.find("\">");
+	if (eb == std::string_view::npos) {
+		return false;
+	}
+	block_id.assign(line.begin() + 7, line.begin() + PD(eb));
+	return true;
+}
+
+bool VISLStream::get_block(StreamInput& in, std::string& str, std::string& block_id) {
 	str.clear();
 	block_id.clear();
-	while (std::getline(in, buffer)) {
-		auto bb = buffer.find("<s id=\"");
-		auto eb = buffer.find("\">");
-		if (bb == 0 && eb != std::string::npos) {
-			block_id.assign(buffer.begin() + 7, buffer.begin() + PD(eb));
-			continue;
-		}
-		else if (buffer.compare("</s>") == 0) {
-			break;
+
+	bool any = false;
+	std::string_view line;
+	while (in.getline(line)) {
+		any = true;
+		// All stream commands start with <, so plain text lines skip all the prefix checks
+		if (!line.empty() && line[0] == '<') {
+			if (block_id_line(line, block_id)) {
+				continue;
+			}
+			if (line == "</s>") {
+				break;
+			}
+			// Concatenated shards repeat the stream header
+			if (line.starts_with("<STREAMCMD:TRANSFUSE:")) {
+				continue;
+			}
 		}
 
-		std::string_view buf{ buffer };
-		while (!buf.empty()) {
-			auto bs = buf.find("<STYLE:");
-			auto es = buf.find("</STYLE>");
+		while (!line.empty()) {
+			auto bs = line.find("<STYLE:");
+			auto es = line.find("</STYLE>");
 			if (es != std::string_view::npos && (bs == std::string_view::npos || es < bs)) {
-				str.append(buf.begin(), buf.begin() + es);
-				buf.remove_prefix(es + 8);
+				str.append(line.begin(), line.begin() + es);
+				line.remove_prefix(es + 8);
 				str += TFI_CLOSE;
 				continue;
 			}
 			if (bs != std::string_view::npos && (es == std::string_view::npos || bs < es)) {
-				str.append(buf.begin(), buf.begin() + bs);
+				str.append(line.begin(), line.begin() + bs);
 				str += TFI_OPEN_B;
-				buf.remove_prefix(bs + 7);
-				auto c = buf.find('>');
-				str.append(buf.begin(), buf.begin() + c);
-				buf.remove_prefix(c + 1);
+				line.remove_prefix(bs + 7);
+				auto c = line.find('>');
+				str.append(line.begin(), line.begin() + c);
+				line.remove_prefix(c + 1);
 				str += ";";
 				str += TFI_OPEN_E;
 				continue;
 			}
 			break;
 		}
-		str += buf;
+		str += line;
 	}
-	return in;
+	return any;
 }
 
-std::istream& CGStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+bool CGStream::get_block(StreamInput& in, std::string& str, std::string& block_id) {
 	str.clear();
 	block_id.clear();
-	while (std::getline(in, buffer)) {
-		auto bb = buffer.find("<s id=\"");
-		auto eb = buffer.find("\">");
-		auto bs = buffer.find("<STYLE:");
-		if (bb == 0 && eb != std::string::npos) {
-			block_id.assign(buffer.begin() + 7, buffer.begin() + PD(eb));
-			str += TF_SENTINEL;
-			continue;
-		}
-		else if (block_id.empty()) {
-			continue;
-		}
-		else if (bs == 0) {
-			trim(buffer);
-			str += TFI_OPEN_B;
-			str.append(buffer.begin() + 7, buffer.end() - 1);
-			str += ";";
-			str += TFI_OPEN_E;
+
+	bool any = false;
+	std::string_view line;
+	while (in.getline(line)) {
+		any = true;
+		bool cmd = (!line.empty() && line[0] == '<');
+		if (cmd && block_id_line(line, block_id)) {
 			str += TF_SENTINEL;
 			continue;
 		}
-		else if (buffer.compare("</STYLE>") == 0) {
-			str += TFI_CLOSE;
-			str += TF_SENTINEL;
+		if (block_id.empty()) {
 			continue;
 		}
-		else if (buffer.compare("</s>") == 0) {
-			break;
+		if (cmd) {
+			if (line.starts_with("<STYLE:")) {
+				trim(line);
+				str += TFI_OPEN_B;
+				str.append(line.begin() + 7, line.end() - 1);
+				str += ";";
+				str += TFI_OPEN_E;
+				str += TF_SENTINEL;
+				continue;
+			}
+			if (line == "</STYLE>") {
+				str += TFI_CLOSE;
+				str += TF_SENTINEL;
+				continue;
+			}
+			if (line == "</s>") {
+				break;
+			}
 		}
-		str += buffer;
+		str += line;
 		str += TF_SENTINEL;
 	}
-	return in;
+	return any;
 }
 
 }
@@ -24,13 +24,74 @@
 #include "shared.hpp"
 #include "state.hpp"
 #include <unicode/utext.h>
+#include <unordered_set>
+#include <array>
 #include <vector>
+#include <tuple>
 #include <string>
 #include <string_view>
 #include <fstream>
+#include <cstdint>
 
 namespace Transfuse {
 
+// Input side of a stream. Maps the whole input into memory when it is a regular file, and otherwise reads it in large chunks.
+// Parsers scan view() and consume() what they used, so there is no per-character istream overhead.
+struct StreamInput {
+	StreamInput(std::istream& in, bool is_stdin = false);
+	~StreamInput();
+
+	// Queues another stream to be read after the previous ones, as if they had been concatenated
+	void append(std::istream& in) {
+		ins.push_back(&in);
+	}
+
+	std::string_view view() const {
+		return std::string_view(data + pos, size - pos);
+	}
+
+	void consume(size_t n) {
+		pos += n;
+	}
+
+	// Makes sure view() is not empty, reading the next chunk if needed; returns false at end of input
+	bool fill() {
+		return (pos < size) || more();
+	}
+
+	// Makes sure view() has at least n bytes, reading more chunks as needed; returns false if input ends first
+	bool need(size_t n) {
+		while (size - pos < n) {
+			if (!more()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Yields the next line without the trailing \n. The view is valid until the next call to any function that reads.
+	bool getline(std::string_view& line);
+
+	// Changes whenever the data behind view() is replaced, so pointers into it can be kept until then
+	size_t generation() const {
+		return refills;
+	}
+
+private:
+	bool more();
+
+	std::vector<std::istream*> ins;
+	size_t cur = 0;
+	const char* data = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	const char* mapped = nullptr;
+	size_t mapped_size = 0;
+	std::string buf;
+	size_t chunk = 1 << 20;
+	size_t refills = 0;
+};
+
 struct StreamBase {
 	Settings* settings = nullptr;
 
@@ -47,7 +108,7 @@ struct StreamBase {
 
 	// Input functions
 	virtual fs::path get_tmpdir(std::string&) = 0;
-	virtual std::istream& get_block(std::istream&, std::string&, std::string&) = 0;
+	virtual bool get_block(StreamInput&, std::string&, std::string&) = 0;
 };
 
 struct ApertiumStream : StreamBase {
@@ -63,12 +124,59 @@ struct ApertiumStream : StreamBase {
 
 	// Input functions
 	fs::path get_tmpdir(std::string&);
-	std::istream& get_block(std::istream&, std::string&, std::string&);
+	bool get_block(StreamInput&, std::string&, std::string&);
 
 private:
-	std::vector<std::string> wbs;
+	void close_blank(std::string&, std::string&);
+
+	std::vector<std::string_view> wbs;
+	std::unordered_set<std::string_view> wbs_seen;
 	std::string wb;
 	std::string unesc;
+	// Where memchr() last found each byte that interrupts a run of text, for as long as the input generation stays the same
+	std::array<const char*, 4> stop_at{};
+	size_t stop_gen = SIZE_MAX;
+};
+
+// Length-prefixed frames for when our own tooling sits between extract and inject, so neither side needs to escape or scan text.
+// All integers are 32 bit little-endian. After the magic comes a header frame and then block frames, each a type byte, payload length, and payload:
+// H: state folder path
+// B: id length, id, body length, body, span count, spans, flags
+// Spans are kind (I for inline style, P for protected inline), begin and end offset into the body, how many spans were opened before this one closed, name length, and name.
+// Spans are in the order they were opened, and the close count orders markers that land on the same offset.
+// Protected inlines are points, so their begin and end are equal. Flag 1 means the block is a header.
+struct BinaryStream : ApertiumStream {
+	static constexpr std::string_view magic{ "\x7fTFB\x01", 5 };
+
+	BinaryStream(Settings* settings) : ApertiumStream(settings) {}
+
+	// Output functions
+	void stream_header(xmlString&, fs::path);
+	void block_open(xmlString&, xmlChar_view);
+	void block_body(xmlString&, xmlChar_view);
+	void block_term_header(xmlString&);
+	void block_close(xmlString&, xmlChar_view);
+
+	// Input functions
+	static bool get_header(StreamInput&, std::string&);
+	fs::path get_tmpdir(std::string&);
+	bool get_block(StreamInput&, std::string&, std::string&);
+
+private:
+	struct Span {
+		char kind = 0;
+		uint32_t begin = 0;
+		uint32_t end = 0;
+		uint32_t closed = 0;
+		std::string_view name;
+	};
+
+	size_t frame = 0;
+	char flags = 0;
+	std::string body;
+	std::vector<Span> spans;
+	std::vector<size_t> open;
+	std::vector<std::tuple<uint32_t, size_t, size_t>> events;
 };
 
 struct VISLStream : StreamBase {
@@ -84,17 +192,15 @@ struct VISLStream : StreamBase {
 
 	// Input functions
 	fs::path get_tmpdir(std::string&);
-	std::istream& get_block(std::istream&, std::string&, std::string&);
+	bool get_block(StreamInput&, std::string&, std::string&);
 
-protected:
-	std::string buffer;
 };
 
 struct CGStream : VISLStream {
 	CGStream(Settings* settings) : VISLStream(settings) {}
 
 	// Input functions
-	std::istream& get_block(std::istream&, std::string&, std::string&);
+	bool get_block(StreamInput&, std::string&, std::string&);
 };
 
 inline void utext_openUTF8(UText& ut, xmlChar_view xc) {
@@ -0,0 +1,43 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_TRANSFUSE_HOOK_H_
+#define e5bd51be_TRANSFUSE_HOOK_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interface for in-process hooks loaded with --hook-inject-plugin. A plugin is a shared object that exports
+ *
+ *   int transfuse_hook_inject(const char* format, const char* name, const char* data, size_t size, void* ctx, transfuse_hook_replace_t replace);
+ *
+ * It is called with the injected data before re-packaging, along with the document format (docx, html, ...) and the file name a --hook-inject program would have been given.
+ * To modify the data, call replace(ctx, new_data, new_size) before returning; the plugin keeps ownership of new_data. replace() returns 0 on success, and anything else if the data could not be taken,
+ * in which case injection is aborted whatever the plugin returns. Return 0 on success, anything else aborts injection.
+ */
+typedef int (*transfuse_hook_replace_t)(void* ctx, const char* data, size_t size);
+typedef int (*transfuse_hook_inject_t)(const char* format, const char* name, const char* data, size_t size, void* ctx, transfuse_hook_replace_t replace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
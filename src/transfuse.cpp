@@ -21,6 +21,8 @@
 #include "filesystem.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
+#include "dom.hpp"
+#include "memory.hpp"
 #include <unicode/uclean.h>
 #include <xxhash.h>
 #include <iostream>
@@ -33,8 +35,10 @@ using namespace icu;
 
 namespace Transfuse {
 
-void extract(Settings&);
-std::pair<fs::path, std::string> inject(Settings&);
+// With fused set, extraction hands everything to injection in memory instead of writing a state folder and stream
+void extract(Settings&, Fused* fused = nullptr);
+// Returns the state folder and the injected document
+std::pair<fs::path, std::string> inject(Settings&, Fused* fused = nullptr);
 
 std::istream* read_or_stdin(const char* arg, std::unique_ptr<std::istream>& in) {
 	if (arg[0] == '-' && arg[1] == 0) {
@@ -79,7 +83,7 @@ int main(int argc, char* argv[]) {
 		O('?',     "", "shows this help"),
 		spacer(),
 		O('f',  "format", ARG_REQ, "input file format: text, html, html-fragment, line, odt, odp, docx, pptx; defaults to auto"),
-		O('s',  "stream", ARG_REQ, "stream format: apertium, visl; defaults to apertium"),
+		O('s',  "stream", ARG_REQ, "stream format: apertium, visl, binary; defaults to apertium"),
 		O('m',    "mode", ARG_REQ, "operating mode: extract, inject, clean; default depends on executable used"),
 		O('d',     "dir", ARG_REQ, "folder to store state in (implies -k); defaults to creating temporary"),
 		O('k',    "keep",  ARG_NO, "don't delete temporary folder after injection"),
@@ -95,11 +99,22 @@ int main(int argc, char* argv[]) {
 		O(0,   "no-extend",  ARG_NO, "don't extend inline tags to surrounding alphanumerics"),
 		O(0,   "extract-more", ARG_NO, "extract non-whitespace content, as opposed to alphanumeric content"),
 		O(0,   "mangle-xml", ARG_NO, "mangle literal XML symbols < >"),
+		O(0,   "shards", ARG_REQ, "split the extracted stream into this many files of similar size, and output their paths instead; inject takes them in any order"),
+		O(0,   "dedupe", ARG_NO, "emit identical blocks only once in the stream; injection copies the translation to every occurrence"),
+		O(0,   "incremental", ARG_NO, "re-extract a changed document into an existing state folder, only emitting blocks that the previous injection didn't translate"),
+		O(0,   "cache", ARG_REQ, "translation cache file shared between documents; extraction omits blocks already in it, and injection fills them back in and adds new translations"),
+		O(0,   "cache-pair", ARG_REQ, "language pair or other identifier of the translation setup, kept separate within the cache file"),
+		O(0,   "bundle", ARG_NO, "store the state as the single file state.tfs, which is faster to inject from and simpler to move; bundled state does not record translations and can not be split with --shards"),
+		O(0,   "stream-zip", ARG_NO, "parse DOCX, PPTX and ODT straight from the decompressing archive instead of from a copy of each entry; uses less memory on large documents"),
+		O(0,   "max-memory", ARG_REQ, "memory budget such as 512M or 2G; documents projected to need more are refused, or switched to --stream-zip if that fits, and libxml and ICU are not allowed to allocate past it"),
+		O(0,   "no-arena", ARG_NO, "allocate what libxml needs with plain malloc instead of from a per-document arena; for memory debuggers"),
+		O(0,   "memory-stats", ARG_REQ, "write peak memory per phase to this file as tab-separated values; -v also prints them"),
 		spacer(),
-		text("Hook programs are called with a filename as first argument. After the hook exits, Transfuse reads the same filename and uses the contents as-is."),
+		text("Hook programs are called with a filename as first argument. After the hook exits, Transfuse reads the same filename and uses the contents as-is. Hook plugins are shared objects loaded once, whose transfuse_hook_inject() gets and may replace the data in memory, as declared in transfuse-hook.h."),
 		spacer(),
 		text("Hooks:"),
 		O(0,   "hook-inject", ARG_REQ, "program to modify injected data before re-packaging"),
+		O(0,   "hook-inject-plugin", ARG_REQ, "shared object to modify injected data in-process before re-packaging; runs before --hook-inject"),
 		spacer(),
 		text("Tags and attribute names that Transfuse uses for navigation and extraction. All are comma-separated lists. If + is listed then the list is appended to the default, otherwise it will override."),
 		spacer(),
@@ -180,6 +195,9 @@ int main(int argc, char* argv[]) {
 			else if (o->value == Streams::cg) {
 				settings.stream = Streams::cg;
 			}
+			else if (o->value == Streams::binary) {
+				settings.stream = Streams::binary;
+			}
 			break;
 		case 'm':
 			settings.mode = o->value;
@@ -216,6 +234,9 @@ int main(int argc, char* argv[]) {
 		else if (o->longopt == "hook-inject") {
 			settings.hook_inject = o->value;
 		}
+		else if (o->longopt == "hook-inject-plugin") {
+			settings.hook_inject_plugin = o->value;
+		}
 		else if (o->longopt == "no-extend") {
 			settings.opt_no_extend = true;
 		}
@@ -225,6 +246,43 @@ int main(int argc, char* argv[]) {
 		else if (o->longopt == "mangle-xml") {
 			settings.opt_mangle_xml = true;
 		}
+		else if (o->longopt == "shards") {
+			auto v = o->value;
+			settings.shards = 0;
+			if (!v.empty() && v.size() <= 9 && v.find_first_not_of("0123456789") == std::string_view::npos) {
+				settings.shards = std::stoul(std::string(v));
+			}
+			if (settings.shards == 0) {
+				throw std::runtime_error("--shards must be a positive integer");
+			}
+		}
+		else if (o->longopt == "dedupe") {
+			settings.opt_dedupe = true;
+		}
+		else if (o->longopt == "incremental") {
+			settings.opt_incremental = true;
+		}
+		else if (o->longopt == "bundle") {
+			settings.opt_bundle = true;
+		}
+		else if (o->longopt == "stream-zip") {
+			settings.opt_stream_zip = true;
+		}
+		else if (o->longopt == "max-memory") {
+			settings.max_memory = mem_parse(o->value);
+		}
+		else if (o->longopt == "no-arena") {
+			settings.opt_no_arena = true;
+		}
+		else if (o->longopt == "memory-stats") {
+			settings.memory_stats = fs::absolute(path(o->value));
+		}
+		else if (o->longopt == "cache") {
+			settings.cache = fs::absolute(path(o->value));
+		}
+		else if (o->longopt == "cache-pair") {
+			settings.cache_pair = o->value;
+		}
 		else if (o->longopt == "debug") {
 			settings.opt_debug = true;
 		}
@@ -245,8 +303,21 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	// The shards are read from the state folder after extraction, and a bundled state folder keeps nothing but the bundle
+	if (settings.shards > 1 && settings.opt_bundle) {
+		throw std::runtime_error("--shards can not be combined with --bundle");
+	}
+
 	// Funnel remaining unparsed arguments into input and/or output files
-	if (argc > 2) {
+	if (settings.mode == "inject" && argc > 3 && settings.infile.empty() && !settings.out) {
+		// Injection can take several stream shards, with the output file last
+		settings.infile = argv[1];
+		for (int i = 2; i < argc - 1; ++i) {
+			settings.infiles.push_back(argv[i]);
+		}
+		settings.out = write_or_stdout(argv[argc - 1], settings._out);
+	}
+	else if (argc > 2) {
 		if (settings.infile.empty() && !settings.out) {
 			settings.infile = argv[1];
 			settings.out = write_or_stdout(argv[2], settings._out);
@@ -273,6 +344,11 @@ int main(int argc, char* argv[]) {
 		settings.out = &std::cout;
 	}
 
+	// The allocation hooks must be in place before libxml or ICU allocate anything
+	if (settings.max_memory || !settings.memory_stats.empty()) {
+		mem_track(settings.max_memory);
+	}
+
 	UErrorCode status = U_ZERO_ERROR;
 	u_init(&status);
 	if (U_FAILURE(status) && status != U_FILE_ACCESS_ERROR) {
@@ -286,12 +362,28 @@ int main(int argc, char* argv[]) {
 			std::cerr << "Mode: clean" << std::endl;
 		}
 		// Extracts and immediately injects again - useful for cleaning documents for other CAT tools, such as OmegaT
-		extract(settings);
-		settings.in = read_or_stdin("extracted", settings._in);
-		auto rv = inject(settings);
-		std::ifstream data(rv.second, std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*settings.out) << data.rdbuf();
+		// Cached translations have no place in a cleaned document
+		settings.cache.clear();
+		std::pair<fs::path, std::string> rv;
+		// Unless something wants to see the state folder, the stream and skeleton go straight from extraction to injection in memory
+		bool fuse = !settings.opt_keep && !settings.opt_debug && !settings.opt_mark_headers && settings.tmpdir.empty() && settings.hook_inject.empty();
+		if (fuse) {
+			// One arena for both, since the parsed document goes from one to the other, and it must outlive the handover
+			MemArena arena(!settings.opt_no_arena);
+			Fused fused;
+			extract(settings, &fused);
+			rv = inject(settings, &fused);
+		}
+		else {
+			{
+				MemArena arena(!settings.opt_no_arena);
+				extract(settings);
+			}
+			settings.in = read_or_stdin("extracted", settings._in);
+			MemArena arena(!settings.opt_no_arena);
+			rv = inject(settings);
+		}
+		settings.out->write(rv.second.data(), SS(rv.second.size()));
 		settings.out->flush();
 		settings.tmpdir = rv.first;
 	}
@@ -299,27 +391,47 @@ int main(int argc, char* argv[]) {
 		if (settings.opt_verbose) {
 			std::cerr << "Mode: extract" << std::endl;
 		}
-		extract(settings);
-		std::ifstream data("extracted", std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*settings.out) << data.rdbuf();
+		{
+			MemArena arena(!settings.opt_no_arena);
+			extract(settings);
+		}
+		if (settings.shards > 1) {
+			for (size_t i = 1; i <= settings.shards; ++i) {
+				(*settings.out) << (fs::current_path() / concat("extracted.", std::to_string(i))).string() << '\n';
+			}
+		}
+		else {
+			std::ifstream data("extracted", std::ios::binary);
+			data.exceptions(std::ios::badbit | std::ios::failbit);
+			(*settings.out) << data.rdbuf();
+		}
 		settings.out->flush();
+		// A bundle is the whole state, so the stream copy only lives long enough to be output
+		if (settings.opt_bundle) {
+			fs::remove("extracted");
+			// Shards from an earlier extraction into the same folder
+			for (size_t i = 1; fs::remove(concat("extracted.", std::to_string(i))); ++i) {
+			}
+		}
 	}
 	else if (settings.mode == "inject") {
 		if (settings.opt_verbose) {
 			std::cerr << "Mode: inject" << std::endl;
 		}
 		settings.in = read_or_stdin(settings.infile, settings._in);
+		MemArena arena(!settings.opt_no_arena);
 		auto rv = inject(settings);
-		std::ifstream data(rv.second, std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*settings.out) << data.rdbuf();
+		settings.out->write(rv.second.data(), SS(rv.second.size()));
 		settings.out->flush();
 		settings.tmpdir = rv.first;
 	}
 
+	if (!settings.memory_stats.empty()) {
+		mem_save(settings.memory_stats);
+	}
+
 	// If neither --dir nor --keep, wipe the temporary folder
-	if (!settings.opt_keep && (settings.mode == "clean" || settings.mode == "inject")) {
+	if (!settings.opt_keep && !settings.tmpdir.empty() && (settings.mode == "clean" || settings.mode == "inject")) {
 		if (settings.opt_verbose) {
 			std::cerr << "Removing folder " << settings.tmpdir << std::endl;
 		}
@@ -114,6 +114,39 @@ inline auto xmlGetAttribute(xmlNodePtr node, xmlChar_view attr) {
 	return rv;
 }
 
+// Whether the node is an element that serializes as <prefix:name>, also if the prefix was not bound when it was parsed
+inline bool is_element(xmlNodePtr n, xmlChar_view prefix, xmlChar_view name) {
+	if (n->type != XML_ELEMENT_NODE) {
+		return false;
+	}
+	if (n->ns && n->ns->prefix) {
+		return xmlStrcmp(n->ns->prefix, prefix.data()) == 0 && xmlStrcmp(n->name, name.data()) == 0;
+	}
+	xmlChar_view qn(n->name);
+	return qn.size() == prefix.size() + 1 + name.size() && qn.compare(0, prefix.size(), prefix) == 0 && qn[prefix.size()] == ':' && qn.compare(prefix.size() + 1, name.size(), name) == 0;
+}
+
+// Same for an attribute, where an empty prefix means an attribute without one
+inline bool is_attr(xmlAttrPtr a, xmlChar_view prefix, xmlChar_view name) {
+	if (a->ns && a->ns->prefix) {
+		return xmlStrcmp(a->ns->prefix, prefix.data()) == 0 && xmlStrcmp(a->name, name.data()) == 0;
+	}
+	if (prefix.empty()) {
+		return xmlStrcmp(a->name, name.data()) == 0;
+	}
+	xmlChar_view qn(a->name);
+	return qn.size() == prefix.size() + 1 + name.size() && qn.compare(0, prefix.size(), prefix) == 0 && qn[prefix.size()] == ':' && qn.compare(prefix.size() + 1, name.size(), name) == 0;
+}
+
+inline xmlChar_view attr_value(xmlAttrPtr a) {
+	return (a->children && a->children->content) ? a->children->content : XCV("");
+}
+
+// Whether the element has neither attributes nor children, as in <name/>
+inline bool is_bare(xmlNodePtr n) {
+	return n->properties == nullptr && n->children == nullptr;
+}
+
 inline xmlNsPtr getNS(xmlNodePtr n) {
 	xmlNsPtr ns = nullptr;
 	if (n == reinterpret_cast<xmlNodePtr>(n->doc)) {
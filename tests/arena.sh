@@ -0,0 +1,9 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Plain malloc must give the same document as the per-document arena
+rm -rf "$5/arena-$3-$4" "arena-$3-$4.out" "arena-$3-$4.err"
+"$1" -v --no-arena -m clean -K -d "$5/arena-$3-$4" -s "$4" "$2/test.$3" "arena-$3-$4.out" 2>"arena-$3-$4.err"
+rm -rf "$5/arena-$3-$4"
+diff "$2/clean-$3-$4.expect" "arena-$3-$4.out"
@@ -0,0 +1,14 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/bundle-$3-$4" "bundle-$3-$4.tmp" "bundle-$3-$4.out" "bundle-$3-$4.err"
+"$1" -v -m extract -K --bundle -d "$5/bundle-$3-$4" -s "$4" "$2/test.$3" "bundle-$3-$4.tmp" 2>"bundle-$3-$4.err"
+
+# The bundle should be all that is left of the state
+if [[ "$(ls "$5/bundle-$3-$4")" != "state.tfs" ]]; then
+	exit 1
+fi
+"$1" -v -m inject -K -d "$5/bundle-$3-$4" "bundle-$3-$4.tmp" "bundle-$3-$4.out" 2>>"bundle-$3-$4.err"
+rm -rf "$5/bundle-$3-$4" "bundle-$3-$4.tmp"
+diff "$2/clean-$3-$4.expect" "bundle-$3-$4.out"
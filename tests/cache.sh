@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/cache-$3-$4" "$5/cache-$3-$4-again" "cache-$3-$4.tm" "cache-$3-$4.tmp" "cache-$3-$4.out" "cache-$3-$4.err"
+"$1" -v -m extract -K --cache "cache-$3-$4.tm" -d "$5/cache-$3-$4" -s "$4" "$2/test.$3" "cache-$3-$4.tmp" 2>"cache-$3-$4.err"
+"$1" -v -m inject -K -d "$5/cache-$3-$4" "cache-$3-$4.tmp" /dev/null 2>>"cache-$3-$4.err"
+
+# Second time around, every block should come from the cache and the stream should be only the header
+"$1" -v -m extract -K --cache "cache-$3-$4.tm" -d "$5/cache-$3-$4-again" -s "$4" "$2/test.$3" "cache-$3-$4.tmp" 2>>"cache-$3-$4.err"
+if tr -d '\000' < "cache-$3-$4.tmp" | grep -aEv '^\[transfuse:|^<STREAMCMD:TRANSFUSE:|^$'; then
+	exit 1
+fi
+"$1" -v -m inject -K -d "$5/cache-$3-$4-again" "cache-$3-$4.tmp" "cache-$3-$4.out" 2>>"cache-$3-$4.err"
+rm -rf "$5/cache-$3-$4" "$5/cache-$3-$4-again" "cache-$3-$4.tm" "cache-$3-$4.tmp"
+diff "$2/clean-$3-$4.expect" "cache-$3-$4.out"
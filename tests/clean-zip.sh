@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# The archive itself depends on how libzip compresses, so the parts that injection rewrote are compared instead, byte for byte
+rm -rf "$5/clean-$3-$4" "clean-$3-$4.$3" "clean-$3-$4.out" "clean-$3-$4.err"
+"$1" -v -m clean -K -d "$5/clean-$3-$4" -s "$4" "$2/test.$3" "clean-$3-$4.$3" 2>"clean-$3-$4.err"
+rm -rf "$5/clean-$3-$4"
+unzip -p "clean-$3-$4.$3" "$6" > "clean-$3-$4.out"
+rm -f "clean-$3-$4.$3"
+diff "$2/clean-$3-$4.expect" "clean-$3-$4.out"
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Times extraction and injection of the test document repeated N and 4N times, less what a single copy takes, where linear growth then takes 4 times as long and quadratic 16 times
+bound=6
+copies="$7"
+base="$5/complexity-$3-$4"
+err="complexity-$3-$4.err"
+
+# Best of 3 in user plus system time, which is steadier than wall time on a busy machine, in milliseconds
+TIMEFORMAT="%3U %3S"
+best() {
+	local rv=0
+	for i in 1 2 3; do
+		local t=$( { time "$@" 2>>"$err"; } 2>&1 )
+		t=${t//[.,]/}
+		local u=$((10#${t% *} + 10#${t#* }))
+		if [[ $rv -eq 0 || $u -lt $rv ]]; then
+			rv=$u
+		fi
+	done
+	echo $rv
+}
+
+# A real regression grows too much every time, while a noisy timing rarely does so twice in a row
+for attempt in 1 2 3; do
+	rm -rf "$base"-* "$err"
+	declare -A took
+	for n in 1 $copies $((copies * 4)); do
+		"$6" "$3" $n "$2/test.$3" "$base-$n.$3"
+		took[extract-$n]=$(best "$1" -m extract -K -d "$base-$n" -s "$4" "$base-$n.$3" "$base-$n.stream")
+		took[inject-$n]=$(best "$1" -m inject -k -d "$base-$n" "$base-$n.stream" "$base-$n.out")
+	done
+	rm -rf "$base"-*
+
+	rv=0
+	for phase in extract inject; do
+		one=${took[$phase-1]}
+		a=$((${took[$phase-$copies]} - one))
+		b=$((${took[$phase-$((copies * 4))]} - one))
+		echo "$phase: $one ms for 1 copy, +$a ms for $copies copies, +$b ms for $((copies * 4)) copies"
+		if [[ $a -gt 0 && $b -gt $((a * bound)) ]]; then
+			echo "$phase grew more than $bound times for 4 times the input"
+			rv=1
+		fi
+	done
+	if [[ $rv -eq 0 ]]; then
+		break
+	fi
+done
+exit $rv
@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/dedupe-$3-$4" "$5/dedupe-$3-$4-all" "dedupe-$3-$4.tmp" "dedupe-$3-$4.all" "dedupe-$3-$4.out" "dedupe-$3-$4.err"
+"$1" -v -m extract -K -d "$5/dedupe-$3-$4-all" -s "$4" "$2/test.$3" "dedupe-$3-$4.all" 2>"dedupe-$3-$4.err"
+"$1" -v -m extract -K --dedupe -d "$5/dedupe-$3-$4" -s "$4" "$2/test.$3" "dedupe-$3-$4.tmp" 2>>"dedupe-$3-$4.err"
+
+# Each repeated block is in the stream only once
+if [[ $(grep -ac 'repeated' "dedupe-$3-$4.all") -le $(grep -ac 'repeated' "dedupe-$3-$4.tmp") ]]; then
+	exit 1
+fi
+if [[ $(grep -a 'repeated' "dedupe-$3-$4.tmp" | sort | uniq -d | wc -l) -ne 0 ]]; then
+	exit 1
+fi
+
+# Left untranslated, the document comes back whole
+"$1" -v -m inject -d "$5/dedupe-$3-$4" "dedupe-$3-$4.tmp" "dedupe-$3-$4.out" 2>>"dedupe-$3-$4.err"
+diff "$2/clean-$3-$4.expect" "dedupe-$3-$4.out"
+
+# A translation of the one block that was emitted fills in every place it was left out of
+sed -i 's/repeated/gjentatt/g' "dedupe-$3-$4.tmp"
+"$1" -v -m inject -K -d "$5/dedupe-$3-$4" "dedupe-$3-$4.tmp" "dedupe-$3-$4.out" 2>>"dedupe-$3-$4.err"
+rm -rf "$5/dedupe-$3-$4" "$5/dedupe-$3-$4-all" "dedupe-$3-$4.tmp" "dedupe-$3-$4.all"
+diff <(sed 's/repeated/gjentatt/g' "$2/clean-$3-$4.expect") "dedupe-$3-$4.out"
@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Without --dir or --keep, clean mode must give the same document and leave nothing behind in the temporary folder
+rm -rf "$5/fused-$3-$4" "$5/unfused-$3-$4" "fused-$3-$4.out" "fused-$3-$4.err" "unfused-$3-$4.out" "unfused-$3-$4.err"
+mkdir -p "$5/fused-$3-$4"
+TMPDIR="$5/fused-$3-$4" "$1" -v -m clean -s "$4" "$2/test.$3" "fused-$3-$4.out" 2>"fused-$3-$4.err"
+rmdir "$5/fused-$3-$4"
+diff "$2/clean-$3-$4.expect" "fused-$3-$4.out"
+
+# The same as a round trip through a state folder, which the fused path must not be able to tell apart from
+"$1" -v -m clean -K -d "$5/unfused-$3-$4" -s "$4" "$2/test.$3" "unfused-$3-$4.out" 2>"unfused-$3-$4.err"
+rm -rf "$5/unfused-$3-$4"
+diff "unfused-$3-$4.out" "fused-$3-$4.out"
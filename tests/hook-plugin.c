@@ -0,0 +1,43 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transfuse-hook.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#define EXPORT __declspec(dllexport)
+#else
+	#define EXPORT
+#endif
+
+/* Does the same as the hook program `sed -i s/e/E/g` */
+EXPORT int transfuse_hook_inject(const char* format, const char* name, const char* data, size_t size, void* ctx, transfuse_hook_replace_t replace) {
+	char* buf = malloc(size + 1);
+	if (buf == NULL || format == NULL || name == NULL) {
+		return 1;
+	}
+	memcpy(buf, data, size);
+	for (size_t i = 0; i < size; ++i) {
+		if (buf[i] == 'e') {
+			buf[i] = 'E';
+		}
+	}
+	int rv = replace(ctx, buf, size);
+	free(buf);
+	return rv;
+}
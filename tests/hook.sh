@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/hook-$3-$4" "hook-$3-$4".*
+sed 's/e/E/g' "$2/clean-$3-$4.expect" > "hook-$3-$4.expect"
+
+# The plugin and the program each make the same change, and running both is then a no-op for the latter
+"$1" -v -m clean -K -d "$5/hook-$3-$4" -s "$4" --hook-inject-plugin "$6" "$2/test.$3" "hook-$3-$4.plugin" 2>"hook-$3-$4.err"
+"$1" -v -m clean -K -d "$5/hook-$3-$4" -s "$4" --hook-inject "sed -i s/e/E/g" "$2/test.$3" "hook-$3-$4.program" 2>>"hook-$3-$4.err"
+"$1" -v -m clean -K -d "$5/hook-$3-$4" -s "$4" --hook-inject-plugin "$6" --hook-inject "sed -i s/e/E/g" "$2/test.$3" "hook-$3-$4.both" 2>>"hook-$3-$4.err"
+rm -rf "$5/hook-$3-$4"
+diff "hook-$3-$4.expect" "hook-$3-$4.plugin"
+diff "hook-$3-$4.expect" "hook-$3-$4.program"
+diff "hook-$3-$4.expect" "hook-$3-$4.both"
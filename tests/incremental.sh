@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/incremental-$3-$4" "incremental-$3-$4.tmp" "incremental-$3-$4.out" "incremental-$3-$4.err"
+"$1" -v -m extract -K -d "$5/incremental-$3-$4" -s "$4" "$2/test.$3" "incremental-$3-$4.tmp" 2>"incremental-$3-$4.err"
+"$1" -v -m inject -d "$5/incremental-$3-$4" "incremental-$3-$4.tmp" /dev/null 2>>"incremental-$3-$4.err"
+
+# Nothing changed, so every block should be reused and the stream should be only the header
+"$1" -v -m extract --incremental -d "$5/incremental-$3-$4" -s "$4" "$2/test.$3" "incremental-$3-$4.tmp" 2>>"incremental-$3-$4.err"
+if tr -d '\000' < "incremental-$3-$4.tmp" | grep -aEv '^\[transfuse:|^<STREAMCMD:TRANSFUSE:|^$'; then
+	exit 1
+fi
+"$1" -v -m inject -K -d "$5/incremental-$3-$4" "incremental-$3-$4.tmp" "incremental-$3-$4.out" 2>>"incremental-$3-$4.err"
+rm -rf "$5/incremental-$3-$4" "incremental-$3-$4.tmp"
+diff "$2/clean-$3-$4.expect" "incremental-$3-$4.out"
@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Memory statistics are written per phase, and tracking them must not change what is extracted
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp" "memory-$3-$4.out" "memory-$3-$4.err" "memory-$3-$4.tsv"
+"$1" --memory-stats "memory-$3-$4.tsv" -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp"
+head -n 1 "memory-$3-$4.tsv" | grep -q "^phase	rss	rss_growth	heap	heap_libxml	heap_icu$"
+cut -f 1 "memory-$3-$4.tsv" | tail -n +2 | tr '\n' ' ' | grep -q "^extract-parse extract-blocks extract-save $"
+cat "memory-$3-$4.tmp" | grep -aEv '^\[transfuse:' | grep -aEv '^<STREAMCMD:TRANSFUSE:' > "memory-$3-$4.out"
+diff "$2/extract-$3-$4.expect" "memory-$3-$4.out"
+
+# The budgets below are set from the projections with and without the streaming parser, so they follow any retuning of the projection
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp"
+"$1" -v --max-memory 1G -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp" 2>"memory-$3-$4.err"
+full=$(sed -n 's/^Projected peak memory: .* (\([0-9]*\) bytes)$/\1/p' "memory-$3-$4.err")
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp"
+"$1" -v --max-memory 1G --stream-zip -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp" 2>"memory-$3-$4.err"
+streamed=$(sed -n 's/^Projected peak memory: .* (\([0-9]*\) bytes)$/\1/p' "memory-$3-$4.err")
+if [[ -z "$full" || -z "$streamed" || "$streamed" -ge "$full" ]]; then
+	exit 1
+fi
+
+# A budget that the normal parser fits within is left alone
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp"
+"$1" -v --max-memory "$full" -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp" 2>"memory-$3-$4.err"
+if grep -q "Using --stream-zip" "memory-$3-$4.err"; then
+	exit 1
+fi
+
+# A budget that only the streaming parser fits within switches to it
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp"
+"$1" -v --max-memory "$(( (streamed + full) / 2 ))" -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp" 2>"memory-$3-$4.err"
+grep -q "Using --stream-zip" "memory-$3-$4.err"
+cat "memory-$3-$4.tmp" | grep -aEv '^\[transfuse:' | grep -aEv '^<STREAMCMD:TRANSFUSE:' > "memory-$3-$4.out"
+diff "$2/extract-$3-$4.expect" "memory-$3-$4.out"
+
+# A budget that nothing fits within is refused up front
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp"
+if "$1" --max-memory "$(( streamed - 1 ))" -m extract -K -d "memory-$3-$4" -s "$4" "$2/test.$3" "memory-$3-$4.tmp" 2>"memory-$3-$4.err"; then
+	exit 1
+fi
+grep -q "exceeds --max-memory" "memory-$3-$4.err"
+rm -rf "memory-$3-$4" "memory-$3-$4.tmp" "memory-$3-$4.tsv"
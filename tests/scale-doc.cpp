@@ -0,0 +1,136 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Makes a larger document out of a test document by repeating the body of it, for timing how phases scale with input size
+#include <zip.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Repeats what lies between the end of the first tag starting with open and the start of the last occurrence of close
+std::string repeat(const std::string& data, std::string_view open, std::string_view close, size_t copies) {
+	size_t b = 0;
+	size_t e = data.size();
+	if (!open.empty()) {
+		b = data.find(open);
+		if (b == std::string::npos) {
+			throw std::runtime_error(std::string("Could not find ").append(open));
+		}
+		b = data.find('>', b) + 1;
+	}
+	if (!close.empty()) {
+		e = data.rfind(close);
+		if (e == std::string::npos || e < b) {
+			throw std::runtime_error(std::string("Could not find ").append(close));
+		}
+	}
+
+	std::string rv{ data.substr(0, b) };
+	for (size_t i = 0; i < copies; ++i) {
+		rv.append(data, b, e - b);
+	}
+	rv.append(data, e, std::string::npos);
+	return rv;
+}
+
+void repeat_entries(const char* out, std::string_view prefix, std::string_view open, std::string_view close, size_t copies) {
+	int err = 0;
+	auto zip = zip_open(out, 0, &err);
+	if (zip == nullptr) {
+		throw std::runtime_error(std::string("Could not open ").append(out));
+	}
+
+	std::vector<std::pair<std::string, std::string>> entries;
+	auto n = zip_get_num_entries(zip, 0);
+	for (zip_int64_t i = 0; i < n; ++i) {
+		std::string_view name{ zip_get_name(zip, static_cast<zip_uint64_t>(i), 0) };
+		if (name.substr(0, prefix.size()) != prefix) {
+			continue;
+		}
+		zip_stat_t stat{};
+		zip_stat_index(zip, static_cast<zip_uint64_t>(i), 0, &stat);
+		std::string data(stat.size, 0);
+		auto zf = zip_fopen_index(zip, stat.index, 0);
+		zip_fread(zf, &data[0], stat.size);
+		zip_fclose(zf);
+		entries.emplace_back(name, repeat(data, open, close, copies));
+	}
+
+	for (auto& entry : entries) {
+		auto src = zip_source_buffer(zip, entry.second.data(), entry.second.size(), 0);
+		if (src == nullptr || zip_file_add(zip, entry.first.c_str(), src, ZIP_FL_OVERWRITE) < 0) {
+			throw std::runtime_error("Could not replace " + entry.first);
+		}
+	}
+	if (zip_close(zip) < 0) {
+		throw std::runtime_error(std::string("Could not write ").append(out));
+	}
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 5) {
+		std::cerr << "Usage: scale-doc <format> <copies> <input> <output>" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string_view format{ argv[1] };
+	auto copies = std::stoul(argv[2]);
+
+	try {
+		std::ifstream in(argv[3], std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		auto data = ss.str();
+
+		if (format == "docx" || format == "pptx" || format == "odt") {
+			std::ofstream(argv[4], std::ios::binary) << data;
+			if (format == "docx") {
+				repeat_entries(argv[4], "word/document.xml", "<w:body", "<w:sectPr", copies);
+			}
+			else if (format == "pptx") {
+				repeat_entries(argv[4], "ppt/slides/slide", "<p:spTree", "</p:spTree>", copies);
+			}
+			else {
+				repeat_entries(argv[4], "content.xml", "<office:text", "</office:text>", copies);
+			}
+			return EXIT_SUCCESS;
+		}
+
+		if (format == "html" || format == "html-protect") {
+			data = repeat(data, "<body", "</body>", copies);
+		}
+		else {
+			data = repeat(data, "", "", copies);
+		}
+		std::ofstream(argv[4], std::ios::binary) << data;
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
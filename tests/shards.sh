@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+rm -rf "$5/shards-$3-$4" "shards-$3-$4.lst" "shards-$3-$4.out" "shards-$3-$4.err"
+"$1" -v -m extract -K --shards 3 -d "$5/shards-$3-$4" -s "$4" "$2/test.$3" "shards-$3-$4.lst" 2>"shards-$3-$4.err"
+
+# Shards may come back in any order
+"$1" -v -m inject -K -d "$5/shards-$3-$4" $(sort -r "shards-$3-$4.lst") "shards-$3-$4.out" 2>>"shards-$3-$4.err"
+rm -rf "$5/shards-$3-$4" "shards-$3-$4.lst"
+diff "$2/clean-$3-$4.expect" "shards-$3-$4.out"
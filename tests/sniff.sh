@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Without a file extension to go by, the format must be sniffed from the contents
+rm -rf "sniff-$3-$4" "sniff-$3-$4.doc" "sniff-$3-$4.tmp" "sniff-$3-$4.out" "sniff-$3-$4.err"
+cp "$2/test.$3" "sniff-$3-$4.doc"
+"$1" -v -m extract -K -d "sniff-$3-$4" -s "$4" "sniff-$3-$4.doc" "sniff-$3-$4.tmp" 2>"sniff-$3-$4.err"
+grep -aq '^Format sniffed by ' "sniff-$3-$4.err"
+cat "sniff-$3-$4.tmp" | grep -aEv '^\[transfuse:' | grep -aEv '^<STREAMCMD:TRANSFUSE:' > "sniff-$3-$4.out"
+rm -rf "sniff-$3-$4" "sniff-$3-$4.doc" "sniff-$3-$4.tmp"
+diff "$2/extract-$3-$4.expect" "sniff-$3-$4.out"
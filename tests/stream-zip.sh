@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+set -e
+set -o pipefail
+
+# Parsing straight from the archive must extract exactly what parsing a copy of the entry does
+rm -rf "stream-zip-$3-$4" "stream-zip-$3-$4.tmp" "stream-zip-$3-$4.out" "stream-zip-$3-$4.err"
+"$1" -v --stream-zip -m extract -K -d "stream-zip-$3-$4" -s "$4" "$2/test.$3" "stream-zip-$3-$4.tmp" 2>"stream-zip-$3-$4.err"
+cat "stream-zip-$3-$4.tmp" | grep -aEv '^\[transfuse:' | grep -aEv '^<STREAMCMD:TRANSFUSE:' > "stream-zip-$3-$4.out"
+rm -rf "stream-zip-$3-$4" "stream-zip-$3-$4.tmp"
+diff "$2/extract-$3-$4.expect" "stream-zip-$3-$4.out"